@@ -24,6 +24,8 @@
 #include <sys/types.h> /* get mode_t (mingw with gcc 4.6) */
 #include <sys/stat.h> /* struct stat redirection */
 #define AT_SYMLINK_NOFOLLOW 0x100
+/* There are no symlinks to follow on Windows. */
+#define O_NOFOLLOW 0
 
 struct stat;
 
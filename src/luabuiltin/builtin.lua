@@ -168,3 +168,52 @@ tup_append_assignment = function(a, b)
 	end
 	return result
 end
+
+-- The parser keeps Lua states around and reuses them for other Tupfiles, so
+-- we return a function that gives the state a new global table for each one.
+-- Nothing a Tupfile does can reach the tables saved here. The libraries
+-- (tup, string, etc) get new copies as well, since they only hold functions
+-- and plain values. The functions above see the new table through _ENV, just
+-- like the Tupfile does.
+local G = _G
+local pairs, type, next, rawset = pairs, type, next, rawset
+local saved_globals = {}
+local string_meta = getmetatable('')
+
+for k, v in pairs(G) do
+	if v ~= G then
+		if type(v) == 'table' then
+			local copy = {}
+			for k2, v2 in pairs(v) do
+				copy[k2] = v2
+			end
+			v = copy
+		end
+		saved_globals[k] = v
+	end
+end
+
+return function()
+	local env = {}
+	for k, v in pairs(saved_globals) do
+		if type(v) == 'table' then
+			local copy = {}
+			for k2, v2 in pairs(v) do
+				copy[k2] = v2
+			end
+			v = copy
+		end
+		env[k] = v
+	end
+	env._G = env
+
+	-- Methods on strings come from the metatable shared by all strings,
+	-- so point it at this Tupfile's string table.
+	while next(string_meta) do
+		rawset(string_meta, next(string_meta), nil)
+	end
+	string_meta.__index = env.string
+
+	_ENV = env
+	return env
+end
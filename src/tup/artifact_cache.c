@@ -0,0 +1,651 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#define _ATFILE_SOURCE
+#include "artifact_cache.h"
+#include "file.h"
+#include "environ.h"
+#include "option.h"
+#include "config.h"
+#include "fslurp.h"
+#include "compat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* The cache is a plain directory tree so that it can be shared between
+ * machines over NFS. Each command is keyed on its directory, expanded command
+ * string, environment and output paths. Since the full set of files a command
+ * reads is only known after it runs, a key can have several entries - one for
+ * each distinct set of input contents:
+ *
+ *   <cache>/<key[0:2]>/<key>/<result>/deps - "<hash> <path>" for each input
+ *   <cache>/<key[0:2]>/<key>/<result>/o0.. - the outputs, in sorted order
+ *
+ * where <result> is the hash of the deps file. Entries are written to a
+ * temporary directory and renamed into place, so readers never see a partial
+ * entry. An input that was missing (ie: a ghost) has a hash of "-", and a
+ * directory is hashed by its sorted list of entry names, leaving out the
+ * command's own outputs since those are what the entry restores.
+ */
+#define ARTIFACT_VERSION "tup-artifact-2"
+#define ABSENT_HASH "-"
+
+static int cache_dfd = -1;
+static int tmp_counter = 0;
+static pthread_mutex_t tmp_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int artifact_cache_init(void)
+{
+	const char *dir;
+
+	dir = tup_option_get_string("updater.artifact_cache");
+	if(!dir || !dir[0])
+		return 0;
+	if(mkdirat(tup_top_fd(), dir, 0777) < 0 && errno != EEXIST) {
+		perror(dir);
+		fprintf(stderr, "tup error: Unable to create the artifact cache directory.\n");
+		return -1;
+	}
+	cache_dfd = openat(tup_top_fd(), dir, O_RDONLY | O_DIRECTORY);
+	if(cache_dfd < 0) {
+		perror(dir);
+		fprintf(stderr, "tup error: Unable to open the artifact cache directory.\n");
+		return -1;
+	}
+	return 0;
+}
+
+void artifact_cache_close(void)
+{
+	if(cache_dfd >= 0) {
+		close(cache_dfd);
+		cache_dfd = -1;
+	}
+}
+
+int artifact_cache_enabled(void)
+{
+	return cache_dfd >= 0;
+}
+
+int artifact_init(struct artifact *a, const char *dir)
+{
+	a->key[0] = 0;
+	a->outputs = NULL;
+	a->num_outputs = 0;
+	a->deps.s = NULL;
+	a->recorded = 0;
+	a->dir = strdup(dir);
+	if(!a->dir) {
+		perror("strdup");
+		return -1;
+	}
+	return 0;
+}
+
+int artifact_add_output(struct artifact *a, const char *path)
+{
+	char **tmp;
+
+	tmp = realloc(a->outputs, sizeof(*tmp) * (a->num_outputs + 1));
+	if(!tmp) {
+		perror("realloc");
+		return -1;
+	}
+	a->outputs = tmp;
+	a->outputs[a->num_outputs] = strdup(path);
+	if(!a->outputs[a->num_outputs]) {
+		perror("strdup");
+		return -1;
+	}
+	a->num_outputs++;
+	return 0;
+}
+
+int artifact_set_key(struct artifact *a, const char *cmd,
+		     const struct tup_env *env)
+{
+	struct tup_sha1 sha;
+	int x;
+
+	/* Commands without outputs have nothing to restore. */
+	if(!a->num_outputs)
+		return -1;
+	qsort(a->outputs, a->num_outputs, sizeof(*a->outputs), strcmp_p);
+
+	tup_sha1_init(&sha);
+	tup_sha1_update(&sha, ARTIFACT_VERSION, sizeof(ARTIFACT_VERSION));
+	tup_sha1_update(&sha, a->dir, strlen(a->dir) + 1);
+	tup_sha1_update(&sha, cmd, strlen(cmd) + 1);
+	tup_sha1_update(&sha, env->envblock, env->block_size);
+	for(x=0; x<a->num_outputs; x++)
+		tup_sha1_update(&sha, a->outputs[x], strlen(a->outputs[x]) + 1);
+	tup_sha1_final(&sha, a->key);
+	return 0;
+}
+
+static void key_dir(char *dest, int len, const struct artifact *a)
+{
+	snprintf(dest, len, "%.2s/%s", a->key, a->key);
+}
+
+static int is_output(struct artifact *a, const char *path)
+{
+	return bsearch(&path, a->outputs, a->num_outputs, sizeof(*a->outputs), strcmp_p) != NULL;
+}
+
+/* Hashes the sorted names in a directory, so a command that lists it (for
+ * example with a glob) only gets a cache hit if the same files are there.
+ */
+static int dir_hash(struct artifact *a, const char *path, char *hash)
+{
+	struct tup_sha1 sha;
+	struct dirent *ent;
+	char fullpath[PATH_MAX];
+	char **names = NULL;
+	int num_names = 0;
+	int rc = -1;
+	int dfd;
+	DIR *d;
+	int x;
+
+	dfd = openat(tup_top_fd(), path, O_RDONLY | O_DIRECTORY);
+	if(dfd < 0)
+		return -1;
+	d = fdopendir(dfd);
+	if(!d) {
+		close(dfd);
+		return -1;
+	}
+	while((ent = readdir(d)) != NULL) {
+		char **tmp;
+
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if(strcmp(path, ".") == 0) {
+			if(snprintf(fullpath, sizeof(fullpath), "%s", ent->d_name) >= (int)sizeof(fullpath))
+				goto out_free;
+		} else {
+			if(snprintf(fullpath, sizeof(fullpath), "%s/%s", path, ent->d_name) >= (int)sizeof(fullpath))
+				goto out_free;
+		}
+		if(is_output(a, fullpath))
+			continue;
+		tmp = realloc(names, sizeof(*tmp) * (num_names + 1));
+		if(!tmp)
+			goto out_free;
+		names = tmp;
+		names[num_names] = strdup(ent->d_name);
+		if(!names[num_names])
+			goto out_free;
+		num_names++;
+	}
+	qsort(names, num_names, sizeof(*names), strcmp_p);
+
+	tup_sha1_init(&sha);
+	for(x=0; x<num_names; x++)
+		tup_sha1_update(&sha, names[x], strlen(names[x]) + 1);
+	tup_sha1_final(&sha, hash);
+	rc = 0;
+
+out_free:
+	for(x=0; x<num_names; x++)
+		free(names[x]);
+	free(names);
+	closedir(d);
+	return rc;
+}
+
+/* Gets the hash of a file for the deps list, relative to the top of the tup
+ * hierarchy.
+ */
+static int dep_hash(struct artifact *a, const char *path, char *hash)
+{
+	struct stat st;
+
+	if(fstatat(tup_top_fd(), path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+		if(errno == ENOENT || errno == ENOTDIR) {
+			strcpy(hash, ABSENT_HASH);
+			return 0;
+		}
+		return -1;
+	}
+	if(S_ISDIR(st.st_mode))
+		return dir_hash(a, path, hash);
+	return hash_file(tup_top_fd(), path, hash);
+}
+
+/* Copies a regular file or symlink, keeping the file mode. */
+static int copy_file(int sfd, const char *src, int dfd, const char *dest)
+{
+	struct stat st;
+	char buf[65536];
+	int in, out;
+	int rc;
+
+	if(fstatat(sfd, src, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	if(S_ISLNK(st.st_mode)) {
+		rc = readlinkat(sfd, src, buf, sizeof(buf) - 1);
+		if(rc < 0)
+			return -1;
+		buf[rc] = 0;
+		return symlinkat(buf, dfd, dest);
+	}
+
+	in = openat(sfd, src, O_RDONLY);
+	if(in < 0)
+		return -1;
+	out = openat(dfd, dest, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(out < 0) {
+		close(in);
+		return -1;
+	}
+	while(1) {
+		rc = read(in, buf, sizeof(buf));
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			goto err_out;
+		}
+		if(rc == 0)
+			break;
+		if(write(out, buf, rc) != rc)
+			goto err_out;
+	}
+	if(fchmod(out, st.st_mode & 07777) < 0)
+		goto err_out;
+	close(in);
+	if(close(out) < 0) {
+		unlinkat(dfd, dest, 0);
+		return -1;
+	}
+	return 0;
+
+err_out:
+	close(in);
+	close(out);
+	unlinkat(dfd, dest, 0);
+	return -1;
+}
+
+/* Checks each "<hash> <path>" line in the deps file against the current tree.
+ * Returns 1 if they all match, 0 if not.
+ */
+static int deps_match(struct artifact *a, char *deps, int len)
+{
+	char *p = deps;
+	char *end = deps + len;
+	char hash[TUP_HASH_SIZE];
+
+	while(p < end) {
+		char *space;
+		char *nl;
+
+		nl = memchr(p, '\n', end - p);
+		if(!nl)
+			return 0;
+		*nl = 0;
+		space = strchr(p, ' ');
+		if(!space)
+			return 0;
+		*space = 0;
+		if(dep_hash(a, space + 1, hash) < 0)
+			return 0;
+		if(strcmp(p, hash) != 0)
+			return 0;
+		*space = ' ';
+		*nl = '\n';
+		p = nl + 1;
+	}
+	return 1;
+}
+
+static int add_mapping(struct file_info *finfo, const char *path)
+{
+	struct mapping *map;
+	char fileout[PATH_MAX];
+
+	if(snprintf(fileout, sizeof(fileout), "./%s", path) >= (int)sizeof(fileout))
+		return -1;
+	if(handle_file(ACCESS_WRITE, fileout, NULL, finfo) < 0)
+		return -1;
+	map = malloc(sizeof *map);
+	if(!map) {
+		perror("malloc");
+		return -1;
+	}
+	map->realname = strdup(fileout);
+	map->tmpname = strdup(fileout);
+	map->tent = NULL;
+	map->have_mtime = 0;
+	if(!map->realname || !map->tmpname) {
+		perror("strdup");
+		del_map(map);
+		return -1;
+	}
+	finfo_lock(finfo);
+	LIST_INSERT_HEAD(&finfo->mapping_list, map, list);
+	finfo_unlock(finfo);
+	return 0;
+}
+
+/* Fills in the file_info as if the command had run, so process_output() can
+ * save the dependencies and outputs just like it would for a real command.
+ */
+static int replay_deps(struct artifact *a, char *deps, int len,
+		       struct file_info *finfo)
+{
+	char *p = deps;
+	char *end = deps + len;
+	char filename[PATH_MAX];
+	int x;
+
+	while(p < end) {
+		char *space;
+		char *nl;
+
+		nl = memchr(p, '\n', end - p);
+		space = memchr(p, ' ', nl - p);
+		if(snprintf(filename, sizeof(filename), "./%.*s", (int)(nl - space - 1), space + 1) >= (int)sizeof(filename))
+			return -1;
+		if(handle_file(ACCESS_READ, filename, NULL, finfo) < 0)
+			return -1;
+		p = nl + 1;
+	}
+	for(x=0; x<a->num_outputs; x++) {
+		if(add_mapping(finfo, a->outputs[x]) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int restore_entry(struct artifact *a, int kfd, const char *result)
+{
+	char src[PATH_MAX];
+	int x;
+
+	for(x=0; x<a->num_outputs; x++) {
+		snprintf(src, sizeof(src), "%s/o%i", result, x);
+		if(copy_file(kfd, src, tup_top_fd(), a->outputs[x]) < 0)
+			goto err_unlink;
+	}
+	return 0;
+
+err_unlink:
+	for(x--; x>=0; x--) {
+		unlinkat(tup_top_fd(), a->outputs[x], 0);
+	}
+	return -1;
+}
+
+int artifact_restore(struct artifact *a, struct file_info *finfo)
+{
+	char path[PATH_MAX];
+	struct dirent *ent;
+	DIR *d;
+	int kfd;
+	int rc = 0;
+
+	key_dir(path, sizeof(path), a);
+	kfd = openat(cache_dfd, path, O_RDONLY | O_DIRECTORY);
+	if(kfd < 0)
+		return 0;
+	d = fdopendir(kfd);
+	if(!d) {
+		close(kfd);
+		return 0;
+	}
+	while((ent = readdir(d)) != NULL) {
+		struct buf b;
+		int fd;
+
+		if(strlen(ent->d_name) != TUP_HASH_SIZE - 1)
+			continue;
+		snprintf(path, sizeof(path), "%s/deps", ent->d_name);
+		fd = openat(kfd, path, O_RDONLY);
+		if(fd < 0)
+			continue;
+		if(fslurp(fd, &b) < 0) {
+			close(fd);
+			continue;
+		}
+		close(fd);
+		if(deps_match(a, b.s, b.len) && restore_entry(a, kfd, ent->d_name) == 0) {
+			if(replay_deps(a, b.s, b.len, finfo) < 0)
+				rc = -1;
+			else
+				rc = 1;
+		}
+		free(b.s);
+		if(rc)
+			break;
+	}
+	closedir(d);
+	return rc;
+}
+
+/* Turns the path elements from the server into a path relative to the top of
+ * the tup hierarchy. Returns -1 for files that tup doesn't track.
+ */
+static int pg_path(struct pel_group *pg, char *dest, int len)
+{
+	if(pg->pg_flags & (PG_HIDDEN | PG_OUTSIDE_TUP | PG_GROUP))
+		return -1;
+	if(snprint_pel_group(dest, len, pg) >= len)
+		return -1;
+	return 0;
+}
+
+void artifact_record(struct artifact *a, struct file_info *finfo)
+{
+	struct file_entry *fent;
+	char path[PATH_MAX];
+	char hash[TUP_HASH_SIZE];
+	char **paths = NULL;
+	int num_paths = 0;
+	int cacheable = 1;
+	int x;
+
+	finfo_lock(finfo);
+	/* If the command read an @-variable or removed a file, the cache
+	 * couldn't reproduce it.
+	 */
+	if(!LIST_EMPTY(&finfo->var_list) || !LIST_EMPTY(&finfo->unlink_list))
+		cacheable = 0;
+	LIST_FOREACH(fent, &finfo->write_list, list) {
+		if(fent->pg.pg_flags & PG_OUTSIDE_TUP)
+			continue;
+		if(pg_path(&fent->pg, path, sizeof(path)) < 0 || !is_output(a, path)) {
+			cacheable = 0;
+			break;
+		}
+	}
+	if(cacheable) {
+		LIST_FOREACH(fent, &finfo->read_list, list) {
+			char **tmp;
+
+			if(pg_path(&fent->pg, path, sizeof(path)) < 0)
+				continue;
+			if(is_output(a, path))
+				continue;
+			tmp = realloc(paths, sizeof(*tmp) * (num_paths + 1));
+			if(!tmp) {
+				cacheable = 0;
+				break;
+			}
+			paths = tmp;
+			paths[num_paths] = strdup(path);
+			if(!paths[num_paths]) {
+				cacheable = 0;
+				break;
+			}
+			num_paths++;
+		}
+	}
+	finfo_unlock(finfo);
+
+	if(!cacheable)
+		goto out_free;
+	qsort(paths, num_paths, sizeof(*paths), strcmp_p);
+	if(estring_init(&a->deps) < 0)
+		goto out_free;
+	for(x=0; x<num_paths; x++) {
+		if(dep_hash(a, paths[x], hash) < 0)
+			goto out_free;
+		if(estring_append(&a->deps, hash, strlen(hash)) < 0 ||
+		   estring_append(&a->deps, " ", 1) < 0 ||
+		   estring_append(&a->deps, paths[x], strlen(paths[x])) < 0 ||
+		   estring_append(&a->deps, "\n", 1) < 0)
+			goto out_free;
+	}
+	a->recorded = 1;
+
+out_free:
+	for(x=0; x<num_paths; x++)
+		free(paths[x]);
+	free(paths);
+}
+
+static int write_deps(int dfd, const char *path, struct estring *deps)
+{
+	int fd;
+
+	fd = openat(dfd, path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0)
+		return -1;
+	if(write(fd, deps->s, deps->len) != deps->len) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+static void remove_tmpdir(int kfd, const char *tmpdir, int num_outputs)
+{
+	char path[PATH_MAX];
+	int x;
+
+	for(x=0; x<num_outputs; x++) {
+		snprintf(path, sizeof(path), "%s/o%i", tmpdir, x);
+		unlinkat(kfd, path, 0);
+	}
+	snprintf(path, sizeof(path), "%s/deps", tmpdir);
+	unlinkat(kfd, path, 0);
+	unlinkat(kfd, tmpdir, AT_REMOVEDIR);
+}
+
+/* Failing to store an entry isn't an error - the command already succeeded,
+ * so we just warn and move on.
+ */
+void artifact_store(struct artifact *a)
+{
+	struct tup_sha1 sha;
+	char result[TUP_HASH_SIZE];
+	char host[64];
+	/* Big enough for "tmp.<host>.<pid>.<num>" */
+	char tmpdir[sizeof(host) + 32];
+	char path[PATH_MAX];
+	int kfd;
+	int num;
+	int x;
+
+	if(!a->recorded)
+		return;
+
+	tup_sha1_init(&sha);
+	tup_sha1_update(&sha, a->deps.s, a->deps.len);
+	tup_sha1_final(&sha, result);
+
+	snprintf(path, sizeof(path), "%.2s", a->key);
+	if(mkdirat(cache_dfd, path, 0777) < 0 && errno != EEXIST)
+		goto err_warn;
+	key_dir(path, sizeof(path), a);
+	if(mkdirat(cache_dfd, path, 0777) < 0 && errno != EEXIST)
+		goto err_warn;
+	kfd = openat(cache_dfd, path, O_RDONLY | O_DIRECTORY);
+	if(kfd < 0)
+		goto err_warn;
+
+	/* Someone else may have already stored this result. */
+	if(faccessat(kfd, result, F_OK, 0) == 0) {
+		close(kfd);
+		return;
+	}
+
+	if(gethostname(host, sizeof(host)) < 0)
+		strcpy(host, "localhost");
+	host[sizeof(host)-1] = 0;
+	pthread_mutex_lock(&tmp_lock);
+	num = tmp_counter++;
+	pthread_mutex_unlock(&tmp_lock);
+	snprintf(tmpdir, sizeof(tmpdir), "tmp.%s.%i.%i", host, (int)getpid(), num);
+
+	if(mkdirat(kfd, tmpdir, 0777) < 0)
+		goto err_close;
+	for(x=0; x<a->num_outputs; x++) {
+		snprintf(path, sizeof(path), "%s/o%i", tmpdir, x);
+		if(copy_file(tup_top_fd(), a->outputs[x], kfd, path) < 0)
+			goto err_remove;
+	}
+	snprintf(path, sizeof(path), "%s/deps", tmpdir);
+	if(write_deps(kfd, path, &a->deps) < 0)
+		goto err_remove;
+	if(renameat(kfd, tmpdir, kfd, result) < 0) {
+		/* Lost the race to another tup storing the same result. */
+		if(errno != EEXIST && errno != ENOTEMPTY)
+			goto err_remove;
+		remove_tmpdir(kfd, tmpdir, a->num_outputs);
+	}
+	close(kfd);
+	return;
+
+err_remove:
+	perror("artifact cache");
+	remove_tmpdir(kfd, tmpdir, a->num_outputs);
+	close(kfd);
+	fprintf(stderr, "tup warning: Unable to store the outputs of a command in the artifact cache.\n");
+	return;
+err_close:
+	close(kfd);
+err_warn:
+	perror("artifact cache");
+	fprintf(stderr, "tup warning: Unable to store the outputs of a command in the artifact cache.\n");
+}
+
+void artifact_free(struct artifact *a)
+{
+	int x;
+
+	for(x=0; x<a->num_outputs; x++)
+		free(a->outputs[x]);
+	free(a->outputs);
+	free(a->dir);
+	free(a->deps.s);
+}
@@ -0,0 +1,61 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#ifndef tup_artifact_cache_h
+#define tup_artifact_cache_h
+
+#include "hash.h"
+#include "estring.h"
+
+struct file_info;
+struct tup_env;
+
+/* The cache state for a single command. The directory and outputs are filled
+ * in from the graph, and the key is computed from those plus the expanded
+ * command string and environment. A command is looked up with
+ * artifact_restore() before it runs, and if it misses, the dependencies it
+ * read are saved with artifact_record() before process_output() consumes
+ * them, so that artifact_store() can put the outputs in the cache once the
+ * command succeeds.
+ */
+struct artifact {
+	char key[TUP_HASH_SIZE];
+	char *dir;
+	char **outputs;
+	int num_outputs;
+	struct estring deps;
+	int recorded;
+};
+
+int artifact_cache_init(void);
+void artifact_cache_close(void);
+int artifact_cache_enabled(void);
+
+int artifact_init(struct artifact *a, const char *dir);
+int artifact_add_output(struct artifact *a, const char *path);
+int artifact_set_key(struct artifact *a, const char *cmd,
+		     const struct tup_env *env);
+int artifact_restore(struct artifact *a, struct file_info *finfo);
+void artifact_record(struct artifact *a, struct file_info *finfo);
+void artifact_store(struct artifact *a);
+void artifact_free(struct artifact *a);
+
+#endif
@@ -52,6 +52,7 @@ int find_tup_dir(void)
 
 	tup_top_len = strlen(tup_wd);
 	tup_sub_len = 0;
+	tup_sub_dir_dt = -1;
 	while(1) {
 		if(stat(".tup", &st) == 0 && S_ISDIR(st.st_mode)) {
 			tup_wd_offset = tup_top_len;
@@ -138,7 +139,7 @@ int tup_top_fd(void)
 int display_output(int fd, int iserr, const char *name, int display_name, FILE *f)
 {
 	if(fd != -1) {
-		char buf[1024];
+		char buf[65536];
 		int rc;
 		int displayed = 0;
 		FILE *out = stdout;
@@ -172,7 +173,10 @@ int display_output(int fd, int iserr, const char *name, int display_name, FILE *
 					}
 				}
 			}
-			fprintf(out, "%.*s", rc, buf);
+			if(fwrite(buf, 1, rc, out) != (size_t)rc) {
+				perror("display_output: fwrite");
+				return -1;
+			}
 		}
 	}
 	return 0;
@@ -28,6 +28,7 @@
 #include "option.h"
 #include "variant.h"
 #include "config.h"
+#include "hash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,6 +38,9 @@
 #include <sys/stat.h>
 
 static int ghost_to_file(struct tup_entry *tent);
+static tupid_t file_mod(tupid_t dt, const char *file, time_t mtime,
+			int force, int ignore_generated, int *modified,
+			const char *hash);
 
 static void (*rmdir_callback)(tupid_t tupid);
 
@@ -93,6 +97,69 @@ tupid_t tup_file_mod(tupid_t dt, const char *file, int *modified)
 
 tupid_t tup_file_mod_mtime(tupid_t dt, const char *file, time_t mtime,
 			   int force, int ignore_generated, int *modified)
+{
+	return file_mod(dt, file, mtime, force, ignore_generated, modified, NULL);
+}
+
+tupid_t tup_file_mod_hash(tupid_t dt, const char *file, time_t mtime,
+			  const char *hash)
+{
+	return file_mod(dt, file, mtime, 0, 0, NULL, hash);
+}
+
+/* The monitor re-reads the options for every update, so this is read again
+ * each time instead of once per process.
+ */
+static int content_hash = 0;
+
+void tup_content_hash_init(void)
+{
+	content_hash = tup_option_get_flag("updater.content_hash");
+}
+
+int tup_content_hash_enabled(void)
+{
+	return content_hash;
+}
+
+/* Called for a normal file that looks like it changed. If updater.content_hash
+ * is enabled, the file is hashed (unless the caller already did it) and
+ * compared to the hash saved the last time it changed. If they match, only the
+ * mtime is updated and the file isn't considered modified. Files without a
+ * saved hash always count as modified. When content hashing is disabled, the
+ * hash is cleared so a stale one is never used if the option is turned on
+ * later.
+ */
+static int update_hash(struct tup_entry *tent, time_t mtime, int force,
+		       const char *hash, int *changed)
+{
+	char newhash[TUP_HASH_SIZE];
+	char oldhash[TUP_HASH_SIZE];
+	char path[PATH_MAX];
+
+	if(!tup_content_hash_enabled())
+		return tup_db_set_mtime_hash(tent, mtime, NULL);
+
+	if(!hash) {
+		snprint_tup_entry(path, sizeof(path), tent);
+		if(hash_file(tup_top_fd(), path + 1, newhash) < 0) {
+			/* Maybe it was removed or we can't read it - either
+			 * way just treat it as modified.
+			 */
+			return tup_db_set_mtime_hash(tent, mtime, NULL);
+		}
+		hash = newhash;
+	}
+	if(tup_db_get_hash(tent->tnode.tupid, oldhash) < 0)
+		return -1;
+	if(!force && oldhash[0] && strcmp(oldhash, hash) == 0)
+		*changed = 0;
+	return tup_db_set_mtime_hash(tent, mtime, hash);
+}
+
+static tupid_t file_mod(tupid_t dt, const char *file, time_t mtime,
+			int force, int ignore_generated, int *modified,
+			const char *hash)
 {
 	struct tup_entry *tent;
 	int new = 0;
@@ -145,6 +212,10 @@ tupid_t tup_file_mod_mtime(tupid_t dt, const char *file, time_t mtime,
 				}
 			}
 		}
+		if(changed && tent->type == TUP_NODE_FILE) {
+			if(update_hash(tent, mtime, force, hash, &changed) < 0)
+				return -1;
+		}
 		if(changed) {
 			if(tent->type == TUP_NODE_GENERATED) {
 				int tmp = 0;
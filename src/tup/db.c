@@ -27,6 +27,7 @@
 #include "config.h"
 #include "vardb.h"
 #include "fslurp.h"
+#include "hash.h"
 #include "entry.h"
 #include "graph.h"
 #include "version.h"
@@ -44,10 +45,11 @@
 #include <unistd.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include "sqlite3/sqlite3.h"
 
-#define DB_VERSION 16
+#define DB_VERSION 18
 #define PARSER_VERSION 12
 
 enum {
@@ -67,6 +69,8 @@ enum {
 	DB_SET_NAME,
 	DB_SET_TYPE,
 	DB_SET_MTIME,
+	DB_SET_MTIME_HASH,
+	DB_GET_HASH,
 	DB_SET_SRCID,
 	DB_PRINT,
 	DB_REBUILD_ALL,
@@ -137,6 +141,19 @@ enum {
 	_DB_GET_DB_VAR_TREE,
 	_DB_VAR_FLAG_DIRS,
 	_DB_DELETE_VAR_ENTRY,
+	DB_SET_CMD_STATS,
+	DB_GET_CMD_STATS,
+	DB_SHOW_CMD_STATS,
+	DB_SHOW_DIR_STATS,
+	_DB_DELETE_CMD_STATS,
+	DB_QUERY_DEPS,
+	DB_QUERY_STICKY_DEPS,
+	DB_QUERY_RDEPS,
+	DB_QUERY_STICKY_RDEPS,
+	DB_QUERY_PATH,
+	DB_QUERY_STICKY_PATH,
+	DB_QUERY_DIR_CMDS,
+	DB_QUERY_MAX_DEPTH,
 	DB_NUM_STATEMENTS
 };
 
@@ -162,6 +179,7 @@ static int sql_debug = 0;
 static int reclaim_ghost_debug = 0;
 static struct vardb envdb = { {NULL}, 0, NULL, NULL};
 static int transaction = 0;
+static int db_readonly = 0;
 static tupid_t local_slash_dt = -1;
 
 /* Simple counter to invalidate the tent->stickies field. If
@@ -196,7 +214,9 @@ static int get_db_var_tree(tupid_t dt, struct vardb *vdb);
 static int get_file_var_tree(struct vardb *vdb, int fd);
 static int var_flag_dirs(tupid_t tupid);
 static int delete_var_entry(tupid_t tupid);
+static int delete_cmd_stats(tupid_t tupid);
 static int no_sync(void);
+static int db_pragma(const char *sql);
 static int delete_node(tupid_t tupid);
 static int db_print(FILE *stream, tupid_t tupid);
 static int get_recurse_dirs(tupid_t dt, struct id_entry_head *head);
@@ -232,12 +252,13 @@ static int msqlite3_reset(sqlite3_stmt *stmt)
 	return sqlite3_reset(stmt);
 }
 
-static int db_open(void)
+static int db_open(int flags)
 {
 	int x;
 	int db_sync;
+	int db_wal;
 
-	if(sqlite3_open_v2(TUP_DB_FILE, &tup_db, SQLITE_OPEN_READWRITE, NULL) != 0) {
+	if(sqlite3_open_v2(TUP_DB_FILE, &tup_db, flags, NULL) != 0) {
 		fprintf(stderr, "Unable to open database: %s\n",
 			sqlite3_errmsg(tup_db));
 		return -1;
@@ -246,16 +267,40 @@ static int db_open(void)
 		stmts[x] = NULL;
 	}
 
-	db_sync = tup_option_get_flag("db.sync");
-	if(db_sync == 0)
-		if(no_sync() < 0)
+	db_wal = tup_option_get_flag("db.wal");
+	if(flags & SQLITE_OPEN_READONLY) {
+		/* A read-only connection never changes the journal mode -
+		 * the writer that set up WAL mode is still running.
+		 */
+		db_readonly = 1;
+		sqlite3_busy_timeout(tup_db, 5000);
+	} else {
+		if(db_pragma(db_wal ? "PRAGMA journal_mode=WAL" : "PRAGMA journal_mode=DELETE") < 0)
+			return -1;
+		db_sync = tup_option_get_flag("db.sync");
+		if(db_sync == 0) {
+			if(no_sync() < 0)
+				return -1;
+		} else if(db_wal) {
+			/* In WAL mode NORMAL only syncs at checkpoints, and
+			 * the database still can't be corrupted by a crash.
+			 */
+			if(db_pragma("PRAGMA synchronous=NORMAL") < 0)
+				return -1;
+		}
+	}
+	if(db_wal) {
+		if(db_pragma("PRAGMA cache_size=-65536") < 0)
+			return -1;
+		if(db_pragma("PRAGMA mmap_size=268435456") < 0)
 			return -1;
+	}
 	return 0;
 }
 
 int tup_db_open(void)
 {
-	if(db_open() < 0)
+	if(db_open(SQLITE_OPEN_READWRITE) < 0)
 		return -1;
 	if(tup_db_begin() < 0)
 		return -1;
@@ -266,6 +311,33 @@ int tup_db_open(void)
 	return 0;
 }
 
+int tup_db_open_readonly(void)
+{
+	int version;
+
+	if(db_open(SQLITE_OPEN_READONLY) < 0)
+		return -1;
+	/* The version can't be upgraded from here, so it has to match
+	 * already.
+	 */
+	if(tup_db_begin() < 0)
+		return -1;
+	if(tup_db_config_get_int("db_version", -1, &version) < 0)
+		return -1;
+	if(tup_db_commit() < 0)
+		return -1;
+	if(version != DB_VERSION) {
+		fprintf(stderr, "tup error: database is version %i, but this version of tup (%s) expects %i. Run 'tup upd' after the current update finishes to convert it.\n", version, tup_version(), DB_VERSION);
+		return -1;
+	}
+	return 0;
+}
+
+int tup_db_readonly(void)
+{
+	return db_readonly;
+}
+
 int tup_db_close(void)
 {
 	int x;
@@ -289,7 +361,7 @@ int tup_db_create(int db_sync, int memory_db)
 	int x;
 	const char *dbname;
 	const char *sql[] = {
-		"create table node (id integer primary key not null, dir integer not null, type integer not null, mtime integer not null, srcid integer not null, name varchar(4096), unique(dir, name))",
+		"create table node (id integer primary key not null, dir integer not null, type integer not null, mtime integer not null, srcid integer not null, name varchar(4096), hash varchar(40), unique(dir, name))",
 		"create table normal_link (from_id integer, to_id integer, unique(from_id, to_id))",
 		"create table sticky_link (from_id integer, to_id integer, unique(from_id, to_id))",
 		"create table group_link (from_id integer, to_id integer, cmdid integer, unique(from_id, to_id, cmdid))",
@@ -299,12 +371,13 @@ int tup_db_create(int db_sync, int memory_db)
 		"create table create_list (id integer primary key not null)",
 		"create table modify_list (id integer primary key not null)",
 		"create table variant_list (id integer primary key not null)",
+		"create table cmd_stats (id integer primary key not null, wall integer not null, cpu integer not null, rss integer not null)",
 		"create index normal_index2 on normal_link(to_id)",
 		"create index sticky_index2 on sticky_link(to_id)",
 		"create index group_index2 on group_link(cmdid)",
 		"create index srcid_index on node(srcid)",
 		"insert into config values('db_version', 0)",
-		"insert into node values(1, 0, 2, -1, -1, '.')",
+		"insert into node values(1, 0, 2, -1, -1, '.', null)",
 	};
 
 	if(memory_db) {
@@ -399,7 +472,7 @@ static int db_backup(int version)
 		return -1;
 	}
 	printf("Old tup database backed up as '%s'\n", backup);
-	if(db_open() < 0)
+	if(db_open(SQLITE_OPEN_READWRITE) < 0)
 		return -1;
 	if(tup_db_begin() < 0)
 		return -1;
@@ -507,6 +580,10 @@ static int version_check(void)
 	char sql_15a[] = "create index srcid_index on node(srcid)";
 	char sql_15b[] = "update node set srcid=dir where type=4";
 
+	char sql_16a[] = "alter table node add column hash varchar(40) default null";
+
+	char sql_17a[] = "create table cmd_stats (id integer primary key not null, wall integer not null, cpu integer not null, rss integer not null)";
+
 	char *tmpsql;
 	struct tup_entry *vartent;
 	int x;
@@ -851,6 +928,26 @@ static int version_check(void)
 				return -1;
 			printf("NOTE: Tup database updated to version 16.\nAdded an index for node.srcid\n");
 
+		case 16:
+			if(sqlite3_exec(tup_db, sql_16a, NULL, NULL, &errmsg) != 0) {
+				fprintf(stderr, "SQL error: %s\nQuery was: %s\n",
+					errmsg, sql_16a);
+				return -1;
+			}
+			if(tup_db_config_set_int("db_version", 17) < 0)
+				return -1;
+			printf("NOTE: Tup database updated to version 17.\nAdded a hash column to the node table for the updater.content_hash option.\n");
+
+		case 17:
+			if(sqlite3_exec(tup_db, sql_17a, NULL, NULL, &errmsg) != 0) {
+				fprintf(stderr, "SQL error: %s\nQuery was: %s\n",
+					errmsg, sql_17a);
+				return -1;
+			}
+			if(tup_db_config_set_int("db_version", 18) < 0)
+				return -1;
+			printf("NOTE: Tup database updated to version 18.\nAdded a cmd_stats table to keep the runtime history of each command.\n");
+
 			/***************************************/
 			/* Last case must fall through to here */
 			if(tup_db_commit() < 0)
@@ -913,15 +1010,12 @@ int tup_db_begin(void)
 	return 0;
 }
 
-int tup_db_commit(void)
+static int db_commit(void)
 {
 	int rc;
 	sqlite3_stmt **stmt = &stmts[DB_COMMIT];
 	static char s[] = "commit";
 
-	if(reclaim_ghosts() < 0)
-		return -1;
-
 	transaction_check("%s", s);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
@@ -946,6 +1040,27 @@ int tup_db_commit(void)
 	return 0;
 }
 
+int tup_db_commit(void)
+{
+	/* A read-only snapshot must never write, and anything it would
+	 * reclaim is left for the process that is updating the database.
+	 */
+	if(!db_readonly) {
+		if(reclaim_ghosts() < 0)
+			return -1;
+	}
+	return db_commit();
+}
+
+int tup_db_commit_batch(void)
+{
+	/* Jobs that are still running may have tup_entrys for ghosts that are
+	 * about to be reclaimed, so that waits for the final commit. The
+	 * ghost_list is kept until then.
+	 */
+	return db_commit();
+}
+
 /* This counts the database changes that are "expected" during refactoring,
  * such as adding/removing directory level dependencies, or removing the
  * create flag.
@@ -982,9 +1097,15 @@ int tup_db_rollback(void)
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
+	transaction = 0;
 	return 0;
 }
 
+int tup_db_in_transaction(void)
+{
+	return transaction;
+}
+
 static const char *check_flags_name;
 static int check_flags_cb(void *arg, int argc, char **argv, char **col)
 {
@@ -1265,13 +1386,8 @@ int tup_db_fill_tup_entry(tupid_t tupid, struct tup_entry *tent)
 	tent->srcid = sqlite3_column_int64(*stmt, 3);
 	name = (const char*)sqlite3_column_text(*stmt, 4);
 	len = strlen(name);
-	tent->name.s = malloc(len + 1);
-	if(!tent->name.s) {
-		perror("malloc");
+	if(tup_entry_set_name(tent, name, len) < 0)
 		goto out_reset;
-	}
-	strcpy(tent->name.s, name);
-	tent->name.len = len;
 	rc = 0;
 
 out_reset:
@@ -1624,7 +1740,16 @@ int delete_node(tupid_t tupid)
 	int rc;
 	sqlite3_stmt **stmt = &stmts[DB_DELETE_NODE];
 	static char s[] = "delete from node where id=?";
+	struct tup_entry *tent;
 
+	/* Commands can be removed without ever being read in, so we don't
+	 * always know the type here.
+	 */
+	tent = tup_entry_find(tupid);
+	if(!tent || tent->type == TUP_NODE_CMD) {
+		if(delete_cmd_stats(tupid) < 0)
+			return -1;
+	}
 	if(tup_entry_rm(tupid) < 0) {
 		return -1;
 	}
@@ -2249,6 +2374,127 @@ int tup_db_set_mtime(struct tup_entry *tent, time_t mtime)
 	return 0;
 }
 
+/* Saves the mtimes of a command's outputs from write_files(). This is still
+ * one update per changed output. It is only cheap because the updater runs it
+ * inside its transaction (the whole update, or each batch with
+ * updater.commit_jobs), so nothing is synced to disk until that commits.
+ */
+int tup_db_set_output_mtimes(struct mapping_head *mapping_list)
+{
+	struct mapping *map;
+
+	LIST_FOREACH(map, mapping_list, list) {
+		/* tent may not be set (in the case of hidden files) */
+		if(!map->tent || !map->have_mtime)
+			continue;
+		if(map->tent->mtime == map->mtime)
+			continue;
+		if(tup_db_set_mtime(map->tent, map->mtime) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+int tup_db_set_mtime_hash(struct tup_entry *tent, time_t mtime, const char *hash)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_SET_MTIME_HASH];
+	static char s[] = "update node set mtime=?, hash=? where id=?";
+
+	transaction_check("%s [37m[%li, '%s', %lli][0m", s, mtime, hash ? hash : "(null)", tent->tnode.tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, mtime) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(hash) {
+		if(sqlite3_bind_text(*stmt, 2, hash, -1, SQLITE_STATIC) != 0) {
+			fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	} else {
+		if(sqlite3_bind_null(*stmt, 2) != 0) {
+			fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+	if(sqlite3_bind_int64(*stmt, 3, tent->tnode.tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	tent->mtime = mtime;
+	return 0;
+}
+
+int tup_db_get_hash(tupid_t tupid, char *hash)
+{
+	int rc = 0;
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[DB_GET_HASH];
+	static char s[] = "select hash from node where id=?";
+	const char *value;
+
+	transaction_check("%s [37m[%lli][0m", s, tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	hash[0] = 0;
+	dbrc = sqlite3_step(*stmt);
+	if(dbrc == SQLITE_ROW) {
+		value = (const char *)sqlite3_column_text(*stmt, 0);
+		if(value) {
+			strncpy(hash, value, TUP_HASH_SIZE - 1);
+			hash[TUP_HASH_SIZE - 1] = 0;
+		}
+	} else if(dbrc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		rc = -1;
+	}
+
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	return rc;
+}
+
 int tup_db_set_srcid(struct tup_entry *tent, tupid_t srcid)
 {
 	int rc;
@@ -2686,6 +2932,13 @@ int tup_db_add_create_list(tupid_t tupid)
 		return -1;
 	}
 
+	/* Something in this directory changed, so any directories that read
+	 * from it must be re-parsed as well. Otherwise they are only parsed
+	 * if our generated files change (see create_work() in updater.c).
+	 */
+	if(tup_db_set_dependent_dir_flags(tupid) < 0)
+		return -1;
+
 	return 0;
 }
 
@@ -4255,7 +4508,7 @@ int tup_db_select_node_by_link(int (*callback)(void *, struct tup_entry *),
 	int rc;
 	int dbrc;
 	sqlite3_stmt **stmt = &stmts[DB_SELECT_NODE_BY_LINK];
-	static char s[] = "select to_id from normal_link where from_id=?";
+	static char s[] = "select to_id, dir, type, mtime, srcid, name from normal_link, node where from_id=? and to_id=node.id";
 
 	transaction_check("%s [37m[%lli][0m", s, tupid);
 	if(!*stmt) {
@@ -4274,6 +4527,7 @@ int tup_db_select_node_by_link(int (*callback)(void *, struct tup_entry *),
 
 	while(1) {
 		struct tup_entry *tent;
+		tupid_t to_id;
 
 		dbrc = sqlite3_step(*stmt);
 		if(dbrc == SQLITE_DONE) {
@@ -4287,9 +4541,26 @@ int tup_db_select_node_by_link(int (*callback)(void *, struct tup_entry *),
 			goto out_reset;
 		}
 
-		if(tup_entry_add(sqlite3_column_int64(*stmt, 0), &tent) < 0) {
-			rc = -1;
-			goto out_reset;
+		/* The node columns come along with the link, so an entry that
+		 * isn't cached yet doesn't need a separate query to fill it in.
+		 */
+		to_id = sqlite3_column_int64(*stmt, 0);
+		tent = tup_entry_find(to_id);
+		if(!tent) {
+			tupid_t dt = sqlite3_column_int64(*stmt, 1);
+
+			if(dt && tup_entry_add(dt, NULL) < 0) {
+				rc = -1;
+				goto out_reset;
+			}
+			if(tup_entry_add_to_dir(dt, to_id,
+						(const char *)sqlite3_column_text(*stmt, 5), -1,
+						sqlite3_column_int(*stmt, 2),
+						sqlite3_column_int64(*stmt, 3),
+						sqlite3_column_int64(*stmt, 4), &tent) < 0) {
+				rc = -1;
+				goto out_reset;
+			}
 		}
 
 		if(callback(arg, tent) < 0) {
@@ -4541,13 +4812,13 @@ int tup_db_config_set_string(const char *lval, const char *rval)
 	return 0;
 }
 
-int tup_db_set_var(tupid_t tupid, const char *value)
+int tup_db_set_cmd_stats(tupid_t tupid, const struct cmd_stats *cs)
 {
 	int rc;
-	sqlite3_stmt **stmt = &stmts[DB_SET_VAR];
-	static char s[] = "insert or replace into var values(?, ?)";
+	sqlite3_stmt **stmt = &stmts[DB_SET_CMD_STATS];
+	static char s[] = "insert or replace into cmd_stats values(?, ?, ?, ?)";
 
-	transaction_check("%s [37m[%lli, '%s'][0m", s, tupid, value);
+	transaction_check("%s [37m[%lli, %li, %li, %li][0m", s, tupid, cs->wall, cs->cpu, cs->rss);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
 			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
@@ -4561,7 +4832,17 @@ int tup_db_set_var(tupid_t tupid, const char *value)
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
-	if(sqlite3_bind_text(*stmt, 2, value, -1, SQLITE_STATIC) != 0) {
+	if(sqlite3_bind_int64(*stmt, 2, cs->wall) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int64(*stmt, 3, cs->cpu) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int64(*stmt, 4, cs->rss) != 0) {
 		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
@@ -4573,7 +4854,6 @@ int tup_db_set_var(tupid_t tupid, const char *value)
 		fprintf(stderr, "Statement was: %s\n", s);
 		return -1;
 	}
-
 	if(rc != SQLITE_DONE) {
 		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
@@ -4583,34 +4863,34 @@ int tup_db_set_var(tupid_t tupid, const char *value)
 	return 0;
 }
 
-static struct var_entry *get_var_id(struct vardb *vdb, struct tup_entry *tent,
-				    const char *var, int varlen)
+int tup_db_get_cmd_stats(tupid_t tupid, struct cmd_stats *cs)
 {
-	struct var_entry *ve = NULL;
+	int rc = -1;
 	int dbrc;
-	int len;
-	const char *value;
-	sqlite3_stmt **stmt = &stmts[_DB_GET_VAR_ID];
-	static char s[] = "select value, length(value) from var where var.id=?";
+	sqlite3_stmt **stmt = &stmts[DB_GET_CMD_STATS];
+	static char s[] = "select wall, cpu, rss from cmd_stats where id=?";
 
-	transaction_check("%s [37m[%lli][0m", s, tent->tnode.tupid);
+	transaction_check("%s [37m[%lli][0m", s, tupid);
 	if(!*stmt) {
 		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
 			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
 			fprintf(stderr, "Statement was: %s\n", s);
-			return NULL;
+			return -1;
 		}
 	}
 
-	if(sqlite3_bind_int64(*stmt, 1, tent->tnode.tupid) != 0) {
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
 		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
-		return NULL;
+		return -1;
 	}
 
 	dbrc = sqlite3_step(*stmt);
 	if(dbrc == SQLITE_DONE) {
-		fprintf(stderr,"tup error: Variable id %lli not found in .tup/db.\n", tent->tnode.tupid);
+		cs->wall = -1;
+		cs->cpu = -1;
+		cs->rss = -1;
+		rc = 0;
 		goto out_reset;
 	}
 	if(dbrc != SQLITE_ROW) {
@@ -4619,63 +4899,628 @@ static struct var_entry *get_var_id(struct vardb *vdb, struct tup_entry *tent,
 		goto out_reset;
 	}
 
-	len = sqlite3_column_int(*stmt, 1);
-	if(len < 0) {
-		goto out_reset;
-	}
-	value = (const char *)sqlite3_column_text(*stmt, 0);
-	if(!value) {
-		goto out_reset;
-	}
-
-	ve = vardb_set2(vdb, var, varlen, value, tent);
+	cs->wall = sqlite3_column_int64(*stmt, 0);
+	cs->cpu = sqlite3_column_int64(*stmt, 1);
+	cs->rss = sqlite3_column_int64(*stmt, 2);
+	rc = 0;
 
 out_reset:
 	if(msqlite3_reset(*stmt) != 0) {
 		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
 		fprintf(stderr, "Statement was: %s\n", s);
-		return NULL;
+		return -1;
 	}
 
-	return ve;
+	return rc;
 }
 
-static struct var_entry *get_var(struct variant *variant, const char *var, int varlen)
-{
-	struct var_entry *ve;
-
-	ve = vardb_get(&variant->vdb, var, varlen);
-	if(!ve) {
-		struct tup_entry *tent;
+struct stats_row {
+	tupid_t tupid;
+	time_t wall;
+	time_t cpu;
+	long rss;
+	int count;
+};
 
-		if(node_select(variant->tent->tnode.tupid, var, varlen, &tent) < 0)
-			return NULL;
-		if(!tent) {
-			tent = tup_db_node_insert(variant->tent->tnode.tupid, var, varlen,
-						  TUP_NODE_GHOST, -1, -1);
-			if(!tent)
-				return NULL;
-		}
-		if(tent->type == TUP_NODE_VAR) {
-			ve = get_var_id(&variant->vdb, tent, var, varlen);
-		} else if(varlen == 12 && strncmp(var, "TUP_PLATFORM", varlen) == 0) {
-			ve = vardb_set2(&variant->vdb, var, varlen, tup_platform, tent);
-		} else if(varlen == 8 && strncmp(var, "TUP_ARCH", varlen) == 0) {
-			ve = vardb_set2(&variant->vdb, var, varlen, tup_arch, tent);
-		} else {
-			ve = vardb_set2(&variant->vdb, var, varlen, "", tent);
-		}
-	}
-	return ve;
+static void print_ms(time_t ms)
+{
+	if(ms < 0)
+		printf("%9s", "-");
+	else
+		printf("%8.3fs", (double)ms / 1000.0);
 }
 
-struct tup_entry *tup_db_get_var(struct variant *variant, const char *var, int varlen, struct estring *e)
+static int show_cmd_stats(int num)
 {
-	struct var_entry *ve;
-
-	ve = get_var(variant, var, varlen);
-	if(!ve)
-		return NULL;
+	int rc = -1;
+	int dbrc;
+	int x;
+	int count = 0;
+	struct stats_row *rows;
+	sqlite3_stmt **stmt = &stmts[DB_SHOW_CMD_STATS];
+	static char s[] = "select cmd_stats.id, wall, cpu, rss from cmd_stats, node where node.id=cmd_stats.id order by wall desc limit ?";
+
+	rows = malloc(sizeof(*rows) * num);
+	if(!rows) {
+		perror("malloc");
+		return -1;
+	}
+
+	transaction_check("%s [37m[%i][0m", s, num);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			goto out_free;
+		}
+	}
+
+	if(sqlite3_bind_int(*stmt, 1, num) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out_free;
+	}
+
+	while(1) {
+		dbrc = sqlite3_step(*stmt);
+		if(dbrc == SQLITE_DONE) {
+			rc = 0;
+			break;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			break;
+		}
+		rows[count].tupid = sqlite3_column_int64(*stmt, 0);
+		rows[count].wall = sqlite3_column_int64(*stmt, 1);
+		rows[count].cpu = sqlite3_column_int64(*stmt, 2);
+		rows[count].rss = sqlite3_column_int64(*stmt, 3);
+		count++;
+	}
+
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		rc = -1;
+	}
+	if(rc < 0)
+		goto out_free;
+
+	/* The entries are read in after the statement is reset, since that
+	 * may need to run other statements.
+	 */
+	printf("Slowest commands:\n");
+	printf("%9s %9s %10s  %s\n", "wall", "cpu", "peak rss", "command");
+	for(x=0; x<count; x++) {
+		struct tup_entry *tent;
+
+		if(tup_entry_add(rows[x].tupid, &tent) < 0) {
+			rc = -1;
+			goto out_free;
+		}
+		print_ms(rows[x].wall);
+		printf(" ");
+		print_ms(rows[x].cpu);
+		if(rows[x].rss < 0)
+			printf(" %10s  ", "-");
+		else
+			printf(" %8likB  ", rows[x].rss);
+		print_tup_entry(stdout, tent);
+		printf("\n");
+	}
+
+out_free:
+	free(rows);
+	return rc;
+}
+
+static int show_dir_stats(int num)
+{
+	int rc = -1;
+	int dbrc;
+	int x;
+	int count = 0;
+	struct stats_row *rows;
+	sqlite3_stmt **stmt = &stmts[DB_SHOW_DIR_STATS];
+	static char s[] = "select node.dir, sum(wall), ifnull(sum(nullif(cpu, -1)), -1), count(*) from cmd_stats, node where node.id=cmd_stats.id group by node.dir order by 2 desc limit ?";
+
+	rows = malloc(sizeof(*rows) * num);
+	if(!rows) {
+		perror("malloc");
+		return -1;
+	}
+
+	transaction_check("%s [37m[%i][0m", s, num);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			goto out_free;
+		}
+	}
+
+	if(sqlite3_bind_int(*stmt, 1, num) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out_free;
+	}
+
+	while(1) {
+		dbrc = sqlite3_step(*stmt);
+		if(dbrc == SQLITE_DONE) {
+			rc = 0;
+			break;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			break;
+		}
+		rows[count].tupid = sqlite3_column_int64(*stmt, 0);
+		rows[count].wall = sqlite3_column_int64(*stmt, 1);
+		rows[count].cpu = sqlite3_column_int64(*stmt, 2);
+		rows[count].count = sqlite3_column_int(*stmt, 3);
+		count++;
+	}
+
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		rc = -1;
+	}
+	if(rc < 0)
+		goto out_free;
+
+	printf("Slowest directories:\n");
+	printf("%9s %9s %8s  %s\n", "wall", "cpu", "commands", "directory");
+	for(x=0; x<count; x++) {
+		struct tup_entry *tent;
+
+		if(tup_entry_add(rows[x].tupid, &tent) < 0) {
+			rc = -1;
+			goto out_free;
+		}
+		print_ms(rows[x].wall);
+		printf(" ");
+		print_ms(rows[x].cpu);
+		printf(" %8i  ", rows[x].count);
+		print_tup_entry(stdout, tent);
+		printf("\n");
+	}
+
+out_free:
+	free(rows);
+	return rc;
+}
+
+int tup_db_show_stats(int num)
+{
+	if(num <= 0)
+		return 0;
+	if(show_cmd_stats(num) < 0)
+		return -1;
+	printf("\n");
+	if(show_dir_stats(num) < 0)
+		return -1;
+	return 0;
+}
+
+/* The graph queries walk the links with recursive SQL, and the rows come back
+ * in breadth-first order since the recursive part is ordered by depth. So the
+ * first time a node shows up is at its shortest distance from the start, and
+ * only the set of nodes already seen needs to be kept in memory, not the graph.
+ */
+struct query_node {
+	struct tupid_tree tnode;
+	tupid_t prev;
+	int depth;
+};
+
+static void free_query_nodes(struct tupid_entries *root)
+{
+	struct tupid_tree *tt;
+
+	while((tt = RB_ROOT(root)) != NULL) {
+		tupid_tree_rm(root, tt);
+		free(container_of(tt, struct query_node, tnode));
+	}
+}
+
+/* A negative max_depth means no limit. Since a simple path can't be longer
+ * than the number of nodes, the largest id is used as the limit instead.
+ */
+static int query_max_depth(int max_depth)
+{
+	int dbrc;
+	sqlite3_stmt **stmt = &stmts[DB_QUERY_MAX_DEPTH];
+	static char s[] = "select max(id) from node";
+
+	if(max_depth >= 0)
+		return max_depth;
+
+	transaction_check("%s", s);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	dbrc = sqlite3_step(*stmt);
+	if(dbrc == SQLITE_ROW) {
+		sqlite3_int64 maxid = sqlite3_column_int64(*stmt, 0);
+		max_depth = maxid > INT_MAX ? INT_MAX : (int)maxid;
+	}
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(dbrc != SQLITE_ROW) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	return max_depth;
+}
+
+static int prepare_query(sqlite3_stmt **stmt, const char *s, tupid_t tupid,
+			 int max_depth)
+{
+	transaction_check("%s [37m[%lli, %i][0m", s, tupid, max_depth);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, -1, stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_int(*stmt, 2, max_depth) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	return 0;
+}
+
+/* Steps through the (id, depth, prev) rows of a query. Each node is recorded
+ * in 'seen' the first time it comes up. If a callback is given it is called
+ * for each new node as it is found, starting with those at min_depth.
+ * The walk stops early once 'target' is seen, in which case 1 is returned.
+ */
+static int run_query(sqlite3_stmt *stmt, const char *s,
+		     struct tupid_entries *seen, tupid_t target, int min_depth,
+		     int (*callback)(void *, struct tup_entry *, int), void *arg)
+{
+	int rc;
+	int dbrc;
+
+	while(1) {
+		struct query_node *qn;
+		tupid_t tupid;
+		int depth;
+
+		dbrc = sqlite3_step(stmt);
+		if(dbrc == SQLITE_DONE) {
+			rc = 0;
+			goto out_reset;
+		}
+		if(dbrc != SQLITE_ROW) {
+			fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			rc = -1;
+			goto out_reset;
+		}
+
+		tupid = sqlite3_column_int64(stmt, 0);
+		if(tupid_tree_search(seen, tupid) != NULL)
+			continue;
+		depth = sqlite3_column_int(stmt, 1);
+
+		qn = malloc(sizeof *qn);
+		if(!qn) {
+			perror("malloc");
+			rc = -1;
+			goto out_reset;
+		}
+		qn->tnode.tupid = tupid;
+		qn->prev = sqlite3_column_int64(stmt, 2);
+		qn->depth = depth;
+		tupid_tree_insert(seen, &qn->tnode);
+
+		if(tupid == target) {
+			rc = 1;
+			goto out_reset;
+		}
+		if(callback && depth >= min_depth) {
+			struct tup_entry *tent;
+
+			if(tup_entry_add(tupid, &tent) < 0) {
+				rc = -1;
+				goto out_reset;
+			}
+			if(callback(arg, tent, depth) < 0) {
+				rc = -1;
+				goto out_reset;
+			}
+		}
+	}
+
+out_reset:
+	if(msqlite3_reset(stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	return rc;
+}
+
+#define QUERY_WALK(next, cur, table) \
+	"with recursive walk(id, depth, prev) as (" \
+	"select ?1, 0, 0 " \
+	"union select " table "." next ", walk.depth+1, walk.id from walk, " table " " \
+	"where " table "." cur "=walk.id and walk.depth<?2 order by 2) " \
+	"select id, depth, prev from walk"
+
+int tup_db_query_links(tupid_t tupid, int reverse, int sticky, int max_depth,
+		       int (*callback)(void *, struct tup_entry *, int depth),
+		       void *arg)
+{
+	int rc;
+	int idx;
+	struct tupid_entries seen = {NULL};
+	static const char *sql[] = {
+		QUERY_WALK("from_id", "to_id", "normal_link"),
+		QUERY_WALK("from_id", "to_id", "sticky_link"),
+		QUERY_WALK("to_id", "from_id", "normal_link"),
+		QUERY_WALK("to_id", "from_id", "sticky_link"),
+	};
+
+	idx = (reverse ? 2 : 0) + (sticky ? 1 : 0);
+	max_depth = query_max_depth(max_depth);
+	if(max_depth < 0)
+		return -1;
+	if(prepare_query(&stmts[DB_QUERY_DEPS + idx], sql[idx], tupid, max_depth) < 0)
+		return -1;
+	rc = run_query(stmts[DB_QUERY_DEPS + idx], sql[idx], &seen, -1, 1, callback, arg);
+	free_query_nodes(&seen);
+	return rc;
+}
+
+int tup_db_query_path(tupid_t from, tupid_t to, int sticky, int max_depth,
+		      int (*callback)(void *, struct tup_entry *, int depth),
+		      void *arg)
+{
+	int rc;
+	int idx = sticky ? 1 : 0;
+	int count;
+	int x;
+	tupid_t *path = NULL;
+	tupid_t tupid;
+	struct tupid_tree *tt;
+	struct tupid_entries seen = {NULL};
+	static const char *sql[] = {
+		QUERY_WALK("to_id", "from_id", "normal_link"),
+		QUERY_WALK("to_id", "from_id", "sticky_link"),
+	};
+
+	max_depth = query_max_depth(max_depth);
+	if(max_depth < 0)
+		return -1;
+	if(prepare_query(&stmts[DB_QUERY_PATH + idx], sql[idx], from, max_depth) < 0)
+		return -1;
+	rc = run_query(stmts[DB_QUERY_PATH + idx], sql[idx], &seen, to, 0, NULL, NULL);
+	if(rc < 0)
+		goto out_free;
+	if(rc == 0) {
+		/* No path within max_depth */
+		rc = 1;
+		goto out_free;
+	}
+
+	tt = tupid_tree_search(&seen, to);
+	count = container_of(tt, struct query_node, tnode)->depth + 1;
+	path = malloc(sizeof(*path) * count);
+	if(!path) {
+		perror("malloc");
+		rc = -1;
+		goto out_free;
+	}
+	tupid = to;
+	for(x=count-1; x>=0; x--) {
+		path[x] = tupid;
+		tt = tupid_tree_search(&seen, tupid);
+		tupid = container_of(tt, struct query_node, tnode)->prev;
+	}
+	for(x=0; x<count; x++) {
+		struct tup_entry *tent;
+
+		if(tup_entry_add(path[x], &tent) < 0) {
+			rc = -1;
+			goto out_free;
+		}
+		if(callback(arg, tent, x) < 0) {
+			rc = -1;
+			goto out_free;
+		}
+	}
+	rc = 0;
+
+out_free:
+	free(path);
+	free_query_nodes(&seen);
+	return rc;
+}
+
+int tup_db_query_dir_cmds(tupid_t dt, int max_depth,
+			  int (*callback)(void *, struct tup_entry *, int depth),
+			  void *arg)
+{
+	int rc;
+	struct tupid_entries seen = {NULL};
+	sqlite3_stmt **stmt = &stmts[DB_QUERY_DIR_CMDS];
+	static char s[] = "with recursive dirs(id, depth) as (select ?1, 0 union select node.id, dirs.depth+1 from dirs, node where node.dir=dirs.id and (node.type=?3 or node.type=?4) and dirs.depth<?2 order by 2) select node.id, dirs.depth, 0 from dirs, node where node.dir=dirs.id and node.type=?5";
+
+	max_depth = query_max_depth(max_depth);
+	if(max_depth < 0)
+		return -1;
+	if(prepare_query(stmt, s, dt, max_depth) < 0)
+		return -1;
+	if(sqlite3_bind_int(*stmt, 3, TUP_NODE_DIR) != 0 ||
+	   sqlite3_bind_int(*stmt, 4, TUP_NODE_GENERATED_DIR) != 0 ||
+	   sqlite3_bind_int(*stmt, 5, TUP_NODE_CMD) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	rc = run_query(*stmt, s, &seen, -1, 0, callback, arg);
+	free_query_nodes(&seen);
+	return rc;
+}
+
+int tup_db_set_var(tupid_t tupid, const char *value)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[DB_SET_VAR];
+	static char s[] = "insert or replace into var values(?, ?)";
+
+	transaction_check("%s [37m[%lli, '%s'][0m", s, tupid, value);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+	if(sqlite3_bind_text(*stmt, 2, value, -1, SQLITE_STATIC) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct var_entry *get_var_id(struct vardb *vdb, struct tup_entry *tent,
+				    const char *var, int varlen)
+{
+	struct var_entry *ve = NULL;
+	int dbrc;
+	int len;
+	const char *value;
+	sqlite3_stmt **stmt = &stmts[_DB_GET_VAR_ID];
+	static char s[] = "select value, length(value) from var where var.id=?";
+
+	transaction_check("%s [37m[%lli][0m", s, tent->tnode.tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return NULL;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tent->tnode.tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return NULL;
+	}
+
+	dbrc = sqlite3_step(*stmt);
+	if(dbrc == SQLITE_DONE) {
+		fprintf(stderr,"tup error: Variable id %lli not found in .tup/db.\n", tent->tnode.tupid);
+		goto out_reset;
+	}
+	if(dbrc != SQLITE_ROW) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		goto out_reset;
+	}
+
+	len = sqlite3_column_int(*stmt, 1);
+	if(len < 0) {
+		goto out_reset;
+	}
+	value = (const char *)sqlite3_column_text(*stmt, 0);
+	if(!value) {
+		goto out_reset;
+	}
+
+	ve = vardb_set2(vdb, var, varlen, value, tent);
+
+out_reset:
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return NULL;
+	}
+
+	return ve;
+}
+
+static struct var_entry *get_var(struct variant *variant, const char *var, int varlen)
+{
+	struct var_entry *ve;
+
+	ve = vardb_get(&variant->vdb, var, varlen);
+	if(!ve) {
+		struct tup_entry *tent;
+
+		if(node_select(variant->tent->tnode.tupid, var, varlen, &tent) < 0)
+			return NULL;
+		if(!tent) {
+			tent = tup_db_node_insert(variant->tent->tnode.tupid, var, varlen,
+						  TUP_NODE_GHOST, -1, -1);
+			if(!tent)
+				return NULL;
+		}
+		if(tent->type == TUP_NODE_VAR) {
+			ve = get_var_id(&variant->vdb, tent, var, varlen);
+		} else if(varlen == 12 && strncmp(var, "TUP_PLATFORM", varlen) == 0) {
+			ve = vardb_set2(&variant->vdb, var, varlen, tup_platform, tent);
+		} else if(varlen == 8 && strncmp(var, "TUP_ARCH", varlen) == 0) {
+			ve = vardb_set2(&variant->vdb, var, varlen, tup_arch, tent);
+		} else {
+			ve = vardb_set2(&variant->vdb, var, varlen, "", tent);
+		}
+	}
+	return ve;
+}
+
+struct tup_entry *tup_db_get_var(struct variant *variant, const char *var, int varlen, struct estring *e)
+{
+	struct var_entry *ve;
+
+	ve = get_var(variant, var, varlen);
+	if(!ve)
+		return NULL;
 
 	if(e) {
 		if(estring_append(e, ve->value, ve->vallen) < 0)
@@ -7574,13 +8419,54 @@ static int delete_var_entry(tupid_t tupid)
 	return 0;
 }
 
+static int delete_cmd_stats(tupid_t tupid)
+{
+	int rc;
+	sqlite3_stmt **stmt = &stmts[_DB_DELETE_CMD_STATS];
+	static char s[] = "delete from cmd_stats where id=?";
+
+	transaction_check("%s [37m[%lli][0m", s, tupid);
+	if(!*stmt) {
+		if(sqlite3_prepare_v2(tup_db, s, sizeof(s), stmt, NULL) != 0) {
+			fprintf(stderr, "SQL Error: %s\n", sqlite3_errmsg(tup_db));
+			fprintf(stderr, "Statement was: %s\n", s);
+			return -1;
+		}
+	}
+
+	if(sqlite3_bind_int64(*stmt, 1, tupid) != 0) {
+		fprintf(stderr, "SQL bind error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	rc = sqlite3_step(*stmt);
+	if(msqlite3_reset(*stmt) != 0) {
+		fprintf(stderr, "SQL reset error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	if(rc != SQLITE_DONE) {
+		fprintf(stderr, "SQL step error: %s\n", sqlite3_errmsg(tup_db));
+		fprintf(stderr, "Statement was: %s\n", s);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int no_sync(void)
+{
+	return db_pragma("PRAGMA synchronous=OFF");
+}
+
+static int db_pragma(const char *sql)
 {
 	char *errmsg;
-	char sql[] = "PRAGMA synchronous=OFF";
 
 	/* This can't use a transaction_check() because SQLite doesn't allow
-	 * changing the synchronicity inside a transaction.
+	 * changing the synchronicity or journal mode inside a transaction.
 	 */
 	if(sql_debug) fprintf(stderr, "%s\n", sql);
 	if(sqlite3_exec(tup_db, sql, NULL, NULL, &errmsg) != 0) {
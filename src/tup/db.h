@@ -39,12 +39,16 @@ struct mapping_head;
 
 /* General operations */
 int tup_db_open(void);
+int tup_db_open_readonly(void);
+int tup_db_readonly(void);
 int tup_db_close(void);
 int tup_db_create(int db_sync, int memory_db);
 int tup_db_begin(void);
 int tup_db_commit(void);
+int tup_db_commit_batch(void);
 int tup_db_changes(void);
 int tup_db_rollback(void);
+int tup_db_in_transaction(void);
 int tup_db_check_flags(int flags);
 void tup_db_enable_sql_debug(void);
 int tup_db_debug_add_all_ghosts(void);
@@ -82,6 +86,9 @@ int tup_db_change_node(tupid_t tupid, const char *name, tupid_t new_dt);
 int tup_db_set_name(tupid_t tupid, const char *new_name, tupid_t new_dt);
 int tup_db_set_type(struct tup_entry *tent, enum TUP_NODE_TYPE type);
 int tup_db_set_mtime(struct tup_entry *tent, time_t mtime);
+int tup_db_set_output_mtimes(struct mapping_head *mapping_list);
+int tup_db_set_mtime_hash(struct tup_entry *tent, time_t mtime, const char *hash);
+int tup_db_get_hash(tupid_t tupid, char *hash);
 int tup_db_set_srcid(struct tup_entry *tent, tupid_t srcid);
 int tup_db_normal_dir_to_generated(struct tup_entry *tent);
 int tup_db_print(FILE *stream, tupid_t tupid);
@@ -148,6 +155,30 @@ int tup_db_config_set_int(const char *lval, int x);
 int tup_db_config_get_int(const char *lval, int def, int *result);
 int tup_db_config_set_string(const char *lval, const char *rval);
 
+/* Command stats operations. The wall and cpu times are in milliseconds, and
+ * rss is the peak resident set size in kilobytes. Any of them may be -1 if
+ * unknown.
+ */
+struct cmd_stats {
+	time_t wall;
+	time_t cpu;
+	long rss;
+};
+int tup_db_set_cmd_stats(tupid_t tupid, const struct cmd_stats *cs);
+int tup_db_get_cmd_stats(tupid_t tupid, struct cmd_stats *cs);
+int tup_db_show_stats(int num);
+
+/* Graph queries */
+int tup_db_query_links(tupid_t tupid, int reverse, int sticky, int max_depth,
+		       int (*callback)(void *, struct tup_entry *, int depth),
+		       void *arg);
+int tup_db_query_path(tupid_t from, tupid_t to, int sticky, int max_depth,
+		      int (*callback)(void *, struct tup_entry *, int depth),
+		      void *arg);
+int tup_db_query_dir_cmds(tupid_t dt, int max_depth,
+			  int (*callback)(void *, struct tup_entry *, int depth),
+			  void *arg);
+
 /* Var operations */
 int tup_db_set_var(tupid_t tupid, const char *value);
 struct tup_entry *tup_db_get_var(struct variant *variant, const char *var, int varlen, struct estring *e);
@@ -50,6 +50,239 @@ static int rm_entry(tupid_t tupid, int safe);
 static int resolve_parent(struct tup_entry *tent);
 static int change_name(struct tup_entry *tent, const char *new_name);
 
+/* Entries are carved out of slabs rather than malloc'd one at a time, since a
+ * big project can have millions of them in the cache. Removed entries go on a
+ * free list (linked through their parent pointer) to be handed out again, and
+ * the slabs themselves are only released by tup_entry_clear().
+ */
+#define ENTRY_SLAB_SIZE 1024
+struct entry_slab {
+	struct entry_slab *next;
+	struct tup_entry entries[ENTRY_SLAB_SIZE];
+};
+static struct entry_slab *entry_slabs = NULL;
+static int slab_used = ENTRY_SLAB_SIZE;
+static struct tup_entry *free_entries = NULL;
+
+/* Names are interned, so the many entries that share a name (Tupfile,
+ * .gitignore, every file in each variant directory) point to a single
+ * reference-counted copy. Small names are packed into chunks with a free list
+ * per 8-byte size class, and anything bigger (mostly command strings) is
+ * malloc'd on its own.
+ */
+struct name_entry {
+	struct name_entry *next;
+	unsigned int hash;
+	int refs;
+	char s[];
+};
+#define NAME_CHUNK_SIZE 65536
+#define NAME_CLASS_SIZE 8
+#define NAME_NUM_CLASSES 32
+struct name_chunk {
+	struct name_chunk *next;
+	char buf[NAME_CHUNK_SIZE];
+};
+static struct name_chunk *name_chunks = NULL;
+static int chunk_used = NAME_CHUNK_SIZE;
+static struct name_entry *free_names[NAME_NUM_CLASSES];
+static struct name_entry **name_table = NULL;
+static unsigned int name_table_size = 0;
+static unsigned int num_names = 0;
+
+static struct tup_entry *alloc_entry(void)
+{
+	struct tup_entry *tent;
+
+	if(free_entries) {
+		tent = free_entries;
+		free_entries = tent->parent;
+		return tent;
+	}
+	if(slab_used == ENTRY_SLAB_SIZE) {
+		struct entry_slab *slab;
+
+		slab = malloc(sizeof *slab);
+		if(!slab) {
+			perror("malloc");
+			return NULL;
+		}
+		slab->next = entry_slabs;
+		entry_slabs = slab;
+		slab_used = 0;
+	}
+	tent = &entry_slabs->entries[slab_used];
+	slab_used++;
+	return tent;
+}
+
+static void free_entry(struct tup_entry *tent)
+{
+	tent->parent = free_entries;
+	free_entries = tent;
+}
+
+static unsigned int name_hash(const char *name, int len)
+{
+	unsigned int hash = 2166136261u;
+	int x;
+
+	for(x=0; x<len; x++) {
+		hash ^= (unsigned char)name[x];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int name_class(int len)
+{
+	return (sizeof(struct name_entry) + len + 1 + NAME_CLASS_SIZE - 1) / NAME_CLASS_SIZE - 1;
+}
+
+static int grow_name_table(void)
+{
+	struct name_entry **table;
+	unsigned int size;
+	unsigned int x;
+
+	size = name_table_size ? name_table_size * 2 : 4096;
+	table = calloc(size, sizeof *table);
+	if(!table) {
+		perror("calloc");
+		return -1;
+	}
+	for(x=0; x<name_table_size; x++) {
+		struct name_entry *ne;
+		struct name_entry *next;
+
+		for(ne = name_table[x]; ne; ne = next) {
+			next = ne->next;
+			ne->next = table[ne->hash & (size - 1)];
+			table[ne->hash & (size - 1)] = ne;
+		}
+	}
+	free(name_table);
+	name_table = table;
+	name_table_size = size;
+	return 0;
+}
+
+static struct name_entry *alloc_name(int len)
+{
+	struct name_entry *ne;
+	int class = name_class(len);
+	int size;
+
+	if(class >= NAME_NUM_CLASSES) {
+		ne = malloc(sizeof *ne + len + 1);
+		if(!ne)
+			perror("malloc");
+		return ne;
+	}
+	if(free_names[class]) {
+		ne = free_names[class];
+		free_names[class] = ne->next;
+		return ne;
+	}
+	size = (class + 1) * NAME_CLASS_SIZE;
+	if(chunk_used + size > NAME_CHUNK_SIZE) {
+		struct name_chunk *chunk;
+
+		chunk = malloc(sizeof *chunk);
+		if(!chunk) {
+			perror("malloc");
+			return NULL;
+		}
+		chunk->next = name_chunks;
+		name_chunks = chunk;
+		chunk_used = 0;
+	}
+	ne = (struct name_entry*)&name_chunks->buf[chunk_used];
+	chunk_used += size;
+	return ne;
+}
+
+static char *intern_name(const char *name, int len)
+{
+	struct name_entry *ne;
+	unsigned int hash = name_hash(name, len);
+
+	if(name_table) {
+		for(ne = name_table[hash & (name_table_size - 1)]; ne; ne = ne->next) {
+			if(ne->hash == hash && strncmp(ne->s, name, len) == 0 && ne->s[len] == 0) {
+				ne->refs++;
+				return ne->s;
+			}
+		}
+	}
+	if(num_names >= name_table_size / 2)
+		if(grow_name_table() < 0)
+			return NULL;
+
+	ne = alloc_name(len);
+	if(!ne)
+		return NULL;
+	memcpy(ne->s, name, len);
+	ne->s[len] = 0;
+	ne->hash = hash;
+	ne->refs = 1;
+	ne->next = name_table[hash & (name_table_size - 1)];
+	name_table[hash & (name_table_size - 1)] = ne;
+	num_names++;
+	return ne->s;
+}
+
+static void release_name(char *s, int len)
+{
+	struct name_entry *ne = container_of(s, struct name_entry, s);
+	struct name_entry **pp;
+	int class;
+
+	ne->refs--;
+	if(ne->refs > 0)
+		return;
+	for(pp = &name_table[ne->hash & (name_table_size - 1)]; *pp != ne; pp = &(*pp)->next) {}
+	*pp = ne->next;
+	num_names--;
+
+	class = name_class(len);
+	if(class >= NAME_NUM_CLASSES) {
+		free(ne);
+	} else {
+		ne->next = free_names[class];
+		free_names[class] = ne;
+	}
+}
+
+/* Only called once the cache is empty, so nothing points into the slabs or
+ * chunks anymore.
+ */
+static void release_storage(void)
+{
+	int x;
+
+	while(entry_slabs) {
+		struct entry_slab *slab = entry_slabs;
+		entry_slabs = slab->next;
+		free(slab);
+	}
+	slab_used = ENTRY_SLAB_SIZE;
+	free_entries = NULL;
+
+	while(name_chunks) {
+		struct name_chunk *chunk = name_chunks;
+		name_chunks = chunk->next;
+		free(chunk);
+	}
+	chunk_used = NAME_CHUNK_SIZE;
+	for(x=0; x<NAME_NUM_CLASSES; x++)
+		free_names[x] = NULL;
+	free(name_table);
+	name_table = NULL;
+	name_table_size = 0;
+	num_names = 0;
+}
+
 int tup_entry_init(void)
 {
 	if(pthread_mutex_init(&entry_openat_mutex, NULL) != 0) {
@@ -179,8 +412,9 @@ static int rm_entry(tupid_t tupid, int safe)
 	}
 	free_tupid_tree(&tent->stickies);
 	free_tupid_tree(&tent->group_stickies);
-	free(tent->name.s);
-	free(tent);
+	if(tent->name.s)
+		release_name(tent->name.s, tent->name.len);
+	free_entry(tent);
 	return 0;
 }
 
@@ -320,6 +554,15 @@ int tup_entry_add_all(tupid_t tupid, tupid_t dt, enum TUP_NODE_TYPE type,
 	return 0;
 }
 
+int tup_entry_set_name(struct tup_entry *tent, const char *name, int len)
+{
+	tent->name.s = intern_name(name, len);
+	if(!tent->name.s)
+		return -1;
+	tent->name.len = len;
+	return 0;
+}
+
 int tup_entry_resolve_dirs(void)
 {
 	struct tupid_tree *tt;
@@ -483,11 +726,9 @@ static struct tup_entry *new_entry(tupid_t tupid, tupid_t dt,
 {
 	struct tup_entry *tent;
 
-	tent = malloc(sizeof *tent);
-	if(!tent) {
-		perror("malloc");
+	tent = alloc_entry();
+	if(!tent)
 		return NULL;
-	}
 
 	if(len == -1)
 		len = strlen(name);
@@ -506,14 +747,11 @@ static struct tup_entry *new_entry(tupid_t tupid, tupid_t dt,
 	tent->retrieved_stickies = 0;
 	tent->incoming = NULL;
 	if(name) {
-		tent->name.s = malloc(len+1);
+		tent->name.s = intern_name(name, len);
 		if(!tent->name.s) {
-			perror("malloc");
-			free(tent);
+			free_entry(tent);
 			return NULL;
 		}
-		strncpy(tent->name.s, name, len);
-		tent->name.s[len] = 0;
 		tent->name.len = len;
 	} else {
 		tent->name.s = NULL;
@@ -580,6 +818,7 @@ int tup_entry_clear(void)
 				return -1;
 		}
 	}
+	release_storage();
 	return 0;
 }
 
@@ -690,15 +929,12 @@ static int change_name(struct tup_entry *tent, const char *new_name)
 	if(tent->parent) {
 		string_tree_rm(&tent->parent->entries, &tent->name);
 	}
-	free(tent->name.s);
+	release_name(tent->name.s, tent->name.len);
 
 	tent->name.len = strlen(new_name);
-	tent->name.s = malloc(tent->name.len + 1);
-	if(!tent->name.s) {
-		perror("malloc");
+	tent->name.s = intern_name(new_name, tent->name.len);
+	if(!tent->name.s)
 		return -1;
-	}
-	strcpy(tent->name.s, new_name);
 	if(resolve_parent(tent) < 0)
 		return -1;
 	return 0;
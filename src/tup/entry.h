@@ -36,7 +36,6 @@ struct tup_entry {
 	struct tupid_tree tnode;
 	tupid_t dt;
 	struct tup_entry *parent;
-	enum TUP_NODE_TYPE type;
 	time_t mtime;
 	tupid_t srcid;
 	struct variant *variant;
@@ -44,6 +43,7 @@ struct tup_entry {
 	struct string_entries entries;
 	struct tupid_entries stickies;
 	struct tupid_entries group_stickies;
+	enum TUP_NODE_TYPE type;
 	int retrieved_stickies;
 	struct tup_entry *incoming;
 	LIST_ENTRY(tup_entry) ghost_list;
@@ -68,6 +68,7 @@ int tup_entry_add_to_dir(tupid_t dt, tupid_t tupid, const char *name, int len,
 			 struct tup_entry **dest);
 int tup_entry_add_all(tupid_t tupid, tupid_t dt, enum TUP_NODE_TYPE type,
 		      time_t mtime, tupid_t srcid, const char *name);
+int tup_entry_set_name(struct tup_entry *tent, const char *name, int len);
 int tup_entry_resolve_dirs(void);
 int tup_entry_change_name_dt(tupid_t tupid, const char *new_name, tupid_t dt);
 int tup_entry_open(struct tup_entry *tent);
@@ -29,12 +29,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
-static struct file_entry *new_entry(const char *filename);
-static void check_unlink_list(const struct pel_group *pg,
-			      struct file_entry_head *u_head);
+static struct file_entry *new_entry(const char *filename,
+				    struct pel_group *pg);
+static unsigned int pg_hash(const struct pel_group *pg);
+static struct file_entry *set_find(struct file_entry_set *set,
+				   const struct pel_group *pg,
+				   unsigned int hash);
+static int set_add(struct file_entry_set *set, struct file_entry *fent,
+		   unsigned int hash);
+static void set_rm(struct file_entry *fent);
+static void check_unlink_list(const struct pel_group *pg, unsigned int hash,
+			      struct file_entry_set *u_set);
 static void handle_unlink(struct file_info *info);
 static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 			     int *warnings, struct tup_entry_head *entryhead);
@@ -50,14 +59,26 @@ static int add_config_files_locked(struct file_info *finfo, struct tup_entry *te
 static int add_parser_files_locked(FILE *f, struct file_info *finfo,
 				   struct tupid_entries *root, tupid_t vardt);
 
+static void init_set(struct file_entry_set *set)
+{
+	set->buckets = NULL;
+	set->num_buckets = 0;
+	set->count = 0;
+}
+
 int init_file_info(struct file_info *info, const char *variant_dir)
 {
 	LIST_INIT(&info->read_list);
 	LIST_INIT(&info->write_list);
 	LIST_INIT(&info->unlink_list);
 	LIST_INIT(&info->var_list);
+	init_set(&info->read_set);
+	init_set(&info->write_set);
+	init_set(&info->unlink_set);
+	init_set(&info->var_set);
 	LIST_INIT(&info->mapping_list);
 	LIST_INIT(&info->tmpdir_list);
+	info->lookups = NULL;
 	pthread_mutex_init(&info->lock, NULL);
 	pthread_cond_init(&info->cond, NULL);
 	/* Root variant gets a NULL variant_dir so we can skip trying to do the
@@ -70,6 +91,9 @@ int init_file_info(struct file_info *info, const char *variant_dir)
 		info->variant_dir = NULL;
 	info->server_fail = 0;
 	info->open_count = 0;
+	info->num_events = 0;
+	info->bytes_read = 0;
+	info->bytes_written = 0;
 	return 0;
 }
 
@@ -103,36 +127,58 @@ int handle_file(enum access_type at, const char *filename, const char *file2,
 int handle_open_file(enum access_type at, const char *filename,
 		     struct file_info *info)
 {
+	struct file_entry_head *head;
+	struct file_entry_set *set;
 	struct file_entry *fent;
-	int rc = 0;
-
-	fent = new_entry(filename);
-	if(!fent) {
-		return -1;
-	}
+	struct pel_group pg;
+	unsigned int hash;
 
 	switch(at) {
 		case ACCESS_READ:
-			LIST_INSERT_HEAD(&info->read_list, fent, list);
+			head = &info->read_list;
+			set = &info->read_set;
 			break;
 		case ACCESS_WRITE:
-			check_unlink_list(&fent->pg, &info->unlink_list);
-			LIST_INSERT_HEAD(&info->write_list, fent, list);
+			head = &info->write_list;
+			set = &info->write_set;
 			break;
 		case ACCESS_UNLINK:
-			LIST_INSERT_HEAD(&info->unlink_list, fent, list);
+			head = &info->unlink_list;
+			set = &info->unlink_set;
 			break;
 		case ACCESS_VAR:
-			LIST_INSERT_HEAD(&info->var_list, fent, list);
+			head = &info->var_list;
+			set = &info->var_set;
 			break;
 		case ACCESS_RENAME:
 		default:
 			fprintf(stderr, "Invalid event type: %i\n", at);
-			rc = -1;
-			break;
+			return -1;
 	}
 
-	return rc;
+	if(get_path_elements(filename, &pg) < 0)
+		return -1;
+	hash = pg_hash(&pg);
+	if(at == ACCESS_WRITE)
+		check_unlink_list(&pg, hash, &info->unlink_set);
+
+	/* Commands tend to stat and open the same files over and over, so
+	 * only the first access of each file is kept.
+	 */
+	if(set_find(set, &pg, hash)) {
+		del_pel_group(&pg);
+		return 0;
+	}
+
+	fent = new_entry(filename, &pg);
+	if(!fent) {
+		del_pel_group(&pg);
+		return -1;
+	}
+	LIST_INSERT_HEAD(head, fent, list);
+	if(set_add(set, fent, hash) < 0)
+		return -1;
+	return 0;
 }
 
 int write_files(FILE *f, tupid_t cmdid, struct file_info *info, int *warnings,
@@ -270,20 +316,89 @@ static int add_node_to_list(FILE *f, tupid_t dt, struct pel_group *pg,
 	return 0;
 }
 
-static int file_set_mtime(struct tup_entry *tent, const char *file)
+static int file_set_mtime(struct mapping *map)
 {
 	struct stat buf;
-	if(fstatat(tup_top_fd(), file, &buf, AT_SYMLINK_NOFOLLOW) < 0) {
+	if(fstatat(tup_top_fd(), map->realname, &buf, AT_SYMLINK_NOFOLLOW) < 0) {
 		fprintf(stderr, "tup error: file_set_mtime() fstatat failed.\n");
-		perror(file);
+		perror(map->realname);
 		return -1;
 	}
 	if(S_ISFIFO(buf.st_mode)) {
 		fprintf(stderr, "tup error: Unable to create a FIFO as an output file. They can only be used as temporary files.\n");
 		return -1;
 	}
-	if(tup_db_set_mtime(tent, MTIME(buf)) < 0)
-		return -1;
+	map->mtime = MTIME(buf);
+	map->have_mtime = 1;
+	return 0;
+}
+
+int strcmp_p(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Moves the temporary files for a finished command's outputs into place and
+ * gets their mtimes. This is done by the worker before it takes the database
+ * and display locks for write_files(), so a command with hundreds of outputs
+ * doesn't hold up everyone else. Only the outputs listed in the Tupfile (the
+ * sorted paths from the top of the tree in outputs) are handled here. Anything
+ * that fails or needs an error message is left for write_files(), which still
+ * checks everything and reports the problems.
+ */
+int rename_outputs(struct file_info *info, char **outputs, int num_outputs)
+{
+	struct mapping *map;
+	char path[PATH_MAX];
+	char *p = path;
+	struct stat buf;
+
+	finfo_lock(info);
+	/* Leftover directories are an error, in which case nothing gets
+	 * moved (see write_files()).
+	 */
+	if(!LIST_EMPTY(&info->tmpdir_list))
+		goto out_unlock;
+	LIST_FOREACH(map, &info->mapping_list, list) {
+		struct pel_group pg;
+		int rc;
+
+		if(get_path_elements(map->realname, &pg) < 0) {
+			finfo_unlock(info);
+			return -1;
+		}
+		rc = -1;
+		if(!(pg.pg_flags & (PG_HIDDEN | PG_OUTSIDE_TUP)))
+			rc = snprint_pel_group(path, sizeof(path), &pg);
+		del_pel_group(&pg);
+		if(rc < 0 || rc >= (int)sizeof(path))
+			continue;
+		if(!bsearch(&p, outputs, num_outputs, sizeof(*outputs), strcmp_p))
+			continue;
+
+		if(strcmp(map->tmpname, map->realname) != 0) {
+			if(renameat(tup_top_fd(), map->tmpname, tup_top_fd(), map->realname) < 0)
+				continue;
+		}
+		if(fstatat(tup_top_fd(), map->realname, &buf, AT_SYMLINK_NOFOLLOW) < 0 ||
+		   S_ISFIFO(buf.st_mode)) {
+			/* The file is in place now, so write_files() just
+			 * needs to do the stat again and show the error.
+			 */
+			free(map->tmpname);
+			map->tmpname = strdup(map->realname);
+			if(!map->tmpname) {
+				perror("strdup");
+				finfo_unlock(info);
+				return -1;
+			}
+			continue;
+		}
+		map->mtime = MTIME(buf);
+		map->have_mtime = 1;
+	}
+out_unlock:
+	finfo_unlock(info);
 	return 0;
 }
 
@@ -369,9 +484,12 @@ static int add_parser_files_locked(FILE *f, struct file_info *finfo,
 	return 0;
 }
 
-static struct file_entry *new_entry(const char *filename)
+/* Takes over the path elements in pg, which point into filename. */
+static struct file_entry *new_entry(const char *filename,
+				    struct pel_group *pg)
 {
 	struct file_entry *fent;
+	struct path_element *pel;
 
 	fent = malloc(sizeof *fent);
 	if(!fent) {
@@ -386,63 +504,198 @@ static struct file_entry *new_entry(const char *filename)
 		return NULL;
 	}
 
-	if(get_path_elements(fent->filename, &fent->pg) < 0) {
-		free(fent->filename);
-		free(fent);
-		return NULL;
+	fent->pg = *pg;
+	TAILQ_INIT(&fent->pg.path_list);
+	while(!TAILQ_EMPTY(&pg->path_list)) {
+		pel = TAILQ_FIRST(&pg->path_list);
+		TAILQ_REMOVE(&pg->path_list, pel, list);
+		pel->path = fent->filename + (pel->path - filename);
+		TAILQ_INSERT_TAIL(&fent->pg.path_list, pel, list);
 	}
+	fent->hash_next = NULL;
+	fent->set = NULL;
+	fent->hash = 0;
 	return fent;
 }
 
 void del_file_entry(struct file_entry *fent)
 {
+	set_rm(fent);
 	LIST_REMOVE(fent, list);
 	del_pel_group(&fent->pg);
 	free(fent->filename);
 	free(fent);
 }
 
-int handle_rename(const char *from, const char *to, struct file_info *info)
+static unsigned int pg_hash(const struct pel_group *pg)
+{
+	struct path_element *pel;
+	unsigned int hash = 2166136261u;
+	int x;
+
+	/* FNV-1a over the path elements, which is consistent with pg_eq()
+	 * regardless of how many separators or "." paths there were.
+	 */
+	TAILQ_FOREACH(pel, &pg->path_list, list) {
+		for(x=0; x<pel->len; x++) {
+#ifdef _WIN32
+			hash ^= (unsigned char)tolower(pel->path[x]);
+#else
+			hash ^= (unsigned char)pel->path[x];
+#endif
+			hash *= 16777619u;
+		}
+		hash ^= PATH_SEP;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct file_entry *set_find(struct file_entry_set *set,
+				   const struct pel_group *pg,
+				   unsigned int hash)
 {
 	struct file_entry *fent;
-	struct pel_group pg_from;
-	struct pel_group pg_to;
 
-	if(get_path_elements(from, &pg_from) < 0)
-		return -1;
-	if(get_path_elements(to, &pg_to) < 0)
-		return -1;
+	if(!set->num_buckets)
+		return NULL;
+	for(fent = set->buckets[hash & (set->num_buckets - 1)]; fent; fent = fent->hash_next) {
+		/* The flags distinguish a full path outside of tup from
+		 * the same relative path inside it.
+		 */
+		if(fent->hash == hash && fent->pg.pg_flags == pg->pg_flags &&
+		   pg_eq(&fent->pg, pg))
+			return fent;
+	}
+	return NULL;
+}
+
+static int set_add(struct file_entry_set *set, struct file_entry *fent,
+		   unsigned int hash)
+{
+	struct file_entry **bucket;
 
-	LIST_FOREACH(fent, &info->write_list, list) {
-		if(pg_eq(&fent->pg, &pg_from)) {
-			del_pel_group(&fent->pg);
-			free(fent->filename);
+	if(set->count >= set->num_buckets) {
+		struct file_entry **buckets;
+		int num_buckets = set->num_buckets ? set->num_buckets * 2 : 64;
+		int x;
 
-			fent->filename = strdup(to);
-			if(!fent->filename) {
-				perror("strdup");
-				return -1;
+		buckets = calloc(num_buckets, sizeof(*buckets));
+		if(!buckets) {
+			perror("calloc");
+			return -1;
+		}
+		for(x=0; x<set->num_buckets; x++) {
+			struct file_entry *tmp;
+			struct file_entry *next;
+
+			for(tmp = set->buckets[x]; tmp; tmp = next) {
+				next = tmp->hash_next;
+				bucket = &buckets[tmp->hash & (num_buckets - 1)];
+				tmp->hash_next = *bucket;
+				*bucket = tmp;
 			}
-			if(get_path_elements(fent->filename, &fent->pg) < 0)
-				return -1;
 		}
+		free(set->buckets);
+		set->buckets = buckets;
+		set->num_buckets = num_buckets;
 	}
-	LIST_FOREACH(fent, &info->read_list, list) {
-		if(pg_eq(&fent->pg, &pg_from)) {
-			del_pel_group(&fent->pg);
-			free(fent->filename);
 
-			fent->filename = strdup(to);
-			if(!fent->filename) {
-				perror("strdup");
-				return -1;
-			}
-			if(get_path_elements(fent->filename, &fent->pg) < 0)
-				return -1;
+	fent->hash = hash;
+	fent->set = set;
+	bucket = &set->buckets[hash & (set->num_buckets - 1)];
+	fent->hash_next = *bucket;
+	*bucket = fent;
+	set->count++;
+	return 0;
+}
+
+static void set_rm(struct file_entry *fent)
+{
+	struct file_entry_set *set = fent->set;
+	struct file_entry **p;
+
+	if(!set)
+		return;
+	for(p = &set->buckets[fent->hash & (set->num_buckets - 1)]; *p; p = &(*p)->hash_next) {
+		if(*p == fent) {
+			*p = fent->hash_next;
+			break;
 		}
 	}
+	fent->set = NULL;
+	fent->hash_next = NULL;
+	set->count--;
+	/* The lists are emptied out after every job, so don't hang on to
+	 * the buckets.
+	 */
+	if(set->count == 0) {
+		free(set->buckets);
+		set->buckets = NULL;
+		set->num_buckets = 0;
+	}
+}
+
+static int rename_entry(struct file_entry_set *set,
+			const struct pel_group *pg_from, unsigned int hash_from,
+			const char *to)
+{
+	struct file_entry *fent;
+	struct pel_group pg;
+	unsigned int hash;
+	char *filename;
+
+	fent = set_find(set, pg_from, hash_from);
+	if(!fent)
+		return 0;
+
+	filename = strdup(to);
+	if(!filename) {
+		perror("strdup");
+		return -1;
+	}
+	if(get_path_elements(filename, &pg) < 0) {
+		free(filename);
+		return -1;
+	}
+	set_rm(fent);
+	del_pel_group(&fent->pg);
+	free(fent->filename);
+	fent->filename = filename;
+	fent->pg = pg;
+	/* The TAILQ head can't just be copied, since the first element
+	 * points back at it.
+	 */
+	TAILQ_INIT(&fent->pg.path_list);
+	TAILQ_CONCAT(&fent->pg.path_list, &pg.path_list, list);
+
+	hash = pg_hash(&fent->pg);
+	if(set_find(set, &fent->pg, hash)) {
+		/* The new name was already recorded. */
+		del_file_entry(fent);
+		return 0;
+	}
+	return set_add(set, fent, hash);
+}
 
-	check_unlink_list(&pg_to, &info->unlink_list);
+int handle_rename(const char *from, const char *to, struct file_info *info)
+{
+	struct pel_group pg_from;
+	struct pel_group pg_to;
+	unsigned int hash_from;
+
+	if(get_path_elements(from, &pg_from) < 0)
+		return -1;
+	if(get_path_elements(to, &pg_to) < 0)
+		return -1;
+	hash_from = pg_hash(&pg_from);
+
+	if(rename_entry(&info->write_set, &pg_from, hash_from, to) < 0)
+		return -1;
+	if(rename_entry(&info->read_set, &pg_from, hash_from, to) < 0)
+		return -1;
+
+	check_unlink_list(&pg_to, pg_hash(&pg_to), &info->unlink_set);
 	del_pel_group(&pg_to);
 	del_pel_group(&pg_from);
 	return 0;
@@ -456,35 +709,29 @@ void del_map(struct mapping *map)
 	free(map);
 }
 
-static void check_unlink_list(const struct pel_group *pg,
-			      struct file_entry_head *u_head)
+static void check_unlink_list(const struct pel_group *pg, unsigned int hash,
+			      struct file_entry_set *u_set)
 {
-	struct file_entry *fent, *tmp;
+	struct file_entry *fent;
 
-	LIST_FOREACH_SAFE(fent, u_head, list, tmp) {
-		if(pg_eq(&fent->pg, pg)) {
-			del_file_entry(fent);
-		}
-	}
+	fent = set_find(u_set, pg, hash);
+	if(fent)
+		del_file_entry(fent);
 }
 
 static void handle_unlink(struct file_info *info)
 {
-	struct file_entry *u, *fent, *tmp;
+	struct file_entry *u, *fent;
 
 	while(!LIST_EMPTY(&info->unlink_list)) {
 		u = LIST_FIRST(&info->unlink_list);
 
-		LIST_FOREACH_SAFE(fent, &info->write_list, list, tmp) {
-			if(pg_eq(&fent->pg, &u->pg)) {
-				del_file_entry(fent);
-			}
-		}
-		LIST_FOREACH_SAFE(fent, &info->read_list, list, tmp) {
-			if(pg_eq(&fent->pg, &u->pg)) {
-				del_file_entry(fent);
-			}
-		}
+		fent = set_find(&info->write_set, &u->pg, u->hash);
+		if(fent)
+			del_file_entry(fent);
+		fent = set_find(&info->read_set, &u->pg, u->hash);
+		if(fent)
+			del_file_entry(fent);
 
 		del_file_entry(u);
 	}
@@ -494,9 +741,8 @@ static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 			     int *warnings, struct tup_entry_head *entryhead)
 {
 	struct file_entry *w;
-	struct file_entry *r;
-	struct file_entry *tmp;
 	struct tup_entry *tent;
+	struct mapping *map;
 	int write_bork = 0;
 
 	while(!LIST_EMPTY(&info->write_list)) {
@@ -505,13 +751,6 @@ static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 
 		w = LIST_FIRST(&info->write_list);
 
-		/* Remove duplicate write entries */
-		LIST_FOREACH_SAFE(r, &info->write_list, list, tmp) {
-			if(r != w && pg_eq(&w->pg, &r->pg)) {
-				del_file_entry(r);
-			}
-		}
-
 		if(w->pg.pg_flags & PG_HIDDEN) {
 			if(warnings) {
 				fprintf(f, "tup warning: Writing to hidden file '%s'\n", w->filename);
@@ -534,8 +773,6 @@ static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 			return -1;
 		free(pel);
 		if(!tent) {
-			struct mapping *map;
-
 			fprintf(f, "tup error: File '%s' was written to, but is not in .tup/db. You probably should specify it as an output\n", w->filename);
 			write_bork = 1;
 #ifdef _WIN32
@@ -551,7 +788,6 @@ static int update_write_info(FILE *f, tupid_t cmdid, struct file_info *info,
 				}
 			}
 		} else {
-			struct mapping *map;
 			tup_entry_list_add(tent, entryhead);
 
 			LIST_FOREACH(map, &info->mapping_list, list) {
@@ -568,10 +804,10 @@ out_skip:
 	if(tup_db_check_actual_outputs(f, cmdid, entryhead, &info->mapping_list, &write_bork) < 0)
 		return -1;
 
-	while(!LIST_EMPTY(&info->mapping_list)) {
-		struct mapping *map;
-
-		map = LIST_FIRST(&info->mapping_list);
+	LIST_FOREACH(map, &info->mapping_list, list) {
+		/* Outputs already moved by rename_outputs() */
+		if(map->have_mtime)
+			continue;
 
 		/* TODO: strcmp only here for win32 support */
 		if(strcmp(map->tmpname, map->realname) != 0) {
@@ -579,14 +815,19 @@ out_skip:
 				perror(map->realname);
 				fprintf(f, "tup error: Unable to rename temporary file '%s' to destination '%s'\n", map->tmpname, map->realname);
 				write_bork = 1;
+				continue;
 			}
 		}
 		if(map->tent) {
 			/* tent may not be set (in the case of hidden files) */
-			if(file_set_mtime(map->tent, map->realname) < 0)
+			if(file_set_mtime(map) < 0)
 				return -1;
 		}
-		del_map(map);
+	}
+	if(tup_db_set_output_mtimes(&info->mapping_list) < 0)
+		return -1;
+	while(!LIST_EMPTY(&info->mapping_list)) {
+		del_map(LIST_FIRST(&info->mapping_list));
 	}
 
 	if(write_bork)
@@ -28,15 +28,20 @@
 #include "pel_group.h"
 #include <stdio.h>
 #include <pthread.h>
+#include <time.h>
 
 struct tup_entry;
 struct tupid_entries;
+struct lookup_cache;
 
 struct mapping {
 	LIST_ENTRY(mapping) list;
 	char *realname;
 	char *tmpname;
 	struct tup_entry *tent;
+	/* Set once the file is moved into place by rename_outputs() */
+	time_t mtime;
+	int have_mtime;
 };
 LIST_HEAD(mapping_head, mapping);
 
@@ -46,13 +51,27 @@ struct tmpdir {
 };
 LIST_HEAD(tmpdir_head, tmpdir);
 
+struct file_entry_set;
+
 struct file_entry {
 	LIST_ENTRY(file_entry) list;
+	struct file_entry *hash_next;
+	struct file_entry_set *set;
+	unsigned int hash;
 	char *filename;
 	struct pel_group pg;
 };
 LIST_HEAD(file_entry_head, file_entry);
 
+/* A hash set of the entries in one of the file_info lists, keyed by path.
+ * A file that is accessed many times by a command is only recorded once.
+ */
+struct file_entry_set {
+	struct file_entry **buckets;
+	int num_buckets;
+	int count;
+};
+
 struct file_info {
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
@@ -61,11 +80,21 @@ struct file_info {
 	struct file_entry_head write_list;
 	struct file_entry_head unlink_list;
 	struct file_entry_head var_list;
+	struct file_entry_set read_set;
+	struct file_entry_set write_set;
+	struct file_entry_set unlink_set;
+	struct file_entry_set var_set;
 	struct mapping_head mapping_list;
 	struct tmpdir_head tmpdir_list;
+	/* Only used by the FUSE server (see fuse.lookup_cache) */
+	struct lookup_cache *lookups;
 	const char *variant_dir;
 	int server_fail;
 	int open_count;
+	/* Only used for tracing (see trace.c) */
+	int num_events;
+	long long bytes_read;
+	long long bytes_written;
 };
 
 int init_file_info(struct file_info *info, const char *variant_dir);
@@ -83,6 +112,9 @@ int write_files(FILE *f, tupid_t cmdid, struct file_info *info, int *warnings,
 		int full_deps, tupid_t vardt,
 		struct tupid_entries *used_groups_root,
 		int *important_link_removed);
+int rename_outputs(struct file_info *info, char **outputs, int num_outputs);
+/* qsort()/bsearch() comparison for an array of strings */
+int strcmp_p(const void *a, const void *b);
 int add_config_files(struct file_info *finfo, struct tup_entry *tent);
 int add_parser_files(FILE *f, struct file_info *finfo, struct tupid_entries *root, tupid_t vardt);
 void del_map(struct mapping *map);
@@ -39,6 +39,10 @@ tupid_t create_command_file(tupid_t dt, const char *cmd);
 tupid_t tup_file_mod(tupid_t dt, const char *file, int *modified);
 tupid_t tup_file_mod_mtime(tupid_t dt, const char *file, time_t mtime,
 			   int force, int ignore_generated, int *modified);
+tupid_t tup_file_mod_hash(tupid_t dt, const char *file, time_t mtime,
+			  const char *hash);
+void tup_content_hash_init(void);
+int tup_content_hash_enabled(void);
 int tup_file_del(tupid_t dt, const char *file, int len, int *modified);
 int tup_file_missing(struct tup_entry *tent);
 int tup_del_id_force(tupid_t tupid, enum TUP_NODE_TYPE type);
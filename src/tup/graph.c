@@ -65,6 +65,11 @@ struct node *create_node(struct graph *g, struct tup_entry *tent)
 	n->parsing = 0;
 	n->marked = 0;
 	n->skip = 1;
+	n->parse_unchanged = 0;
+	n->cpath = 0;
+	n->cpath_edges = 0;
+	n->runtime = 0;
+	n->mem_kb = 0;
 	TAILQ_INSERT_TAIL(&g->node_list, n, list);
 
 	if(tupid_tree_insert(&g->node_root, &n->tnode) < 0)
@@ -655,6 +660,149 @@ void trim_graph(struct graph *g)
 	} while(nodes_removed);
 }
 
+static int load_runtime(struct node *n)
+{
+	struct cmd_stats cs;
+
+	n->runtime = 0;
+	n->mem_kb = 0;
+	if(n->tent->type != TUP_NODE_CMD)
+		return 0;
+	if(tup_db_get_cmd_stats(n->tent->tnode.tupid, &cs) < 0)
+		return -1;
+	n->runtime = cs.wall;
+	if(cs.rss > 0)
+		n->mem_kb = cs.rss;
+	/* Commands that ran before the cmd_stats table existed still have
+	 * their last runtime in the mtime field, or -1 if they never ran.
+	 */
+	if(n->runtime == -1)
+		n->runtime = n->tent->mtime;
+	return 0;
+}
+
+static int add_cpath_leaves(struct node_head *head, struct node **stack,
+			    int num, time_t *total, int *known)
+{
+	struct node *n;
+	struct edge *e;
+
+	TAILQ_FOREACH(n, head, list) {
+		n->cpath_edges = 0;
+		LIST_FOREACH(e, &n->edges, list) {
+			n->cpath_edges++;
+		}
+		if(n->cpath_edges == 0)
+			stack[num++] = n;
+		if(load_runtime(n) < 0)
+			return -1;
+		if(n->runtime != -1) {
+			*total += n->runtime;
+			(*known)++;
+		}
+	}
+	return num;
+}
+
+static time_t set_unknown_runtimes(struct node_head *head, struct graph *g,
+				   time_t unknown)
+{
+	struct node *n;
+	time_t total = 0;
+
+	TAILQ_FOREACH(n, head, list) {
+		if(n->runtime == -1)
+			n->runtime = unknown;
+		n->cpath = n->runtime;
+		if(n->tent->type == g->count_flags && n->expanded)
+			total += n->runtime;
+	}
+	return total;
+}
+
+/* Calculate the critical path length of each node, which is the node's own
+ * runtime plus the largest critical path of anything that depends on it. The
+ * updater uses this to start the nodes on the longest chains first. This walks
+ * backwards from the leaves of the graph so we don't have to recurse through
+ * very deep graphs. Nodes that are part of a cycle are never reached, and just
+ * keep their own runtime.
+ *
+ * The runtimes come from each command's history in the database, so this is
+ * also where the total time of a command graph is set for the progress bar.
+ */
+int set_critical_paths(struct graph *g)
+{
+	struct node **stack;
+	struct node *n;
+	int count = 0;
+	int num;
+	int known = 0;
+	time_t total = 0;
+	time_t unknown;
+
+	TAILQ_FOREACH(n, &g->node_list, list) {
+		count++;
+	}
+	TAILQ_FOREACH(n, &g->plist, list) {
+		count++;
+	}
+	if(count == 0)
+		return 0;
+
+	stack = malloc(sizeof(*stack) * count);
+	if(!stack) {
+		perror("malloc");
+		return -1;
+	}
+	num = add_cpath_leaves(&g->node_list, stack, 0, &total, &known);
+	if(num >= 0)
+		num = add_cpath_leaves(&g->plist, stack, num, &total, &known);
+	if(num < 0) {
+		free(stack);
+		return -1;
+	}
+
+	/* Commands that have never run are assumed to take the average time of
+	 * the ones that have.
+	 */
+	if(known)
+		unknown = total / known;
+	else
+		unknown = 1;
+	if(unknown < 1)
+		unknown = 1;
+
+	total = set_unknown_runtimes(&g->node_list, g, unknown);
+	total += set_unknown_runtimes(&g->plist, g, unknown);
+	/* Only commands have runtimes, so anything else is counted by the
+	 * number of nodes.
+	 */
+	if(g->count_flags == TUP_NODE_CMD)
+		g->total_mtime = total;
+	else
+		g->total_mtime = -1;
+
+	while(num > 0) {
+		struct edge *e;
+		time_t longest = 0;
+
+		n = stack[--num];
+		LIST_FOREACH(e, &n->edges, list) {
+			if(e->dest->cpath > longest)
+				longest = e->dest->cpath;
+		}
+		n->cpath += longest;
+
+		LIST_FOREACH(e, &n->incoming, destlist) {
+			e->src->cpath_edges--;
+			if(e->src->cpath_edges == 0)
+				stack[num++] = e->src;
+		}
+	}
+	free(stack);
+	return 0;
+}
+
 void save_graph(FILE *err, struct graph *g, const char *filename)
 {
 	static int count = 0;
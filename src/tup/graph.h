@@ -57,6 +57,25 @@ struct node {
 	unsigned char parsing;
 	unsigned char marked;
 	unsigned char skip;
+
+	/* Set by the parser if the Tupfile produced exactly the same set of
+	 * generated files as last time, in which case the directories that
+	 * depend on this one don't need to be re-parsed.
+	 */
+	unsigned char parse_unchanged;
+
+	/* The estimated runtime (in ms) of the longest path from this node to
+	 * the end of the graph. See set_critical_paths()
+	 */
+	time_t cpath;
+	int cpath_edges;
+
+	/* The estimated runtime (in ms) and peak memory (in kB) of just this
+	 * node, from the command's history. Only valid after
+	 * set_critical_paths()
+	 */
+	time_t runtime;
+	long mem_kb;
 };
 TAILQ_HEAD(node_head, node);
 
@@ -99,6 +118,7 @@ int prune_graph(struct graph *g, int argc, char **argv, int *num_pruned,
 int nodes_are_connected(struct tup_entry *src, struct tupid_entries *valid_root,
 			int *connected);
 void trim_graph(struct graph *g);
+int set_critical_paths(struct graph *g);
 void save_graph(FILE *err, struct graph *g, const char *filename);
 void dump_graph(struct graph *g, FILE *f, int show_dirs, int combine);
 
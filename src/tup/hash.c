@@ -0,0 +1,193 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _ATFILE_SOURCE
+#include "hash.h"
+#include "compat.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_block(struct tup_sha1 *sha, const unsigned char *p)
+{
+	unsigned int w[80];
+	unsigned int a, b, c, d, e;
+	int x;
+
+	for(x=0; x<16; x++) {
+		w[x] = ((unsigned int)p[x*4] << 24) |
+			((unsigned int)p[x*4+1] << 16) |
+			((unsigned int)p[x*4+2] << 8) |
+			((unsigned int)p[x*4+3]);
+	}
+	for(x=16; x<80; x++) {
+		unsigned int t = w[x-3] ^ w[x-8] ^ w[x-14] ^ w[x-16];
+		w[x] = ROL(t, 1);
+	}
+
+	a = sha->h[0];
+	b = sha->h[1];
+	c = sha->h[2];
+	d = sha->h[3];
+	e = sha->h[4];
+	for(x=0; x<80; x++) {
+		unsigned int f;
+		unsigned int k;
+		unsigned int t;
+
+		if(x < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if(x < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if(x < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROL(a, 5) + f + e + k + w[x];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	sha->h[0] += a;
+	sha->h[1] += b;
+	sha->h[2] += c;
+	sha->h[3] += d;
+	sha->h[4] += e;
+}
+
+void tup_sha1_init(struct tup_sha1 *sha)
+{
+	sha->h[0] = 0x67452301;
+	sha->h[1] = 0xefcdab89;
+	sha->h[2] = 0x98badcfe;
+	sha->h[3] = 0x10325476;
+	sha->h[4] = 0xc3d2e1f0;
+	sha->len = 0;
+	sha->used = 0;
+}
+
+void tup_sha1_update(struct tup_sha1 *sha, const void *data, int len)
+{
+	const unsigned char *p = data;
+
+	sha->len += len;
+	if(sha->used) {
+		int n = 64 - sha->used;
+		if(n > len)
+			n = len;
+		memcpy(sha->block + sha->used, p, n);
+		sha->used += n;
+		p += n;
+		len -= n;
+		if(sha->used < 64)
+			return;
+		sha1_block(sha, sha->block);
+		sha->used = 0;
+	}
+	while(len >= 64) {
+		sha1_block(sha, p);
+		p += 64;
+		len -= 64;
+	}
+	if(len) {
+		memcpy(sha->block, p, len);
+		sha->used = len;
+	}
+}
+
+void tup_sha1_final(struct tup_sha1 *sha, char *hash)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned long long bits = sha->len * 8;
+	unsigned char pad[72];
+	int padlen;
+	int x;
+
+	padlen = (sha->used < 56) ? 56 - sha->used : 120 - sha->used;
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	for(x=0; x<8; x++) {
+		pad[padlen + x] = bits >> (56 - x * 8);
+	}
+	tup_sha1_update(sha, pad, padlen + 8);
+
+	for(x=0; x<20; x++) {
+		unsigned char c = sha->h[x/4] >> (24 - (x % 4) * 8);
+		hash[x*2] = hex[c >> 4];
+		hash[x*2+1] = hex[c & 0xf];
+	}
+	hash[40] = 0;
+}
+
+int hash_file(int dfd, const char *path, char *hash)
+{
+	struct tup_sha1 sha;
+	struct stat st;
+	char buf[65536];
+	int fd;
+	int rc;
+
+	tup_sha1_init(&sha);
+	if(fstatat(dfd, path, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	if(S_ISLNK(st.st_mode)) {
+		rc = readlinkat(dfd, path, buf, sizeof(buf));
+		if(rc < 0)
+			return -1;
+		tup_sha1_update(&sha, buf, rc);
+		tup_sha1_final(&sha, hash);
+		return 0;
+	}
+
+	/* O_NOFOLLOW so that if the file was replaced by a symlink since the
+	 * fstatat(), we fail instead of hashing whatever it points to.
+	 */
+	fd = openat(dfd, path, O_RDONLY | O_NOFOLLOW);
+	if(fd < 0)
+		return -1;
+	while(1) {
+		rc = read(fd, buf, sizeof(buf));
+		if(rc < 0) {
+			if(errno == EINTR)
+				continue;
+			close(fd);
+			return -1;
+		}
+		if(rc == 0)
+			break;
+		tup_sha1_update(&sha, buf, rc);
+	}
+	if(close(fd) < 0)
+		return -1;
+	tup_sha1_final(&sha, hash);
+	return 0;
+}
@@ -0,0 +1,44 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef tup_hash_h
+#define tup_hash_h
+
+/* Size of a hex-encoded SHA-1 content hash, including the nul terminator. */
+#define TUP_HASH_SIZE 41
+
+struct tup_sha1 {
+	unsigned int h[5];
+	unsigned long long len;
+	unsigned char block[64];
+	int used;
+};
+
+void tup_sha1_init(struct tup_sha1 *sha);
+void tup_sha1_update(struct tup_sha1 *sha, const void *data, int len);
+void tup_sha1_final(struct tup_sha1 *sha, char *hash);
+
+/* Hashes the contents of the file at path (relative to dfd). Symlinks are not
+ * followed - the hash of a symlink is the hash of its target string. Returns 0
+ * on success, or -1 on error with errno set.
+ */
+int hash_file(int dfd, const char *path, char *hash);
+
+#endif
@@ -40,7 +40,9 @@
 #define mkdir(a,b) mkdir(a)
 #endif
 
-int tup_init(void)
+static int snapshot = 0;
+
+static int init(int readonly)
 {
 	if(find_tup_dir() != 0) {
 		fprintf(stderr, "tup %s usage: tup [args]\n", tup_version());
@@ -60,12 +62,29 @@ int tup_init(void)
 	if(open_tup_top() < 0) {
 		goto out_err;
 	}
-	if(tup_lock_init() < 0) {
-		goto out_err;
+	if(readonly && tup_option_get_flag("db.wal")) {
+		/* In WAL mode a reader can work from the last committed
+		 * state of the database while another process is in the
+		 * middle of an update, so there's no need to wait for it.
+		 */
+		int rc = tup_lock_init_nowait();
+		if(rc < 0)
+			goto out_err;
+		if(rc == 1)
+			snapshot = 1;
+	} else {
+		if(tup_lock_init() < 0) {
+			goto out_err;
+		}
 	}
 	color_init();
-	if(tup_db_open() != 0) {
-		goto out_unlock;
+	if(snapshot) {
+		if(tup_db_open_readonly() != 0)
+			goto out_err;
+	} else {
+		if(tup_db_open() != 0) {
+			goto out_unlock;
+		}
 	}
 	return 0;
 
@@ -76,11 +95,23 @@ out_err:
 	return -1;
 }
 
+int tup_init(void)
+{
+	return init(0);
+}
+
+int tup_init_readonly(void)
+{
+	return init(1);
+}
+
 int tup_cleanup(void)
 {
 	tup_db_close();
 	tup_option_exit();
-	tup_lock_exit();
+	if(!snapshot)
+		tup_lock_exit();
+	snapshot = 0;
 	if(close(tup_top_fd()) < 0)
 		perror("close(tup_top_fd())");
 	if(server_post_exit() < 0)
@@ -19,6 +19,7 @@
  */
 
 int tup_init(void);
+int tup_init_readonly(void);
 int tup_cleanup(void);
 void tup_valgrind_cleanup(void);
 int init_command(int argc, char **argv);
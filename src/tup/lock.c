@@ -79,7 +79,7 @@ static tup_lock_t sh_lock;
 static tup_lock_t obj_lock;
 static tup_lock_t tri_lock;
 
-int tup_lock_init(void)
+static int lock_init(int wait)
 {
 	int ret;
 
@@ -87,6 +87,10 @@ int tup_lock_init(void)
 		return -1;
 	ret = tup_try_flock(sh_lock);
 	if(ret > 0) {
+		if(!wait) {
+			tup_lock_close(sh_lock);
+			return 1;
+		}
 		printf("Waiting for another tup process (or an autoupdate) to finish...\n");
 		ret = tup_flock(sh_lock);
 	}
@@ -104,6 +108,16 @@ int tup_lock_init(void)
 	return 0;
 }
 
+int tup_lock_init(void)
+{
+	return lock_init(1);
+}
+
+int tup_lock_init_nowait(void)
+{
+	return lock_init(0);
+}
+
 void tup_lock_exit(void)
 {
 	tup_unflock(obj_lock);
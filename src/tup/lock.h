@@ -34,6 +34,11 @@
  */
 int tup_lock_init(void);
 
+/** Same as tup_lock_init(), but if another process already holds the shared
+ * lock this returns 1 immediately without taking any locks.
+ */
+int tup_lock_init_nowait(void);
+
 /** Unlocks the object lock and closes the file descriptor. It seems if the
  * OS is left to clean up the lock, it issues a close event before the lock
  * actually becomes available again.
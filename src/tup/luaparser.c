@@ -52,6 +52,7 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <assert.h>
+#include <stdint.h>
 
 #include "luabuiltin/luabuiltin.h" /* Generated from builtin.lua */
 typedef lua_State * scriptdata;
@@ -61,6 +62,36 @@ struct tuplua_reader_data {
 	int read;
 };
 
+/* Setting up a Lua state (registering the tup functions, opening the
+ * libraries and running builtin.lua) costs more than parsing most
+ * Tupfile.lua files, so states are kept in a pool for the parsing phase.
+ * Each directory gets a new global table (see the end of builtin.lua), so
+ * nothing one Tupfile.lua sets is seen by the next. The closures registered
+ * in the state refer to the tuplua_state, which points to whichever tupfile
+ * is using the state right now. Only one Tupfile is
+ * parsed at a time, so the pool needs no locking.
+ */
+struct tuplua_state {
+	struct tuplua_state *next;
+	lua_State *ls;
+	struct tupfile *tf;
+};
+
+/* Included .lua files are cached as bytecode in .tup/luacache, named by the
+ * file's tupid. The header must match the file's mtime and contents for the
+ * bytecode to be used.
+ */
+#define LUACACHE_DIR ".tup/luacache"
+#define LUACACHE_MAGIC "tuplua01"
+
+struct luacache_header {
+	char magic[8];
+	int64_t tupid;
+	int64_t mtime;
+	uint32_t srclen;
+	uint32_t srchash;
+};
+
 struct tuplua_glob_data {
 	lua_State *ls;
 	const char *directory;
@@ -71,6 +102,14 @@ struct tuplua_glob_data {
 static int get_path_list(struct tupfile *tf, const char *p, struct path_list_head *plist);
 
 static int debug_run = 0;
+static struct tuplua_state *state_pool = NULL;
+static int luacache_dir_ok = 0;
+
+static struct tupfile *tuplua_tupfile(struct lua_State *ls)
+{
+	struct tuplua_state *state = lua_touserdata(ls, lua_upvalueindex(1));
+	return state->tf;
+}
 
 static const char *tuplua_tostring(struct lua_State *ls, int strindex)
 {
@@ -131,7 +170,7 @@ static void tuplua_register_function(struct lua_State *ls, const char *name, lua
 
 static int tuplua_function_include(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	char *file = NULL;
 
 	file = tuplua_strdup(ls, -1);
@@ -213,7 +252,7 @@ static char *tuplua_table_tostring(lua_State *ls)
 
 static int tuplua_function_definerule(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	struct rule r;
 	struct path_list_head input_path_list;
 	struct path_list_head extra_input_path_list;
@@ -305,7 +344,7 @@ static int tuplua_function_append_table(lua_State *ls)
 
 static int tuplua_function_getcwd(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	struct estring e;
 
 	lua_settop(ls, 0);
@@ -327,7 +366,7 @@ static int tuplua_function_getcwd(lua_State *ls)
 
 static int tuplua_function_getdirectory(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 
 	if(tf->tupid == DOT_DT) {
 		/* At the top of the tup-hierarchy, we get the
@@ -357,7 +396,7 @@ static int tuplua_function_getdirectory(lua_State *ls)
 
 static int tuplua_function_getrelativedir(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	const char *dirname;
 	tupid_t dest;
 	struct estring e;
@@ -380,7 +419,7 @@ static int tuplua_function_getrelativedir(lua_State *ls)
 
 static int tuplua_function_getconfig(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	const char *name = NULL;
 	size_t name_size = 0;
 	struct tup_entry *tent = NULL;
@@ -434,7 +473,7 @@ static int tuplua_glob_callback(void *arg, struct tup_entry *tent)
 
 static int tuplua_function_glob(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	const char *pattern = NULL;
 	struct path_list_head plist;
 	struct path_list *pl;
@@ -510,7 +549,7 @@ static int tuplua_function_glob(lua_State *ls)
 
 static int tuplua_function_export(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	const char *name = NULL;
 
 	name = tuplua_tostring(ls, -1);
@@ -525,7 +564,7 @@ static int tuplua_function_export(lua_State *ls)
 
 static int tuplua_function_creategitignore(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	tf->ign = 1;
 	return 0;
 }
@@ -535,7 +574,7 @@ static int tuplua_function_creategitignore(lua_State *ls)
 #endif
 static int tuplua_function_chdir(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	const char *filename;
 	const char *mode;
 
@@ -570,7 +609,7 @@ static int tuplua_function_unchdir(lua_State *ls)
 
 static int tuplua_function_run(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	const char *cmdline;
 	struct bin_head bl;
 	LIST_INIT(&bl);
@@ -587,7 +626,7 @@ static int tuplua_function_run(lua_State *ls)
 
 static int tuplua_function_nodevariable(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 
 	lua_settop(ls, 1);
 
@@ -626,7 +665,7 @@ static int tuplua_function_nodevariable(lua_State *ls)
 
 static int tuplua_function_nodevariable_tostring(lua_State *ls)
 {
-	struct tupfile *tf = lua_touserdata(ls, lua_upvalueindex(1));
+	struct tupfile *tf = tuplua_tupfile(ls);
 	int rc = -1;
 	void *stackid;
 	tupid_t tid;
@@ -722,88 +761,338 @@ static char *lua_vardb(void *arg, const char *var, int varlen)
 	return value;
 }
 
-int parse_lua_tupfile(struct tupfile *tf, struct buf *b, const char *name)
+static void close_state(struct tuplua_state *state)
+{
+	lua_close(state->ls);
+	free(state);
+}
+
+static struct tuplua_state *new_state(struct tupfile *tf)
+{
+	struct tuplua_state *state;
+	lua_State *ls;
+
+	state = malloc(sizeof *state);
+	if(!state) {
+		perror("malloc");
+		return NULL;
+	}
+	ls = luaL_newstate();
+	if(!ls) {
+		fprintf(tf->f, "tup error: Unable to create Lua state.\n");
+		free(state);
+		return NULL;
+	}
+	state->next = NULL;
+	state->ls = ls;
+	state->tf = tf;
+	luaL_setoutput(ls, tf->f);
+
+	/* Register tup interaction functions in the "tup" table in Lua */
+	lua_newtable(ls);
+	tuplua_register_function(ls, "include", tuplua_function_include, state);
+	tuplua_register_function(ls, "definerule", tuplua_function_definerule, state);
+	tuplua_register_function(ls, "append_table", tuplua_function_append_table, state);
+	tuplua_register_function(ls, "getcwd", tuplua_function_getcwd, state);
+	tuplua_register_function(ls, "getdirectory", tuplua_function_getdirectory, state);
+	tuplua_register_function(ls, "getrelativedir", tuplua_function_getrelativedir, state);
+	tuplua_register_function(ls, "getconfig", tuplua_function_getconfig, state);
+	tuplua_register_function(ls, "glob", tuplua_function_glob, state);
+	tuplua_register_function(ls, "export", tuplua_function_export, state);
+	tuplua_register_function(ls, "creategitignore", tuplua_function_creategitignore, state);
+	tuplua_register_function(ls, "chdir", tuplua_function_chdir, state);
+	tuplua_register_function(ls, "unchdir", tuplua_function_unchdir, state);
+	tuplua_register_function(ls, "run", tuplua_function_run, state);
+
+	lua_pushlightuserdata(ls, state);
+	lua_newtable(ls);
+	lua_pushlightuserdata(ls, state);
+	lua_pushcclosure(ls, tuplua_function_nodevariable_tostring, 1);
+	lua_setfield(ls, -2, "__tostring");
+	lua_pushlightuserdata(ls, state);
+	lua_pushcclosure(ls, tuplua_function_concat, 1);
+	lua_setfield(ls, -2, "__concat");
+	lua_pushcclosure(ls, tuplua_function_nodevariable, 2);
+	lua_setfield(ls, 1, "nodevariable");
+
+	lua_setglobal(ls, "tup");
+
+	lua_pushlightuserdata(ls, state);
+	lua_setfield(ls, LUA_REGISTRYINDEX, "tup_state");
+
+	/* Load some basic libraries.  Load the debug library so
+	 * tracebacks for errors can be formatted nicely
+	 */
+	luaL_requiref(ls, "_G", luaopen_base, 1); lua_pop(ls, 1);
+	luaL_requiref(ls, LUA_TABLIBNAME, luaopen_table, 1); lua_pop(ls, 1);
+	luaL_requiref(ls, LUA_STRLIBNAME, luaopen_string, 1); lua_pop(ls, 1);
+	luaL_requiref(ls, LUA_BITLIBNAME, luaopen_bit32, 1); lua_pop(ls, 1);
+	luaL_requiref(ls, LUA_MATHLIBNAME, luaopen_math, 1); lua_pop(ls, 1);
+	luaL_requiref(ls, LUA_DBLIBNAME, luaopen_debug, 1); lua_pop(ls, 1);
+	luaL_requiref(ls, LUA_IOLIBNAME, luaopen_io, 1); lua_pop(ls, 1);
+	lua_pushnil(ls); lua_setglobal(ls, "dofile");
+	lua_pushnil(ls); lua_setglobal(ls, "loadfile");
+	lua_pushnil(ls); lua_setglobal(ls, "load");
+	lua_pushnil(ls); lua_setglobal(ls, "require");
+
+	/* Load lua built-in lua helper functions from luabuiltin.h. These
+	 * return the function that makes the global table for each
+	 * directory that uses the state.
+	 */
+	lua_getglobal(ls, "debug");
+	lua_getfield(ls, -1, "traceback");
+	lua_setfield(ls, LUA_REGISTRYINDEX, "tup_traceback");
+	lua_pop(ls, 1);
+	lua_getfield(ls, LUA_REGISTRYINDEX, "tup_traceback");
+	if(luaL_loadbuffer(ls, (char *)builtin_lua, builtin_lua_len, "builtin") != LUA_OK) {
+		fprintf(tf->f, "tup error: Failed to open builtins:\n%s\n", tuplua_tostring(ls, -1));
+		close_state(state);
+		return NULL;
+	}
+	if(lua_pcall(ls, 0, 1, 1) != LUA_OK) {
+		fprintf(tf->f, "tup error: Failed to parse builtins:\n%s\n", tuplua_tostring(ls, -1));
+		close_state(state);
+		return NULL;
+	}
+	lua_setfield(ls, LUA_REGISTRYINDEX, "tup_reset");
+	lua_pop(ls, 1);
+	assert(lua_gettop(ls) == 0);
+	return state;
+}
+
+/* Gives the state a new global table from builtin.lua's reset function.
+ * Returns 0 on success, or -1 if the state should be thrown away instead.
+ */
+static int reset_state(struct tuplua_state *state, struct tupfile *tf)
+{
+	lua_State *ls = state->ls;
+
+	state->tf = tf;
+	luaL_setoutput(ls, tf->f);
+	lua_getfield(ls, LUA_REGISTRYINDEX, "tup_reset");
+	if(lua_pcall(ls, 0, 1, 0) != LUA_OK || !lua_istable(ls, -1)) {
+		lua_settop(ls, 0);
+		return -1;
+	}
+	/* Chunks loaded after this, and lua_getglobal()/lua_setglobal(), use
+	 * the new table.
+	 */
+	lua_rawseti(ls, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+	assert(lua_gettop(ls) == 0);
+	return 0;
+}
+
+static struct tuplua_state *get_state(struct tupfile *tf)
+{
+	struct tuplua_state *state;
+
+	while(state_pool) {
+		state = state_pool;
+		state_pool = state->next;
+		state->next = NULL;
+		if(reset_state(state, tf) == 0)
+			return state;
+		close_state(state);
+	}
+	state = new_state(tf);
+	if(!state)
+		return NULL;
+	if(reset_state(state, tf) < 0) {
+		fprintf(tf->f, "tup error: Unable to set up the globals for a Lua state.\n");
+		close_state(state);
+		return NULL;
+	}
+	return state;
+}
+
+static uint32_t luacache_hash(const char *s, int len)
+{
+	uint32_t hash = 2166136261u;
+	int x;
+
+	for(x=0; x<len; x++) {
+		hash ^= (unsigned char)s[x];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void luacache_fill_header(struct luacache_header *hdr, struct buf *b,
+				 struct tup_entry *tent)
+{
+	memset(hdr, 0, sizeof *hdr);
+	memcpy(hdr->magic, LUACACHE_MAGIC, sizeof(hdr->magic));
+	hdr->tupid = tent->tnode.tupid;
+	hdr->mtime = tent->mtime;
+	hdr->srclen = b->len;
+	hdr->srchash = luacache_hash(b->s, b->len);
+}
+
+static int luacache_path(char *path, int len, struct tup_entry *tent,
+			 const char *suffix)
+{
+	if(snprintf(path, len, LUACACHE_DIR "/%lli%s", tent->tnode.tupid, suffix) >= len) {
+		fprintf(stderr, "tup internal error: luacache path is sized incorrectly.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Pushes the cached chunk for the file onto the stack. Returns -1 if there
+ * isn't a usable one, in which case the stack is unchanged.
+ */
+static int luacache_load(lua_State *ls, struct buf *b, struct tup_entry *tent,
+			 const char *chunkname)
+{
+	struct luacache_header hdr;
+	struct buf cache;
+	struct buf bytecode;
+	struct tuplua_reader_data lrd;
+	char path[PATH_MAX];
+	int fd;
+	int rc = -1;
+
+	if(luacache_path(path, sizeof(path), tent, "") < 0)
+		return -1;
+	fd = openat(tup_top_fd(), path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	if(fslurp(fd, &cache) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	luacache_fill_header(&hdr, b, tent);
+	if(cache.len <= (int)sizeof(hdr) || memcmp(cache.s, &hdr, sizeof(hdr)) != 0)
+		goto out_free;
+
+	bytecode.s = cache.s + sizeof(hdr);
+	bytecode.len = cache.len - sizeof(hdr);
+	lrd.read = 0;
+	lrd.b = &bytecode;
+	if(lua_load(ls, &tuplua_reader, &lrd, chunkname, "b") != LUA_OK) {
+		/* Probably from a different version of Lua - just compile
+		 * it again.
+		 */
+		lua_pop(ls, 1);
+		goto out_free;
+	}
+	rc = 0;
+out_free:
+	free(cache.s);
+	return rc;
+}
+
+static int luacache_writer(lua_State *ls, const void *p, size_t sz, void *ud)
+{
+	struct estring *e = ud;
+	if(ls) {}
+
+	if(estring_append(e, p, sz) < 0)
+		return 1;
+	return 0;
+}
+
+/* Saves the compiled chunk on the top of the stack. Failing to write the
+ * cache isn't an error, it just means we compile the file again next time.
+ */
+static void luacache_save(lua_State *ls, struct buf *b, struct tup_entry *tent)
+{
+	struct luacache_header hdr;
+	struct estring e;
+	char path[PATH_MAX];
+	char tmppath[PATH_MAX];
+	int fd;
+
+	if(!luacache_dir_ok) {
+		if(mkdirat(tup_top_fd(), LUACACHE_DIR, 0777) < 0 && errno != EEXIST) {
+			perror(LUACACHE_DIR);
+			return;
+		}
+		luacache_dir_ok = 1;
+	}
+	if(luacache_path(path, sizeof(path), tent, "") < 0)
+		return;
+	if(luacache_path(tmppath, sizeof(tmppath), tent, ".tmp") < 0)
+		return;
+
+	luacache_fill_header(&hdr, b, tent);
+	if(estring_init(&e) < 0)
+		return;
+	if(estring_append(&e, (const char *)&hdr, sizeof(hdr)) < 0)
+		goto out_free;
+	if(lua_dump(ls, luacache_writer, &e) != 0)
+		goto out_free;
+
+	fd = openat(tup_top_fd(), tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0) {
+		perror(tmppath);
+		goto out_free;
+	}
+	if(write(fd, e.s, e.len) != e.len) {
+		perror("write");
+		close(fd);
+		unlinkat(tup_top_fd(), tmppath, 0);
+		goto out_free;
+	}
+	close(fd);
+	if(renameat(tup_top_fd(), tmppath, tup_top_fd(), path) < 0) {
+		perror(path);
+		unlinkat(tup_top_fd(), tmppath, 0);
+	}
+out_free:
+	free(e.s);
+}
+
+/* Loads the chunk for a Tupfile.lua or included .lua file. If tent is set,
+ * the chunk goes through the bytecode cache. Cached chunks are named by their
+ * path from the top of the tree, since the same bytecode is used no matter
+ * which directory includes the file.
+ */
+static int load_chunk(lua_State *ls, struct buf *b,
+		      const char *name, struct tup_entry *tent)
 {
 	struct tuplua_reader_data lrd;
-	struct lua_State *ls = NULL;
+	char chunkname[PATH_MAX];
 
 	lrd.read = 0;
 	lrd.b = b;
 
+	if(!tent)
+		return lua_load(ls, &tuplua_reader, &lrd, name, 0);
+
+	if(snprint_tup_entry(chunkname, sizeof(chunkname), tent) >= (int)sizeof(chunkname)) {
+		lua_pushliteral(ls, "internal error: chunkname is sized incorrectly.");
+		return LUA_ERRERR;
+	}
+	if(luacache_load(ls, b, tent, chunkname+1) == 0)
+		return LUA_OK;
+	if(lua_load(ls, &tuplua_reader, &lrd, chunkname+1, "t") != LUA_OK)
+		return LUA_ERRSYNTAX;
+	luacache_save(ls, b, tent);
+	return LUA_OK;
+}
+
+int parse_lua_tupfile(struct tupfile *tf, struct buf *b, const char *name,
+		      struct tup_entry *tent)
+{
+	struct lua_State *ls = NULL;
+
 	if(!tf->ls) {
-		ls = luaL_newstate();
-		luaL_setoutput(ls, tf->f);
+		struct tuplua_state *state;
+
+		state = get_state(tf);
+		if(!state)
+			return -1;
+		ls = state->ls;
 		tf->ls = ls;
 
 		tf->vdb.external_vardb = lua_vardb;
 		tf->vdb.external_arg = ls;
 
-		/* Register tup interaction functions in the "tup" table in Lua */
-		lua_newtable(ls);
-		tuplua_register_function(ls, "include", tuplua_function_include, tf);
-		tuplua_register_function(ls, "definerule", tuplua_function_definerule, tf);
-		tuplua_register_function(ls, "append_table", tuplua_function_append_table, tf);
-		tuplua_register_function(ls, "getcwd", tuplua_function_getcwd, tf);
-		tuplua_register_function(ls, "getdirectory", tuplua_function_getdirectory, tf);
-		tuplua_register_function(ls, "getrelativedir", tuplua_function_getrelativedir, tf);
-		tuplua_register_function(ls, "getconfig", tuplua_function_getconfig, tf);
-		tuplua_register_function(ls, "glob", tuplua_function_glob, tf);
-		tuplua_register_function(ls, "export", tuplua_function_export, tf);
-		tuplua_register_function(ls, "creategitignore", tuplua_function_creategitignore, tf);
-		tuplua_register_function(ls, "chdir", tuplua_function_chdir, tf);
-		tuplua_register_function(ls, "unchdir", tuplua_function_unchdir, tf);
-		tuplua_register_function(ls, "run", tuplua_function_run, tf);
-
-		lua_pushlightuserdata(ls, tf);
-		lua_newtable(ls);
-		lua_pushlightuserdata(ls, tf);
-		lua_pushcclosure(ls, tuplua_function_nodevariable_tostring, 1);
-		lua_setfield(ls, -2, "__tostring");
-		lua_pushlightuserdata(ls, tf);
-		lua_pushcclosure(ls, tuplua_function_concat, 1);
-		lua_setfield(ls, -2, "__concat");
-		lua_pushcclosure(ls, tuplua_function_nodevariable, 2);
-		lua_setfield(ls, 1, "nodevariable");
-
-		lua_setglobal(ls, "tup");
-
 		set_vardb(tf, ls);
 
-		/* Load some basic libraries.  Load the debug library so
-		 * tracebacks for errors can be formatted nicely
-		 */
-		luaL_requiref(ls, "_G", luaopen_base, 1); lua_pop(ls, 1);
-		luaL_requiref(ls, LUA_TABLIBNAME, luaopen_table, 1); lua_pop(ls, 1);
-		luaL_requiref(ls, LUA_STRLIBNAME, luaopen_string, 1); lua_pop(ls, 1);
-		luaL_requiref(ls, LUA_BITLIBNAME, luaopen_bit32, 1); lua_pop(ls, 1);
-		luaL_requiref(ls, LUA_MATHLIBNAME, luaopen_math, 1); lua_pop(ls, 1);
-		luaL_requiref(ls, LUA_DBLIBNAME, luaopen_debug, 1); lua_pop(ls, 1);
-		luaL_requiref(ls, LUA_IOLIBNAME, luaopen_io, 1); lua_pop(ls, 1);
-		lua_pushnil(ls); lua_setglobal(ls, "dofile");
-		lua_pushnil(ls); lua_setglobal(ls, "loadfile");
-		lua_pushnil(ls); lua_setglobal(ls, "load");
-		lua_pushnil(ls); lua_setglobal(ls, "require");
-
-		/* Load lua built-in lua helper functions from luabuiltin.h */
-		lua_getglobal(ls, "debug");
-		lua_getfield(ls, -1, "traceback");
-		lua_setfield(ls, LUA_REGISTRYINDEX, "tup_traceback");
-		lua_pop(ls, 1);
-		lua_getfield(ls, LUA_REGISTRYINDEX, "tup_traceback");
-		if(luaL_loadbuffer(ls, (char *)builtin_lua, builtin_lua_len, "builtin") != LUA_OK) {
-			fprintf(tf->f, "tup error: Failed to open builtins:\n%s\n", tuplua_tostring(ls, -1));
-			lua_close(ls);
-			tf->ls = NULL;
-			return -1;
-		}
-		if(lua_pcall(ls, 0, 0, 1) != LUA_OK) {
-			fprintf(tf->f, "tup error: Failed to parse builtins:\n%s\n", tuplua_tostring(ls, -1));
-			lua_close(ls);
-			tf->ls = NULL;
-			return -1;
-		}
-		lua_pop(ls, 1);
-
 		if(parser_include_rules(tf, "Tuprules.lua") < 0) {
 			if(tf->luaerror == TUPLUA_PENDINGERROR) {
 				assert(lua_gettop(ls) == 2);
@@ -820,7 +1109,7 @@ int parse_lua_tupfile(struct tupfile *tf, struct buf *b, const char *name)
 
 	lua_getfield(ls, LUA_REGISTRYINDEX, "tup_traceback");
 
-	if(lua_load(ls, &tuplua_reader, &lrd, name, 0) != LUA_OK) {
+	if(load_chunk(ls, b, name, tent) != LUA_OK) {
 		fprintf(tf->f, "tup error %s\n", tuplua_tostring(ls, -1));
 		tf->luaerror = TUPLUA_PENDINGERROR;
 		assert(lua_gettop(ls) == 2);
@@ -843,8 +1132,35 @@ int parse_lua_tupfile(struct tupfile *tf, struct buf *b, const char *name)
 
 void lua_parser_cleanup(struct tupfile *tf)
 {
-	if(tf->ls)
-		lua_close(tf->ls);
+	struct tuplua_state *state;
+
+	if(!tf->ls)
+		return;
+	lua_getfield(tf->ls, LUA_REGISTRYINDEX, "tup_state");
+	state = lua_touserdata(tf->ls, -1);
+	lua_pop(tf->ls, 1);
+	tf->ls = NULL;
+
+	/* A state that hit an error may be left in any condition, so only
+	 * clean ones go back in the pool.
+	 */
+	if(tf->luaerror != TUPLUA_NOERROR || lua_gettop(state->ls) != 0) {
+		close_state(state);
+		return;
+	}
+	state->tf = NULL;
+	state->next = state_pool;
+	state_pool = state;
+}
+
+void lua_parser_pool_clear(void)
+{
+	while(state_pool) {
+		struct tuplua_state *state = state_pool;
+		state_pool = state->next;
+		close_state(state);
+	}
+	luacache_dir_ok = 0;
 }
 
 void lua_parser_debug_run(void)
@@ -24,9 +24,12 @@
 
 struct tupfile;
 struct buf;
+struct tup_entry;
 
 void lua_parser_debug_run(void);
-int parse_lua_tupfile(struct tupfile *tf, struct buf *b, const char *name);
+int parse_lua_tupfile(struct tupfile *tf, struct buf *b, const char *name,
+		      struct tup_entry *tent);
 void lua_parser_cleanup(struct tupfile *tf);
+void lua_parser_pool_clear(void);
 
 #endif
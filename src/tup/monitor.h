@@ -23,11 +23,13 @@
 
 #define AUTOUPDATE_PID "autoupdate pid"
 #define MONITOR_PID_FILE ".tup/monitor.pid"
+#define MONITOR_SERVER_SOCKET ".tup/server"
 
 int monitor_supported(void);
 int monitor(int argc, char **argv);
 int stop_monitor(int restarting);
 int monitor_get_pid(int restarting, int *pid);
+int monitor_client(int argc, char **argv, int *status);
 
 enum {
 	TUP_MONITOR_SHUTDOWN=0,
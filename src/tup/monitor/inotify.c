@@ -49,6 +49,8 @@
 #include <sys/time.h>
 #include <errno.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "tup/dircache.h"
 #include "tup/debug.h"
 #include "tup/fileio.h"
@@ -65,6 +67,8 @@
 #include "tup/timespan.h"
 #include "tup/variant.h"
 #include "tup/init.h"
+#include "tup/updater.h"
+#include "tup/colors.h"
 
 #define MONITOR_LOOP_RETRY -2
 
@@ -102,16 +106,47 @@ static void monitor_rmdir_cb(tupid_t dt);
 static int handle_event(struct monitor_event *m, int *modified);
 static void pinotify(void);
 static int dump_dircache(void);
-static void sighandler(int sig);
+static void sighandler(int sig, siginfo_t *info, void *ctx);
+static int monitor_signals(void);
+static int server_start(int foreground);
+static int server_stop(void);
+static int server_update(void);
+
+/* Sent by monitor_client(), along with the client's working directory,
+ * stdout, and stderr. The NUL-separated arguments follow.
+ */
+struct server_msg {
+	int pid;
+	int argc;
+	int len;
+};
+
+struct server_request {
+	int pid;
+	int argc;
+	char **argv;
+	char *buf;
+	int fds[3];
+};
+
+#define SERVER_MAX_ARGS (1024 * 1024)
 
 static int inot_fd;
+static int server_sd = -1;
 static int tup_wd;
 static int obj_wd;
 static struct dircache_root droot;
 static struct sigaction sigact = {
-	.sa_handler = sighandler,
-	.sa_flags = 0,
+	.sa_sigaction = sighandler,
+	.sa_flags = SA_SIGINFO,
 };
+/* The 'tup upd' client being served, which forwards SIGINT and SIGTERM to
+ * us. While the update runs, the updater's own handlers take care of them.
+ * See sighandler().
+ */
+static volatile sig_atomic_t client_pid = -1;
+static volatile sig_atomic_t server_updating = 0;
+static volatile sig_atomic_t server_interrupted = 0;
 static struct monitor_event_head event_list;
 static struct monitor_event *queue_last_e = NULL;
 static char **update_argv;
@@ -177,26 +212,8 @@ int monitor(int argc, char **argv)
 	update_argc = argc;
 	update_argv = argv;
 
-	if(sigemptyset(&sigact.sa_mask) < 0) {
-		perror("sigemptyset");
-		return -1;
-	}
-	if(sigaction(SIGINT, &sigact, NULL) < 0) {
-		perror("sigaction");
+	if(monitor_signals() < 0)
 		return -1;
-	}
-	if(sigaction(SIGTERM, &sigact, NULL) < 0) {
-		perror("sigaction");
-		return -1;
-	}
-	if(sigaction(SIGHUP, &sigact, NULL) < 0) {
-		perror("sigaction");
-		return -1;
-	}
-	if(sigaction(SIGUSR1, &sigact, NULL) < 0) {
-		perror("sigaction");
-		return -1;
-	}
 
 	if(stop_monitor(TUP_MONITOR_RESTARTING) < 0) {
 		fprintf(stderr, "tup error: Unable to stop the current monitor process.\n");
@@ -255,6 +272,13 @@ int monitor(int argc, char **argv)
 		}
 	}
 
+	if(tup_option_get_flag("monitor.server")) {
+		if(server_start(foreground) < 0) {
+			rc = -1;
+			goto close_inot;
+		}
+	}
+
 	if(monitor_set_pid(getpid()) < 0) {
 		rc = -1;
 		goto close_inot;
@@ -325,6 +349,8 @@ int monitor(int argc, char **argv)
 	monitor_set_pid(-1);
 
 close_inot:
+	if(server_stop() < 0)
+		rc = -1;
 	if(close(inot_fd) < 0) {
 		perror("close(inot_fd)");
 		rc = -1;
@@ -332,6 +358,482 @@ close_inot:
 	return rc;
 }
 
+static int monitor_signals(void)
+{
+	if(sigemptyset(&sigact.sa_mask) < 0) {
+		perror("sigemptyset");
+		return -1;
+	}
+	if(sigaction(SIGINT, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	if(sigaction(SIGTERM, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	if(sigaction(SIGHUP, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	if(sigaction(SIGUSR1, &sigact, NULL) < 0) {
+		perror("sigaction");
+		return -1;
+	}
+	return 0;
+}
+
+static int server_start(int foreground)
+{
+	struct sockaddr_un addr;
+
+	/* The updater signals its whole process group when it is
+	 * interrupted, so a daemonized monitor gets a group of its own. This
+	 * has to happen before the master_fork process is started so that
+	 * the sub-processes end up in the same group.
+	 */
+	if(!foreground) {
+		if(setsid() < 0) {
+			perror("setsid");
+			return -1;
+		}
+	}
+	if(server_pre_init() < 0)
+		return -1;
+	server_set_persistent(1);
+
+	/* A client that goes away in the middle of an update shouldn't take
+	 * the monitor down with it.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, MONITOR_SERVER_SOCKET);
+
+	if(fchdir(tup_top_fd()) < 0) {
+		perror("fchdir");
+		return -1;
+	}
+	if(unlink(MONITOR_SERVER_SOCKET) < 0 && errno != ENOENT) {
+		perror(MONITOR_SERVER_SOCKET);
+		return -1;
+	}
+	server_sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(server_sd < 0) {
+		perror("socket");
+		return -1;
+	}
+	if(bind(server_sd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		fprintf(stderr, "tup error: Unable to create the update server socket '%s'\n", MONITOR_SERVER_SOCKET);
+		return -1;
+	}
+	if(listen(server_sd, 8) < 0) {
+		perror("listen");
+		return -1;
+	}
+	return 0;
+}
+
+static int server_stop(void)
+{
+	int rc = 0;
+
+	if(server_sd < 0)
+		return 0;
+	if(unlinkat(tup_top_fd(), MONITOR_SERVER_SOCKET, 0) < 0) {
+		perror(MONITOR_SERVER_SOCKET);
+		rc = -1;
+	}
+	if(close(server_sd) < 0) {
+		perror("close(server_sd)");
+		rc = -1;
+	}
+	server_sd = -1;
+	server_set_persistent(0);
+	if(server_quit() < 0)
+		rc = -1;
+	if(server_post_exit() < 0)
+		rc = -1;
+	return rc;
+}
+
+static void free_server_request(struct server_request *req)
+{
+	int x;
+
+	for(x=0; x<3; x++) {
+		if(req->fds[x] >= 0)
+			close(req->fds[x]);
+	}
+	free(req->argv);
+	free(req->buf);
+}
+
+static int server_recv(int sd, struct server_request *req)
+{
+	struct server_msg sm;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(req->fds))];
+	int offset;
+	int x;
+
+	req->argv = NULL;
+	req->buf = NULL;
+	for(x=0; x<3; x++)
+		req->fds[x] = -1;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &sm;
+	iov.iov_len = sizeof(sm);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if(recvmsg(sd, &msg, 0) != sizeof(sm)) {
+		perror("recvmsg");
+		return -1;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+	   cmsg->cmsg_len != CMSG_LEN(sizeof(req->fds))) {
+		fprintf(stderr, "tup monitor: Update request is missing its file descriptors.\n");
+		return -1;
+	}
+	memcpy(req->fds, CMSG_DATA(cmsg), sizeof(req->fds));
+
+	if(sm.argc < 1 || sm.len < sm.argc || sm.len > SERVER_MAX_ARGS) {
+		fprintf(stderr, "tup monitor: Invalid update request (argc=%i, len=%i).\n", sm.argc, sm.len);
+		return -1;
+	}
+	req->buf = malloc(sm.len);
+	req->argv = malloc(sizeof(char*) * (sm.argc + 1));
+	if(!req->buf || !req->argv) {
+		perror("malloc");
+		return -1;
+	}
+	for(offset=0; offset<sm.len; ) {
+		int rc = read(sd, req->buf + offset, sm.len - offset);
+		if(rc <= 0) {
+			if(rc < 0)
+				perror("read");
+			fprintf(stderr, "tup monitor: Short read of the update request.\n");
+			return -1;
+		}
+		offset += rc;
+	}
+	if(req->buf[sm.len-1] != 0) {
+		fprintf(stderr, "tup monitor: Update request arguments are not terminated.\n");
+		return -1;
+	}
+	req->argc = 0;
+	for(offset=0; offset<sm.len; offset += strlen(req->buf + offset) + 1) {
+		if(req->argc == sm.argc) {
+			fprintf(stderr, "tup monitor: Update request has too many arguments.\n");
+			return -1;
+		}
+		req->argv[req->argc] = req->buf + offset;
+		req->argc++;
+	}
+	req->argv[req->argc] = NULL;
+	req->pid = sm.pid;
+	return 0;
+}
+
+/* Runs the update in the monitor process, with the client's stdout/stderr
+ * and working directory standing in for our own. Returns the exit status for
+ * the client, or -1 if the monitor itself can't continue.
+ */
+static int server_run(struct server_request *req)
+{
+	int saved_stdout;
+	int saved_stderr;
+	int status = 1;
+
+	fflush(stdout);
+	fflush(stderr);
+	saved_stdout = dup(STDOUT_FILENO);
+	saved_stderr = dup(STDERR_FILENO);
+	if(saved_stdout < 0 || saved_stderr < 0) {
+		perror("dup");
+		return -1;
+	}
+	if(dup2(req->fds[1], STDOUT_FILENO) < 0 ||
+	   dup2(req->fds[2], STDERR_FILENO) < 0) {
+		perror("dup2");
+		return -1;
+	}
+
+	/* The client's directory determines the default targets, so we
+	 * re-find the top from there.
+	 */
+	if(fchdir(req->fds[0]) < 0) {
+		perror("fchdir");
+		goto out;
+	}
+	if(find_tup_dir() < 0) {
+		fprintf(stderr, "tup error: Unable to find the .tup directory from the client's working directory.\n");
+		goto out;
+	}
+
+	/* Re-read the options with the client's command-line overrides (eg:
+	 * -j), and so the display options see the client's terminal.
+	 */
+	tup_option_exit();
+	if(tup_option_init(req->argc, req->argv) < 0)
+		goto out;
+	color_init();
+
+	if(server_interrupted) {
+		fprintf(stderr, " *** tup: signal caught - the update was not started.\n");
+		goto out;
+	}
+	if(updater(req->argc, req->argv, 0) == 0)
+		status = 0;
+
+out:
+	fflush(stdout);
+	fflush(stderr);
+	if(dup2(saved_stdout, STDOUT_FILENO) < 0 ||
+	   dup2(saved_stderr, STDERR_FILENO) < 0) {
+		perror("dup2");
+		return -1;
+	}
+	close(saved_stdout);
+	close(saved_stderr);
+
+	if(status != 0) {
+		/* A failed update can leave a transaction open, and the
+		 * tup_entrys may not match the database anymore. Start over
+		 * the same way we do after another tup process has run.
+		 */
+		if(tup_db_in_transaction())
+			tup_db_rollback();
+		if(tup_entry_clear() < 0)
+			return -1;
+		variants_free();
+		if(tup_db_begin() < 0)
+			return -1;
+		if(variant_load() < 0)
+			return -1;
+		if(tup_db_commit() < 0)
+			return -1;
+	}
+
+	if(fchdir(tup_top_fd()) < 0) {
+		perror("fchdir");
+		return -1;
+	}
+	if(find_tup_dir() < 0)
+		return -1;
+	tup_option_exit();
+	if(tup_option_init(update_argc, update_argv) < 0)
+		return -1;
+	color_init();
+	if(monitor_signals() < 0)
+		return -1;
+	return status;
+}
+
+static int server_update(void)
+{
+	struct server_request req;
+	int pid = getpid();
+	int status;
+	int sd;
+	int rc;
+
+	sd = accept(server_sd, NULL, NULL);
+	if(sd < 0) {
+		if(errno == EINTR || errno == ECONNABORTED)
+			return 0;
+		perror("accept");
+		return -1;
+	}
+	if(server_recv(sd, &req) < 0) {
+		fprintf(stderr, "tup monitor: Ignoring a bad update request.\n");
+		rc = 0;
+		goto out;
+	}
+
+	/* Bring the database up to date with everything we've seen so far.
+	 * If that fails, the client just gets dropped and runs the update
+	 * on its own.
+	 */
+	rc = flush_queue(0);
+	if(rc < 0)
+		goto out;
+
+	/* The client can interrupt us as soon as it has our pid. */
+	server_interrupted = 0;
+	server_updating = 1;
+	client_pid = req.pid;
+	if(write(sd, &pid, sizeof(pid)) != sizeof(pid)) {
+		perror("write");
+		fprintf(stderr, "tup monitor: Unable to start an update for the client.\n");
+		server_updating = 0;
+		goto out;
+	}
+	DEBUGP("server update\n");
+	status = server_run(&req);
+	server_updating = 0;
+	if(status < 0) {
+		rc = -1;
+		goto out;
+	}
+	if(write(sd, &status, sizeof(status)) != sizeof(status)) {
+		perror("write");
+		fprintf(stderr, "tup monitor: Unable to send the update status to the client.\n");
+	}
+
+out:
+	free_server_request(&req);
+	if(close(sd) < 0) {
+		perror("close(sd)");
+		return -1;
+	}
+	return rc;
+}
+
+static volatile sig_atomic_t client_server_pid = -1;
+
+static void client_sighandler(int sig)
+{
+	/* Pass along the interrupt to the monitor so it can stop the jobs
+	 * that are running on our behalf.
+	 */
+	if(client_server_pid > 0)
+		kill(client_server_pid, sig);
+}
+
+int monitor_client(int argc, char **argv, int *status)
+{
+	struct sockaddr_un addr;
+	struct server_msg sm;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct sigaction client_sigact = {
+		.sa_handler = client_sighandler,
+		.sa_flags = SA_RESTART,
+	};
+	char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+	int fds[3];
+	char *buf;
+	int pid;
+	int sd;
+	int rc;
+	int x;
+	int offset;
+
+	fds[0] = open(".", O_RDONLY);
+	if(fds[0] < 0) {
+		perror(".");
+		return -1;
+	}
+	fds[1] = STDOUT_FILENO;
+	fds[2] = STDERR_FILENO;
+
+	if(find_tup_dir() < 0)
+		goto out_local;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, MONITOR_SERVER_SOCKET);
+	sd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(sd < 0) {
+		perror("socket");
+		goto out_local;
+	}
+	if(connect(sd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		/* No server is listening, so just run the update here. */
+		close(sd);
+		goto out_local;
+	}
+
+	sm.pid = getpid();
+	sm.argc = argc;
+	sm.len = 0;
+	for(x=0; x<argc; x++)
+		sm.len += strlen(argv[x]) + 1;
+	buf = malloc(sm.len);
+	if(!buf) {
+		perror("malloc");
+		goto out_err;
+	}
+	for(x=0, offset=0; x<argc; x++) {
+		strcpy(buf + offset, argv[x]);
+		offset += strlen(argv[x]) + 1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &sm;
+	iov.iov_len = sizeof(sm);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	if(sendmsg(sd, &msg, 0) != sizeof(sm)) {
+		perror("sendmsg");
+		free(buf);
+		goto out_err;
+	}
+	if(write(sd, buf, sm.len) != sm.len) {
+		perror("write");
+		free(buf);
+		goto out_err;
+	}
+	free(buf);
+
+	rc = read(sd, &pid, sizeof(pid));
+	if(rc == 0) {
+		/* The monitor hung up without starting the update. */
+		close(sd);
+		goto out_local;
+	}
+	if(rc != sizeof(pid)) {
+		perror("read");
+		goto out_err;
+	}
+	client_server_pid = pid;
+	sigemptyset(&client_sigact.sa_mask);
+	sigaction(SIGINT, &client_sigact, NULL);
+	sigaction(SIGTERM, &client_sigact, NULL);
+
+	rc = read(sd, status, sizeof(*status));
+	if(rc != sizeof(*status)) {
+		if(rc < 0)
+			perror("read");
+		fprintf(stderr, "tup error: Lost the connection to the monitor's update server.\n");
+		goto out_err;
+	}
+	close(sd);
+	close(fds[0]);
+	return 1;
+
+out_err:
+	close(sd);
+	close(fds[0]);
+	return -1;
+
+out_local:
+	if(fchdir(fds[0]) < 0) {
+		perror("fchdir");
+		close(fds[0]);
+		return -1;
+	}
+	close(fds[0]);
+	return 0;
+}
+
 static int monitor_set_pid(int pid)
 {
 	char buf[32];
@@ -514,11 +1016,20 @@ static int monitor_loop(void)
 		int offset = 0;
 		struct timeval tv = {0, 100000};
 		int ret;
+		int maxfd = inot_fd;
 		fd_set rfds;
 
 		FD_ZERO(&rfds);
 		FD_SET(inot_fd, &rfds);
-		ret = select(inot_fd+1, &rfds, NULL, NULL, &tv);
+		/* Update requests are only taken while we hold the lock, so
+		 * they can't run alongside another tup process.
+		 */
+		if(server_sd >= 0 && locked) {
+			FD_SET(server_sd, &rfds);
+			if(server_sd > maxfd)
+				maxfd = server_sd;
+		}
+		ret = select(maxfd+1, &rfds, NULL, NULL, &tv);
 		if(ret < 0) {
 			if(errno == EINTR)
 				continue;
@@ -533,6 +1044,14 @@ static int monitor_loop(void)
 					return rc;
 			}
 			x = 0;
+		} else if(!FD_ISSET(inot_fd, &rfds)) {
+			/* Only handle an update request once all of the
+			 * events that happened before it have been read.
+			 */
+			rc = server_update();
+			if(rc < 0)
+				return rc;
+			x = 0;
 		} else {
 			x = read(inot_fd, buf, sizeof(buf));
 			if(x < 0) {
@@ -1226,12 +1745,21 @@ static int dump_dircache(void)
 	return rc;
 }
 
-static void sighandler(int sig)
+static void sighandler(int sig, siginfo_t *info, void *ctx)
 {
+	if(ctx) {}
+
 	if(sig == SIGUSR1) {
 		dircache_debug = 1;
 	} else if(sig == SIGHUP) {
 		monitor_quit = 1;
+	} else if(client_pid > 0 && info->si_pid == client_pid) {
+		/* A client's interrupt only stops its own update. Here we
+		 * haven't started the updater yet, or it is already done, so
+		 * it must not take down the monitor.
+		 */
+		if(server_updating)
+			server_interrupted = 1;
 	} else {
 		monitor_set_pid(-1);
 		/* TODO: gracefully close, or something? */
@@ -79,6 +79,15 @@ static struct option {
 	{"updater.keep_going", "0", NULL},
 	{"updater.full_deps", "0", NULL},
 	{"updater.warnings", "1", NULL},
+	{"updater.content_hash", "0", NULL},
+	{"updater.vfork", "1", NULL},
+	{"updater.direct_exec", "1", NULL},
+	{"updater.memory_budget", "0", NULL},
+	{"updater.commit_jobs", "0", NULL},
+	{"updater.commit_interval", "0", NULL},
+	{"updater.artifact_cache", "", NULL},
+	{"fuse.num_threads", NULL, cpu_number},
+	{"fuse.lookup_cache", "0", NULL},
 	{"display.color", "auto", NULL},
 	{"display.width", NULL, get_console_width},
 	{"display.progress", NULL, stdout_isatty},
@@ -88,7 +97,9 @@ static struct option {
 	{"monitor.autoupdate", "0", NULL},
 	{"monitor.autoparse", "0", NULL},
 	{"monitor.foreground", "0", NULL},
+	{"monitor.server", "0", NULL},
 	{"db.sync", "1", NULL},
+	{"db.wal", "0", NULL},
 	{"graph.dirs", "0", NULL},
 	{"graph.ghosts", "0", NULL},
 	{"graph.environment", "0", NULL},
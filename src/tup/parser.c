@@ -36,6 +36,7 @@
 #include "server.h"
 #include "variant.h"
 #include "estring.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -65,6 +66,30 @@ struct bang_rule {
 	struct path_list_head extra_outputs;
 };
 
+/* A Tuprules.tup usually just sets variables and !-macros, and the same chain
+ * of them is included by every Tupfile underneath. When include_rules is the
+ * first thing in a Tupfile, the parser state after each Tuprules.tup in the
+ * chain is kept here, keyed by the directory it was included from and the memo
+ * of the Tuprules.tup above it. Other Tupfiles that include the same chain
+ * start from a copy of that state instead of re-parsing each file. Anything
+ * that makes the result depend on the including Tupfile (rules, run-scripts,
+ * nested includes, $(TUP_CWD), &-variables, .gitignore) marks the memo as
+ * unusable, and then those Tupfiles parse the file as usual.
+ */
+struct rules_memo {
+	struct tupid_tree tnode;
+	struct rules_memo *next;
+	struct rules_memo *prev_memo;
+	tupid_t tupid;
+	time_t mtime;
+	int usable;
+	int complete;
+	struct vardb vdb;
+	struct string_entries bang_root;
+	struct tupid_entries env_root;
+	struct tupid_entries inputs;
+};
+
 struct bang_list {
 	TAILQ_ENTRY(bang_list) list;
 	struct bang_rule *br;
@@ -87,6 +112,12 @@ static int open_tupfile(struct tupfile *tf, struct tup_entry *tent,
 			char *path, int *parser_lua);
 static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename);
 static int parse_internal_definitions(struct tupfile *tf);
+static int include_file(struct tupfile *tf, const char *file,
+			struct rules_memo **memop);
+static void memo_dirty(struct tupfile *tf);
+static int add_parser_input(struct tupfile *tf, tupid_t tupid);
+static int copy_bang_tree(struct tupfile *tf, struct string_entries *dest,
+			  struct string_entries *src);
 static int var_ifdef(struct tupfile *tf, const char *var);
 static int eval_eq(struct tupfile *tf, char *expr, char *eol);
 static int error_directive(struct tupfile *tf, char *cmdline);
@@ -94,6 +125,7 @@ static int preload(struct tupfile *tf, char *cmdline);
 static int run_script(struct tupfile *tf, char *cmdline, int lno,
 		      struct bin_head *bl);
 static int gitignore(struct tupfile *tf, tupid_t dt);
+static void keep_output(struct tupfile *tf, struct tup_entry *tent);
 static int check_toplevel_gitignore(struct tupfile *tf);
 static int parse_rule(struct tupfile *tf, char *p, int lno, struct bin_head *bl);
 static int parse_bang_definition(struct tupfile *tf, char *p, int lno);
@@ -142,6 +174,7 @@ static char *tup_printf(struct tupfile *tf, const char *cmd, int cmd_len,
 static int glob_parse(const char *base, int baselen, char *expanded, int *globidx);
 
 static int debug_run = 0;
+static struct tupid_entries rules_memo_root = {NULL};
 
 void parser_debug_run(void)
 {
@@ -232,6 +265,8 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 	}
 	tf.ign = 0;
 	tf.circular_dep_error = 0;
+	tf.memo = NULL;
+	tf.rules_pristine = 0;
 	if(nodedb_init(&tf.node_db) < 0)
 		goto out_server_stop;
 	if(vardb_init(&tf.vdb) < 0)
@@ -245,8 +280,11 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 	 */
 	if(tup_db_dirtype_to_tree(tf.tupid, &g->cmd_delete_root, &g->cmd_delete_count, TUP_NODE_CMD) < 0)
 		goto out_close_vdb;
+	tf.old_outputs = g->gen_delete_count;
+	tf.outputs_changed = 0;
 	if(tup_db_srcid_to_tree(tf.tupid, &g->gen_delete_root, &g->gen_delete_count, TUP_NODE_GENERATED) < 0)
 		goto out_close_vdb;
+	tf.old_outputs = g->gen_delete_count - tf.old_outputs;
 
 	if(refactoring) {
 		if(tup_db_dirtype_to_tree(tf.tupid, &tf.refactoring_cmd_delete_root, NULL, TUP_NODE_CMD) < 0)
@@ -288,10 +326,11 @@ int parse(struct node *n, struct graph *g, struct timespan *retts, int refactori
 		if(fslurp_null(fd, &b) < 0)
 			goto out_close_file;
 		if(!parser_lua) {
+			tf.rules_pristine = 1;
 			if(parse_tupfile(&tf, &b, "Tupfile") < 0)
 				goto out_free_bs;
 		} else {
-			if(parse_lua_tupfile(&tf, &b, path) < 0)
+			if(parse_lua_tupfile(&tf, &b, path, NULL) < 0)
 				goto out_free_bs;
 		}
 	}
@@ -359,6 +398,8 @@ out_server_stop:
 			rc = -1;
 		if(tup_db_write_dir_inputs(tf.f, tf.tupid, &tf.input_root) < 0)
 			rc = -1;
+		if(!tf.outputs_changed && tf.old_outputs == 0)
+			n->parse_unchanged = 1;
 	}
 
 	pthread_mutex_lock(&ps.lock);
@@ -383,6 +424,15 @@ out_server_stop:
 		memcpy(&retts->end, &tf.ts.end, sizeof(retts->end));
 	}
 	show_result(n->tent, rc != 0, &tf.ts, NULL, 0);
+	if(trace_enabled()) {
+		/* The trace shows the real wall time, so Tupfiles that are
+		 * parsed from here nest inside of our span.
+		 */
+		struct timespan tts;
+		memcpy(&tts.start, &orig_start, sizeof(tts.start));
+		memcpy(&tts.end, &tf.ts.end, sizeof(tts.end));
+		trace_span("parse", n->tent, &tts, NULL);
+	}
 	if(fflush(tf.f) != 0) {
 		/* Use perror, since we're trying to flush the tf.f output */
 		perror("fflush");
@@ -538,6 +588,9 @@ static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename
 		strncpy(line_debug, line, sizeof(line_debug));
 		memcpy(line_debug + sizeof(line_debug) - 4, "...", 4);
 
+		if(strcmp(line, "include_rules") != 0)
+			tf->rules_pristine = 0;
+
 		rc = 0;
 		if(strcmp(line, "else") == 0) {
 			rc = if_else(&ifs);
@@ -574,6 +627,7 @@ static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename
 		} else if(strncmp(line, "include ", 8) == 0) {
 			char *file;
 
+			memo_dirty(tf);
 			file = line + 8;
 			file = eval(tf, file, ALLOW_NODES);
 			if(!file) {
@@ -583,16 +637,21 @@ static int parse_tupfile(struct tupfile *tf, struct buf *b, const char *filename
 				free(file);
 			}
 		} else if(strcmp(line, "include_rules") == 0) {
+			memo_dirty(tf);
 			rc = parser_include_rules(tf, "Tuprules.tup");
 		} else if(strncmp(line, "preload ", 8) == 0) {
+			memo_dirty(tf);
 			rc = preload(tf, line+8);
 		} else if(strncmp(line, "run ", 4) == 0) {
+			memo_dirty(tf);
 			rc = run_script(tf, line+4, lno, &bl);
 		} else if(strncmp(line, "export ", 7) == 0) {
 			rc = export(tf, line+7);
 		} else if(strcmp(line, ".gitignore") == 0) {
+			memo_dirty(tf);
 			tf->ign = 1;
 		} else if(line[0] == ':') {
+			memo_dirty(tf);
 			rc = parse_rule(tf, line+1, lno, &bl);
 		} else if(line[0] == '!') {
 			rc = parse_bang_definition(tf, line, lno);
@@ -685,7 +744,7 @@ static int var_ifdef(struct tupfile *tf, const char *var)
 	} else {
 		rc = 0;
 	}
-	if(tupid_tree_add_dup(&tf->input_root, tent->tnode.tupid) < 0)
+	if(add_parser_input(tf, tent->tnode.tupid) < 0)
 		return -1;
 	return rc;
 }
@@ -719,6 +778,8 @@ int parser_include_rules(struct tupfile *tf, const char *tuprules)
 	char *path;
 	char *p;
 	int x;
+	struct rules_memo *memo = NULL;
+	struct rules_memo **memop = NULL;
 
 	num_dotdots = 0;
 	tent = tf->curtent;
@@ -738,11 +799,22 @@ int parser_include_rules(struct tupfile *tf, const char *tuprules)
 	}
 	strcpy(path + num_dotdots*3, tuprules);
 
+	/* Only a Tupfile that hasn't done anything else yet starts from the
+	 * same state as every other one, so that's when memos can be used.
+	 */
+	if(tf->rules_pristine && strcmp(tuprules, "Tuprules.tup") == 0) {
+		memop = &memo;
+	}
+	tf->rules_pristine = 0;
+
 	p = path;
 	for(x=0; x<=num_dotdots; x++, p += 3) {
-		if(fstatat(tf->cur_dfd, p, &buf, AT_SYMLINK_NOFOLLOW) == 0)
-			if(parser_include_file(tf, p) < 0)
+		if(fstatat(tf->cur_dfd, p, &buf, AT_SYMLINK_NOFOLLOW) == 0) {
+			if(include_file(tf, p, memop) < 0)
 				goto out_free;
+			if(memop && !memo)
+				memop = NULL;
+		}
 	}
 	rc = 0;
 
@@ -1006,10 +1078,15 @@ static int gitignore(struct tupfile *tf, tupid_t dt)
 		}
 		if(tup_db_node_insert_tent(dt, ".gitignore", -1, TUP_NODE_GENERATED, -1, dt, &tent) < 0)
 			return -1;
+		tf->outputs_changed = 1;
 	} else {
-		tree_entry_remove(&tf->g->gen_delete_root,
-				  tent->tnode.tupid,
-				  &tf->g->gen_delete_count);
+		if(dt == tf->tupid) {
+			keep_output(tf, tent);
+		} else {
+			tree_entry_remove(&tf->g->gen_delete_root,
+					  tent->tnode.tupid,
+					  &tf->g->gen_delete_count);
+		}
 		/* It may be a ghost if we are going from a variant
 		 * to an in-tree build.
 		 */
@@ -1023,6 +1100,23 @@ static int gitignore(struct tupfile *tf, tupid_t dt)
 	return 0;
 }
 
+static void keep_output(struct tupfile *tf, struct tup_entry *tent)
+{
+	/* Anything that isn't one of our old outputs means the set of files
+	 * visible to dependent Tupfiles has changed. Nodes still have their
+	 * old srcid at this point, so an output taken over from another
+	 * Tupfile counts as new.
+	 */
+	if(tent->srcid == tf->tupid &&
+	   tupid_tree_search(&tf->g->gen_delete_root, tent->tnode.tupid) != NULL) {
+		tf->old_outputs--;
+	} else {
+		tf->outputs_changed = 1;
+	}
+	tree_entry_remove(&tf->g->gen_delete_root, tent->tnode.tupid,
+			  &tf->g->gen_delete_count);
+}
+
 static int check_toplevel_gitignore(struct tupfile *tf)
 {
 	int fd;
@@ -1121,6 +1215,139 @@ out_close:
 }
 
 int parser_include_file(struct tupfile *tf, const char *file)
+{
+	return include_file(tf, file, NULL);
+}
+
+static void memo_dirty(struct tupfile *tf)
+{
+	if(tf->memo)
+		tf->memo->usable = 0;
+}
+
+/* Adds a dependency of the Tupfile that doesn't come from reading a file, so
+ * it's also remembered for any Tuprules.tup being memoized.
+ */
+static int add_parser_input(struct tupfile *tf, tupid_t tupid)
+{
+	if(tupid_tree_add_dup(&tf->input_root, tupid) < 0)
+		return -1;
+	if(tf->memo)
+		if(tupid_tree_add_dup(&tf->memo->inputs, tupid) < 0)
+			return -1;
+	return 0;
+}
+
+static void clear_memo(struct rules_memo *memo)
+{
+	vardb_close(&memo->vdb);
+	free_bang_tree(&memo->bang_root);
+	free_tupid_tree(&memo->env_root);
+	free_tupid_tree(&memo->inputs);
+}
+
+static struct rules_memo *find_memo(tupid_t dt, struct rules_memo *prev_memo)
+{
+	struct tupid_tree *tt;
+	struct rules_memo *memo;
+
+	tt = tupid_tree_search(&rules_memo_root, dt);
+	if(!tt)
+		return NULL;
+	for(memo = container_of(tt, struct rules_memo, tnode); memo; memo = memo->next) {
+		if(memo->prev_memo == prev_memo)
+			return memo;
+	}
+	return NULL;
+}
+
+static struct rules_memo *new_memo(tupid_t dt, struct rules_memo *prev_memo)
+{
+	struct tupid_tree *tt;
+	struct rules_memo *memo;
+
+	memo = malloc(sizeof *memo);
+	if(!memo) {
+		perror("malloc");
+		return NULL;
+	}
+	memo->tnode.tupid = dt;
+	memo->next = NULL;
+	memo->prev_memo = prev_memo;
+	memo->usable = 0;
+	memo->complete = 0;
+	vardb_init(&memo->vdb);
+	RB_INIT(&memo->bang_root);
+	RB_INIT(&memo->env_root);
+	RB_INIT(&memo->inputs);
+
+	tt = tupid_tree_search(&rules_memo_root, dt);
+	if(tt) {
+		struct rules_memo *head = container_of(tt, struct rules_memo, tnode);
+		memo->next = head->next;
+		head->next = memo;
+	} else {
+		tupid_tree_insert(&rules_memo_root, &memo->tnode);
+	}
+	return memo;
+}
+
+static int save_memo(struct tupfile *tf, struct rules_memo *memo)
+{
+	if(vardb_clone(&memo->vdb, &tf->vdb) < 0)
+		return -1;
+	if(copy_bang_tree(tf, &memo->bang_root, &tf->bang_root) < 0)
+		return -1;
+	if(tupid_tree_copy_dup(&memo->env_root, &tf->env_root) < 0)
+		return -1;
+	return 0;
+}
+
+static int load_memo(struct tupfile *tf, struct rules_memo *memo)
+{
+	vardb_close(&tf->vdb);
+	if(vardb_clone(&tf->vdb, &memo->vdb) < 0)
+		return -1;
+	free_bang_tree(&tf->bang_root);
+	if(copy_bang_tree(tf, &tf->bang_root, &memo->bang_root) < 0)
+		return -1;
+	free_tupid_tree(&tf->env_root);
+	if(tupid_tree_copy_dup(&tf->env_root, &memo->env_root) < 0)
+		return -1;
+
+	/* The rules file itself would otherwise have been picked up as a
+	 * dependency when the parser server saw it being read.
+	 */
+	if(tupid_tree_add_dup(&tf->input_root, memo->tupid) < 0)
+		return -1;
+	if(tupid_tree_copy_dup(&tf->input_root, &memo->inputs) < 0)
+		return -1;
+	return 0;
+}
+
+void parser_rules_memo_clear(void)
+{
+	while(!RB_EMPTY(&rules_memo_root)) {
+		struct tupid_tree *tt = RB_ROOT(&rules_memo_root);
+		struct rules_memo *memo = container_of(tt, struct rules_memo, tnode);
+
+		tupid_tree_rm(&rules_memo_root, tt);
+		while(memo) {
+			struct rules_memo *next = memo->next;
+			clear_memo(memo);
+			free(memo);
+			memo = next;
+		}
+	}
+}
+
+/* If memop is set, the file is a Tuprules.tup in an include_rules chain and
+ * *memop is the memo of the one above it (NULL for the first). On return
+ * *memop is this file's memo, or NULL if the rest of the chain can't use
+ * memos.
+ */
+static int include_file(struct tupfile *tf, const char *file,
+			struct rules_memo **memop)
 {
 	struct buf incb;
 	int fd;
@@ -1133,6 +1360,7 @@ int parser_include_file(struct tupfile *tf, const char *file)
 	int old_dfd = tf->cur_dfd;
 	struct tup_entry *srctent = NULL;
 	struct tup_entry *newtent;
+	struct rules_memo *memo = NULL;
 	char *lua;
 
 	if(get_path_elements(file, &pg) < 0)
@@ -1169,6 +1397,37 @@ int parser_include_file(struct tupfile *tf, const char *file)
 		goto out_free_pel;
 	}
 
+	if(memop) {
+		memo = find_memo(newdt, *memop);
+		if(memo && memo->tupid == tent->tnode.tupid && memo->mtime == tent->mtime) {
+			/* A memo that isn't complete yet is still being
+			 * recorded by a Tupfile further up the stack (a
+			 * dependent Tupfile parsed in the middle of it).
+			 */
+			if(memo->usable && memo->complete) {
+				if(load_memo(tf, memo) < 0)
+					goto out_free_pel;
+				*memop = memo;
+				rc = 0;
+				goto out_free_pel;
+			}
+			memo = NULL;
+		} else {
+			if(!memo) {
+				memo = new_memo(newdt, *memop);
+				if(!memo)
+					goto out_free_pel;
+			}
+			clear_memo(memo);
+			memo->tupid = tent->tnode.tupid;
+			memo->mtime = tent->mtime;
+			memo->usable = 1;
+			memo->complete = 0;
+			tf->memo = memo;
+		}
+		*memop = NULL;
+	}
+
 	tf->cur_dfd = tup_entry_openat(tf->root_fd, tent->parent);
 	if(tf->cur_dfd < 0) {
 		parser_error(tf, file);
@@ -1185,12 +1444,20 @@ int parser_include_file(struct tupfile *tf, const char *file)
 	lua = strstr(file, ".lua");
 	/* strcmp is to make sure .lua is at the end of the filename */
 	if(lua && strcmp(lua, ".lua") == 0) {
-		if(parse_lua_tupfile(tf, &incb, file) < 0)
+		if(parse_lua_tupfile(tf, &incb, file, tent) < 0)
 			goto out_free;
 	} else {
 		if(parse_tupfile(tf, &incb, file) < 0)
 			goto out_free;
 	}
+	if(memo) {
+		if(memo->usable) {
+			if(save_memo(tf, memo) < 0)
+				goto out_free;
+			memo->complete = 1;
+			*memop = memo;
+		}
+	}
 	rc = 0;
 out_free:
 	free(incb.s);
@@ -1212,6 +1479,11 @@ out_del_pg:
 out_err:
 	tf->curtent = oldtent;
 	tf->cur_dfd = old_dfd;
+	if(memo) {
+		tf->memo = NULL;
+		if(rc < 0)
+			memo->usable = 0;
+	}
 	if(rc < 0) {
 		fprintf(tf->f, "tup error: Failed to parse included file '%s'\n", file);
 		return -1;
@@ -1435,7 +1707,13 @@ static int parse_bang_definition(struct tupfile *tf, char *p, int lno)
 		struct bang_rule *cur_br;
 
 		cur_br = container_of(st, struct bang_rule, st);
-		free(cur_br->value);
+		if(cur_br->value) {
+			free(cur_br->value);
+		} else {
+			/* Aliased macros own their input and command */
+			free(cur_br->input);
+			free(cur_br->command);
+		}
 		cur_br->foreach = foreach;
 		cur_br->value = alloc_value;
 		cur_br->input = input;
@@ -1529,6 +1807,8 @@ static int set_variable(struct tupfile *tf, char *line)
 
 	if(var[0] == '&') {
 		struct tup_entry *tent;
+
+		memo_dirty(tf);
 		tent = get_tent_dt(tf->curtent->tnode.tupid, value);
 		if(!tent || tent->type == TUP_NODE_GHOST) {
 			/* didn't find the given file; if using a variant, check the source dir */
@@ -1673,6 +1953,55 @@ static void free_bang_rule(struct string_entries *root, struct bang_rule *br)
 	free(br);
 }
 
+/* Copies each !-macro as an aliased macro, so the copy owns its input and
+ * command strings instead of sharing the original's value buffer.
+ */
+static int copy_bang_tree(struct tupfile *tf, struct string_entries *dest,
+			  struct string_entries *src)
+{
+	struct string_tree *st;
+	struct bang_rule *br;
+
+	RB_FOREACH(st, string_entries, src) {
+		struct bang_rule *cur_br = container_of(st, struct bang_rule, st);
+
+		br = alloc_br();
+		if(!br)
+			return -1;
+		br->foreach = cur_br->foreach;
+		if(cur_br->input) {
+			br->input = strdup(cur_br->input);
+			if(!br->input) {
+				parser_error(tf, "strdup");
+				goto err_cleanup_br;
+			}
+		}
+		br->command = strdup(cur_br->command);
+		if(!br->command) {
+			parser_error(tf, "strdup");
+			goto err_cleanup_br;
+		}
+		br->command_len = cur_br->command_len;
+		if(copy_path_list(tf, &br->outputs, &cur_br->outputs) < 0)
+			goto err_cleanup_br;
+		if(copy_path_list(tf, &br->extra_outputs, &cur_br->extra_outputs) < 0)
+			goto err_cleanup_br;
+		if(string_tree_add(dest, &br->st, st->s) < 0) {
+			fprintf(tf->f, "tup internal error: Error inserting bang rule into tree\n");
+			goto err_cleanup_br;
+		}
+	}
+	return 0;
+
+err_cleanup_br:
+	free_path_list(&br->outputs);
+	free_path_list(&br->extra_outputs);
+	free(br->command);
+	free(br->input);
+	free(br);
+	return -1;
+}
+
 static void free_bang_tree(struct string_entries *root)
 {
 	struct string_tree *st;
@@ -3138,8 +3467,7 @@ static int do_rule(struct tupfile *tf, struct rule *r, struct name_list *nl,
 		if(tup_db_create_unique_link(cmdid, onle->tent->tnode.tupid) < 0) {
 			return -1;
 		}
-		tree_entry_remove(&tf->g->gen_delete_root, onle->tent->tnode.tupid,
-				  &tf->g->gen_delete_count);
+		keep_output(tf, onle->tent);
 		if(output_nl) {
 			move_name_list_entry(output_nl, &onl, onle);
 		} else {
@@ -3152,8 +3480,7 @@ static int do_rule(struct tupfile *tf, struct rule *r, struct name_list *nl,
 		if(tup_db_create_unique_link(cmdid, onle->tent->tnode.tupid) < 0) {
 			return -1;
 		}
-		tree_entry_remove(&tf->g->gen_delete_root, onle->tent->tnode.tupid,
-				  &tf->g->gen_delete_count);
+		keep_output(tf, onle->tent);
 		delete_name_list_entry(&extra_onl, onle);
 	}
 
@@ -3624,6 +3951,7 @@ char *eval(struct tupfile *tf, const char *string, int allow_nodes)
 				var = s + 2;
 				if(rparen-var == 7 &&
 				   strncmp(var, "TUP_CWD", 7) == 0) {
+					memo_dirty(tf);
 					if(get_relative_dir(NULL, &e, tf->tupid, tf->curtent->tnode.tupid) < 0) {
 						fprintf(tf->f, "tup internal error: Unable to find relative directory from ID %lli -> %lli\n", tf->tupid, tf->curtent->tnode.tupid);
 						tup_db_print(tf->f, tf->tupid);
@@ -3639,7 +3967,7 @@ char *eval(struct tupfile *tf, const char *string, int allow_nodes)
 					tent = tup_db_get_var(tf->variant, atvar, rparen-atvar, &e);
 					if(!tent)
 						return NULL;
-					if(tupid_tree_add_dup(&tf->input_root, tent->tnode.tupid) < 0)
+					if(add_parser_input(tf, tent->tnode.tupid) < 0)
 						return NULL;
 				} else {
 					if(vardb_copy(&tf->vdb, var, rparen-var, &e) < 0)
@@ -3666,7 +3994,7 @@ char *eval(struct tupfile *tf, const char *string, int allow_nodes)
 				tent = tup_db_get_var(tf->variant, var, rparen-var, &e);
 				if(!tent)
 					return NULL;
-				if(tupid_tree_add_dup(&tf->input_root, tent->tnode.tupid) < 0)
+				if(add_parser_input(tf, tent->tnode.tupid) < 0)
 					return NULL;
 				s = rparen + 1;
 			} else {
@@ -3688,6 +4016,7 @@ char *eval(struct tupfile *tf, const char *string, int allow_nodes)
 					goto syntax_error;
 				}
 
+				memo_dirty(tf);
 				var = s + 2;
 				if (nodedb_copy(&tf->node_db, var, rparen-var, &e,
 				                tf->curtent->tnode.tupid) < 0)
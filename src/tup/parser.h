@@ -40,6 +40,7 @@ struct tup_entry;
 struct graph;
 struct parser_server;
 struct lua_State;
+struct rules_memo;
 
 struct tupfile {
 	tupid_t tupid;
@@ -58,11 +59,15 @@ struct tupfile {
 	struct tupid_entries input_root;
 	struct tupid_entries directory_root;
 	struct tupid_entries refactoring_cmd_delete_root;
+	int old_outputs;
+	int outputs_changed;
 	FILE *f;
 	struct parser_server *ps;
 	struct timespan ts;
 	char ign;
 	char circular_dep_error;
+	struct rules_memo *memo;
+	int rules_pristine;
 	struct lua_State *ls;
 	int luaerror;
 	int use_server;
@@ -162,6 +167,7 @@ void init_rule(struct rule *r);
 int execute_rule(struct tupfile *tf, struct rule *r, struct name_list *output_nl);
 int parser_include_file(struct tupfile *tf, const char *file);
 int parser_include_rules(struct tupfile *tf, const char *tuprules);
+void parser_rules_memo_clear(void);
 
 struct node;
 struct graph;
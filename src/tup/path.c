@@ -29,14 +29,171 @@
 #include "entry.h"
 #include "option.h"
 #include "pel_group.h"
+#include "hash.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
+/* With updater.content_hash enabled, files whose mtime changed are collected
+ * during the scan and hashed on multiple threads afterward, before the results
+ * are saved in the database.
+ */
+struct hash_job {
+	tupid_t dt;
+	time_t mtime;
+	char *name;
+	char *path;
+	char hash[TUP_HASH_SIZE];
+	int rc;
+};
+
+static struct hash_job *hash_jobs = NULL;
+static int num_hash_jobs = 0;
+static int hash_jobs_size = 0;
+static int next_hash_job;
+static pthread_mutex_t hash_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int add_hash_job(struct tup_entry *tent, time_t mtime)
+{
+	struct hash_job *job;
+	char path[PATH_MAX];
+
+	if(num_hash_jobs == hash_jobs_size) {
+		struct hash_job *tmp;
+		hash_jobs_size = hash_jobs_size ? hash_jobs_size * 2 : 64;
+		tmp = realloc(hash_jobs, sizeof(*hash_jobs) * hash_jobs_size);
+		if(!tmp) {
+			perror("realloc");
+			return -1;
+		}
+		hash_jobs = tmp;
+	}
+	snprint_tup_entry(path, sizeof(path), tent);
+
+	job = &hash_jobs[num_hash_jobs];
+	job->dt = tent->dt;
+	job->mtime = mtime;
+	job->name = strdup(tent->name.s);
+	job->path = strdup(path + 1);
+	job->rc = -1;
+	if(!job->name || !job->path) {
+		perror("strdup");
+		free(job->name);
+		free(job->path);
+		return -1;
+	}
+	num_hash_jobs++;
+	return 0;
+}
+
+static void *hash_thread(void *arg)
+{
+	if(arg) {/* unused */}
+
+	while(1) {
+		struct hash_job *job;
+
+		pthread_mutex_lock(&hash_mutex);
+		if(next_hash_job >= num_hash_jobs) {
+			pthread_mutex_unlock(&hash_mutex);
+			break;
+		}
+		job = &hash_jobs[next_hash_job];
+		next_hash_job++;
+		pthread_mutex_unlock(&hash_mutex);
+
+		job->rc = hash_file(tup_top_fd(), job->path, job->hash);
+	}
+	return NULL;
+}
+
+/* Hashes the files found by the scan, and then saves the results. If apply is
+ * not set, the jobs are just thrown away.
+ */
+static int run_hash_jobs(int apply)
+{
+	pthread_t *pids;
+	int num_threads;
+	int x;
+	int rc = 0;
+
+	if(!num_hash_jobs)
+		return 0;
+	if(!apply) {
+		rc = -1;
+		goto out_free;
+	}
+
+	num_threads = tup_option_get_int("updater.num_jobs");
+	if(num_threads > num_hash_jobs)
+		num_threads = num_hash_jobs;
+	if(num_threads < 1)
+		num_threads = 1;
+	pids = malloc(sizeof(*pids) * num_threads);
+	if(!pids) {
+		perror("malloc");
+		return -1;
+	}
+	next_hash_job = 0;
+	for(x=0; x<num_threads; x++) {
+		if(pthread_create(&pids[x], NULL, hash_thread, NULL) != 0) {
+			perror("pthread_create");
+			num_threads = x;
+			rc = -1;
+			break;
+		}
+	}
+	for(x=0; x<num_threads; x++) {
+		pthread_join(pids[x], NULL);
+	}
+	free(pids);
+
+out_free:
+	for(x=0; x<num_hash_jobs; x++) {
+		struct hash_job *job = &hash_jobs[x];
+
+		if(rc == 0) {
+			/* If we couldn't hash the file, let tup_file_mod_mtime
+			 * sort it out.
+			 */
+			if(job->rc == 0) {
+				if(tup_file_mod_hash(job->dt, job->name, job->mtime, job->hash) < 0)
+					rc = -1;
+			} else {
+				if(tup_file_mod_mtime(job->dt, job->name, job->mtime, 0, 0, NULL) < 0)
+					rc = -1;
+			}
+		}
+		free(job->name);
+		free(job->path);
+	}
+	free(hash_jobs);
+	hash_jobs = NULL;
+	num_hash_jobs = 0;
+	hash_jobs_size = 0;
+	return rc;
+}
+
+static int scan_file(tupid_t dt, const char *file, time_t mtime)
+{
+	if(tup_content_hash_enabled()) {
+		struct tup_entry *tent;
+
+		if(tup_db_select_tent(dt, file, &tent) < 0)
+			return -1;
+		if(tent && tent->type == TUP_NODE_FILE && tent->mtime != mtime)
+			return add_hash_job(tent, mtime);
+	}
+	if(tup_file_mod_mtime(dt, file, mtime, 0, 0, NULL) < 0)
+		return -1;
+	return 0;
+}
+
 static int watch_path_internal(tupid_t dt, const char *file,
 			       int (*callback)(tupid_t newdt, const char *file, int *skip))
 {
@@ -57,11 +214,7 @@ static int watch_path_internal(tupid_t dt, const char *file,
 	}
 
 	if(S_ISREG(buf.st_mode) || S_ISLNK(buf.st_mode)) {
-		tupid_t tupid;
-		tupid = tup_file_mod_mtime(dt, file, MTIME(buf), 0, 0, NULL);
-		if(tupid < 0)
-			return -1;
-		return 0;
+		return scan_file(dt, file, MTIME(buf));
 	} else if(S_ISDIR(buf.st_mode)) {
 		struct tupid_entries root = {NULL};
 		struct tup_entry *tent;
@@ -156,8 +309,358 @@ int watch_path(tupid_t dt, const char *file,
 		perror("fchdir");
 		return -1;
 	}
+	if(run_hash_jobs(rc == 0) < 0)
+		rc = -1;
+	return rc;
+}
+
+#ifdef _WIN32
+/* There is no fdopendir() on Windows, so just use the serial scanner. */
+static int scan_tree(void)
+{
+	return watch_path(0, ".", NULL);
+}
+#else
+/* The parallel scanner. Worker threads read directories and stat their
+ * entries using openat() and fstatat(), so nobody needs to chdir(). Each
+ * directory's results are handed back as one batch, and the main thread walks
+ * the batches in tree order to update the database, the same way
+ * watch_path_internal() does.
+ */
+#define SCAN_GONE 0
+#define SCAN_FILE 1
+#define SCAN_DIR 2
+#define SCAN_OTHER 3
+
+struct scan_dir;
+
+struct scan_entry {
+	char *name;
+	time_t mtime;
+	int type;
+	struct scan_dir *dir;
+};
+
+struct scan_dir {
+	struct scan_dir *next;
+	char *path;
+	struct scan_entry *entries;
+	int num_entries;
+	int size;
+	int done;
+	int rc;
+};
+
+static struct scan_dir *scan_stack;
+static int scan_active;
+static int scan_quit;
+static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t scan_done_cond = PTHREAD_COND_INITIALIZER;
+
+static struct scan_dir *new_scan_dir(const char *parent, const char *name)
+{
+	struct scan_dir *sd;
+
+	sd = malloc(sizeof *sd);
+	if(!sd) {
+		perror("malloc");
+		return NULL;
+	}
+	if(parent) {
+		int len = strlen(parent) + strlen(name) + 2;
+		sd->path = malloc(len);
+		if(sd->path)
+			snprintf(sd->path, len, "%s/%s", parent, name);
+	} else {
+		sd->path = strdup(name);
+	}
+	if(!sd->path) {
+		perror("malloc");
+		free(sd);
+		return NULL;
+	}
+	sd->next = NULL;
+	sd->entries = NULL;
+	sd->num_entries = 0;
+	sd->size = 0;
+	sd->done = 0;
+	sd->rc = 0;
+	return sd;
+}
+
+static void free_scan_dir(struct scan_dir *sd)
+{
+	int x;
+	for(x=0; x<sd->num_entries; x++) {
+		free(sd->entries[x].name);
+	}
+	free(sd->entries);
+	free(sd->path);
+	free(sd);
+}
+
+static struct scan_entry *add_scan_entry(struct scan_dir *sd, const char *name)
+{
+	struct scan_entry *se;
+
+	if(sd->num_entries == sd->size) {
+		struct scan_entry *tmp;
+		sd->size = sd->size ? sd->size * 2 : 16;
+		tmp = realloc(sd->entries, sizeof(*tmp) * sd->size);
+		if(!tmp) {
+			perror("realloc");
+			return NULL;
+		}
+		sd->entries = tmp;
+	}
+	se = &sd->entries[sd->num_entries];
+	se->name = strdup(name);
+	if(!se->name) {
+		perror("strdup");
+		return NULL;
+	}
+	se->mtime = -1;
+	se->type = SCAN_GONE;
+	se->dir = NULL;
+	sd->num_entries++;
+	return se;
+}
+
+/* Reads a single directory. Subdirectories are pushed onto the scan stack for
+ * the other workers to pick up. Returns 0 on success, -ENOENT if the directory
+ * is gone, or -1 on error.
+ */
+static int read_scan_dir(struct scan_dir *sd)
+{
+	struct dirent *ent;
+	DIR *d;
+	int dfd;
+
+	dfd = openat(tup_top_fd(), sd->path, O_RDONLY);
+	if(dfd < 0) {
+		if(errno == ENOENT || errno == ENOTDIR)
+			return -ENOENT;
+		fprintf(stderr, "tup error: Unable to open directory.\n");
+		perror(sd->path);
+		return -1;
+	}
+	d = fdopendir(dfd);
+	if(!d) {
+		perror("fdopendir");
+		close(dfd);
+		return -1;
+	}
+	while((ent = readdir(d)) != NULL) {
+		struct scan_entry *se;
+		struct stat buf;
+
+		se = add_scan_entry(sd, ent->d_name);
+		if(!se)
+			goto err_out;
+		if(ent->d_name[0] == '.' && pel_ignored(ent->d_name, -1))
+			continue;
+
+		if(fstatat(dirfd(d), ent->d_name, &buf, AT_SYMLINK_NOFOLLOW) != 0) {
+			if(errno == ENOENT) {
+				/* The file may have been created and then
+				 * removed before we got here (t7037).
+				 */
+				continue;
+			}
+			fprintf(stderr, "tup error: fstatat failed\n");
+			perror(ent->d_name);
+			goto err_out;
+		}
+		if(S_ISREG(buf.st_mode) || S_ISLNK(buf.st_mode)) {
+			se->type = SCAN_FILE;
+			se->mtime = MTIME(buf);
+		} else if(S_ISDIR(buf.st_mode)) {
+			se->dir = new_scan_dir(sd->path, ent->d_name);
+			if(!se->dir)
+				goto err_out;
+			se->type = SCAN_DIR;
+			pthread_mutex_lock(&scan_mutex);
+			se->dir->next = scan_stack;
+			scan_stack = se->dir;
+			pthread_cond_signal(&scan_work_cond);
+			pthread_mutex_unlock(&scan_mutex);
+		} else {
+			se->type = SCAN_OTHER;
+		}
+	}
+	closedir(d);
+	return 0;
+
+err_out:
+	closedir(d);
+	return -1;
+}
+
+static void *scan_thread(void *arg)
+{
+	if(arg) {/* unused */}
+
+	pthread_mutex_lock(&scan_mutex);
+	while(1) {
+		struct scan_dir *sd;
+
+		while(!scan_stack && scan_active && !scan_quit)
+			pthread_cond_wait(&scan_work_cond, &scan_mutex);
+		if(scan_quit || !scan_stack)
+			break;
+		sd = scan_stack;
+		scan_stack = sd->next;
+		scan_active++;
+		pthread_mutex_unlock(&scan_mutex);
+
+		sd->rc = read_scan_dir(sd);
+
+		pthread_mutex_lock(&scan_mutex);
+		scan_active--;
+		sd->done = 1;
+		pthread_cond_broadcast(&scan_done_cond);
+		if(!scan_stack && !scan_active)
+			pthread_cond_broadcast(&scan_work_cond);
+	}
+	pthread_mutex_unlock(&scan_mutex);
+	return NULL;
+}
+
+/* Updates the database with the results for a single directory, and then
+ * recurses into its subdirectories.
+ */
+static int process_scan_dir(struct tup_entry *tent, struct scan_dir *sd)
+{
+	struct tupid_entries root = {NULL};
+	int x;
+
+	pthread_mutex_lock(&scan_mutex);
+	while(!sd->done)
+		pthread_cond_wait(&scan_done_cond, &scan_mutex);
+	pthread_mutex_unlock(&scan_mutex);
+
+	if(sd->rc == -ENOENT) {
+		/* The directory was removed after we found it (t7037 race
+		 * condition).
+		 */
+		if(tup_file_missing(tent) < 0)
+			return -1;
+		return 0;
+	}
+	if(sd->rc < 0)
+		return -1;
+
+	if(tup_entry_get_dir_tree(tent, &root) < 0)
+		return -1;
+
+	for(x=0; x<sd->num_entries; x++) {
+		struct scan_entry *se = &sd->entries[x];
+		struct tup_entry *subtent;
+
+		if(tup_entry_find_name_in_dir(tent, se->name, -1, &subtent) < 0)
+			return -1;
+		if(subtent) {
+			tupid_tree_remove(&root, subtent->tnode.tupid);
+		}
+		if(se->name[0] == '.') {
+			if(pel_ignored(se->name, -1))
+				continue;
+		}
+		if(se->type == SCAN_FILE) {
+			if(scan_file(tent->tnode.tupid, se->name, se->mtime) < 0)
+				return -1;
+		} else if(se->type == SCAN_DIR) {
+			subtent = tup_db_create_node(tent->tnode.tupid, se->name, TUP_NODE_DIR);
+			if(!subtent)
+				return -1;
+			if(process_scan_dir(subtent, se->dir) < 0)
+				return -1;
+		} else if(se->type == SCAN_OTHER) {
+			fprintf(stderr, "tup error: File '%s' is not regular nor a dir?\n",
+				se->name);
+			return -1;
+		}
+	}
+
+	{
+		struct tupid_tree *tt;
+		while((tt = RB_ROOT(&root)) != NULL) {
+			struct tup_entry *subtent;
+
+			subtent = tup_entry_get(tt->tupid);
+			if(tup_file_missing(subtent) < 0)
+				return -1;
+			tupid_tree_rm(&root, tt);
+			free(tt);
+		}
+	}
+
+	free_scan_dir(sd);
+	return 0;
+}
+
+static int scan_tree(void)
+{
+	struct scan_dir *top;
+	struct tup_entry *tent;
+	pthread_t *pids;
+	int num_threads;
+	int x;
+	int rc;
+
+	tent = tup_db_create_node(0, ".", TUP_NODE_DIR);
+	if(!tent)
+		return -1;
+
+	top = new_scan_dir(NULL, ".");
+	if(!top)
+		return -1;
+	num_threads = tup_option_get_int("updater.num_jobs");
+	if(num_threads < 1)
+		num_threads = 1;
+	pids = malloc(sizeof(*pids) * num_threads);
+	if(!pids) {
+		perror("malloc");
+		return -1;
+	}
+
+	scan_stack = top;
+	scan_active = 0;
+	scan_quit = 0;
+	for(x=0; x<num_threads; x++) {
+		if(pthread_create(&pids[x], NULL, scan_thread, NULL) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+	if(x == 0) {
+		free(pids);
+		free_scan_dir(top);
+		return -1;
+	}
+	num_threads = x;
+
+	rc = process_scan_dir(tent, top);
+
+	/* On success everything has been read already, so this just wakes up
+	 * any idle workers. On failure we stop reading directories, and the
+	 * ones that weren't processed yet are left for the exit to clean up.
+	 */
+	pthread_mutex_lock(&scan_mutex);
+	scan_quit = 1;
+	pthread_cond_broadcast(&scan_work_cond);
+	pthread_mutex_unlock(&scan_mutex);
+	for(x=0; x<num_threads; x++) {
+		pthread_join(pids[x], NULL);
+	}
+	free(pids);
+
+	if(run_hash_jobs(rc == 0) < 0)
+		rc = -1;
 	return rc;
 }
+#endif
 
 static int full_scan_cb(void *arg, struct tup_entry *tent)
 {
@@ -274,7 +777,7 @@ int tup_scan(void)
 {
 	if(tup_db_scan_begin() < 0)
 		return -1;
-	if(watch_path(0, ".", NULL) < 0)
+	if(scan_tree() < 0)
 		return -1;
 	if(scan_full_deps() < 0)
 		return -1;
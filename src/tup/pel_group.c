@@ -293,6 +293,19 @@ void del_pel_group(struct pel_group *pg)
 	}
 }
 
+int snprint_pel_group(char *dest, int len, const struct pel_group *pg)
+{
+	struct path_element *pel;
+	int rc = 0;
+
+	if(TAILQ_EMPTY(&pg->path_list))
+		return snprintf(dest, len, ".");
+	TAILQ_FOREACH(pel, &pg->path_list, list) {
+		rc += snprintf(dest + rc, rc < len ? len - rc : 0, "%s%.*s", rc ? "/" : "", pel->len, pel->path);
+	}
+	return rc;
+}
+
 void print_pel_group(struct pel_group *pg)
 {
 	struct path_element *pel;
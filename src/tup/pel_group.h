@@ -49,6 +49,10 @@ int append_path_elements(struct pel_group *pg, tupid_t dt);
 int pg_eq(const struct pel_group *pga, const struct pel_group *pgb);
 void del_pel(struct path_element *pel, struct pel_group *pg);
 void del_pel_group(struct pel_group *pg);
+/* Writes the path elements separated by '/' (or "." if there are none), and
+ * returns the length of the full path like snprintf().
+ */
+int snprint_pel_group(char *dest, int len, const struct pel_group *pg);
 void print_pel_group(struct pel_group *pg);
 
 #endif
@@ -34,8 +34,8 @@ static int cur_phase = -1;
 static int sum;
 static int sum_width;
 static int total;
-static int job_time;
-static int total_time;
+static time_t job_time;
+static time_t total_time;
 static int max_jobs;
 static int is_active = 0;
 static int color_len;
@@ -47,7 +47,7 @@ static int display_job_time;
 static struct timespan gts;
 static struct timespan main_ts;
 
-static int get_time_remaining(char *dest, int len, int part, int whole, int approx);
+static int get_time_remaining(char *dest, int len, time_t part, time_t whole, int approx);
 
 /* Each of these corresponds to one unit of info that can be displayed inside
  * the progress bar (eg: ETA, Remaining, Active). Maxlen remains constant for
@@ -71,6 +71,8 @@ void progress_init(void)
 	display_job_numbers = tup_option_get_int("display.job_numbers");
 	display_job_time = tup_option_get_int("display.job_time");
 	quiet = tup_option_get_int("display.quiet");
+	cur_phase = -1;
+	got_error = 0;
 	timespan_start(&main_ts);
 }
 
@@ -128,7 +130,7 @@ void tup_main_progress(const char *s)
 	tup_show_message(s);
 }
 
-void start_progress(int new_total, int new_total_time, int new_max_jobs)
+void start_progress(int new_total, time_t new_total_time, int new_max_jobs)
 {
 	int i;
 	char buf[256];
@@ -161,12 +163,16 @@ void start_progress(int new_total, int new_total_time, int new_max_jobs)
 	timespan_start(&gts);
 }
 
-void skip_result(struct tup_entry *tent)
+void skip_result(time_t runtime)
 {
 	sum++;
-	if(tent) {
-		total_time -= tent->mtime;
-	}
+	if(total_time != -1)
+		total_time -= runtime;
+}
+
+void progress_add_time(time_t runtime)
+{
+	job_time += runtime;
 }
 
 static int percent_complete(void)
@@ -189,8 +195,6 @@ void show_result(struct tup_entry *tent, int is_error, struct timespan *ts, cons
 	FILE *f;
 	float tdiff = 0.0;
 
-	job_time += tent->mtime;
-
 	if(ts) {
 		tdiff = timespan_seconds(ts);
 	}
@@ -233,7 +237,7 @@ void show_result(struct tup_entry *tent, int is_error, struct timespan *ts, cons
 	color_error_mode_clear();
 }
 
-static int get_time_remaining(char *dest, int len, int part, int whole, int approx)
+static int get_time_remaining(char *dest, int len, time_t part, time_t whole, int approx)
 {
 	const char *eq = "=";
 
@@ -33,12 +33,15 @@ struct tup_env;
 struct server {
 	struct file_info finfo;
 	int id;
+	int jobnum;
 	int exited;
 	int signalled;
 	int exit_status;
 	int exit_sig;
 	int output_fd;
 	int error_fd;
+	int cpu_ms; /* -1 if the server can't tell */
+	long rss_kb; /* -1 if the server can't tell */
 	pthread_mutex_t *error_mutex;
 };
 
@@ -66,6 +69,7 @@ int server_pre_init(void);
 int server_post_exit(void);
 int server_init(enum server_mode mode);
 int server_quit(void);
+void server_set_persistent(int persistent);
 int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newenv,
 		struct tup_entry *dtent, int need_namespacing);
 int server_postexec(struct server *s);
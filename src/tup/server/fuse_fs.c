@@ -31,6 +31,7 @@
 #include "tup/debug.h"
 #include "tup/server.h"
 #include "tup/container.h"
+#include "tup/trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,8 +47,12 @@ static int access_flags = 0;
 static int access_flags = AT_SYMLINK_NOFOLLOW;
 #endif
 
+/* Large enough for TUP_TMP "/%x" */
+#define TMPNAME_SIZE (sizeof(int) * 2 + sizeof(TUP_TMP) + 1)
+
 static struct thread_root troot = THREAD_ROOT_INITIALIZER;
 static int server_mode = 0;
+static int lookup_cache = 0;
 static pid_t ourpgid;
 static int max_open_files = 128;
 
@@ -72,6 +77,133 @@ void tup_fuse_fs_init(void)
 	}
 }
 
+/* With fuse.lookup_cache, the result of a job's getattr() on a file in the tup
+ * hierarchy is saved once tup_fuse_handle_file() has recorded the read, and a
+ * later stat() of the same path by the same job is answered from here. So
+ * the only lookups that can be cached are ones that are already dependencies
+ * of the job. The job's own outputs and temporary directories are checked
+ * before the cache, so creating a file after a failed stat() still shows it.
+ */
+struct lookup {
+	struct lookup *next;
+	char *path;
+	unsigned int hash;
+	int rc;
+	struct stat st;
+};
+
+struct lookup_cache {
+	struct lookup **buckets;
+	int num_buckets;
+	int count;
+};
+
+static unsigned int lookup_hash(const char *path)
+{
+	unsigned int hash = 5381;
+
+	for(; *path; path++)
+		hash = hash * 33 + (unsigned char)*path;
+	return hash;
+}
+
+static struct lookup *lookup_find(struct file_info *finfo, const char *path)
+{
+	struct lookup_cache *lc = finfo->lookups;
+	struct lookup *l;
+	unsigned int hash;
+
+	if(!lc)
+		return NULL;
+	hash = lookup_hash(path);
+	for(l = lc->buckets[hash & (lc->num_buckets - 1)]; l; l = l->next) {
+		if(l->hash == hash && strcmp(l->path, path) == 0)
+			return l;
+	}
+	return NULL;
+}
+
+/* This is only a cache, so if we run out of memory the lookup just isn't
+ * saved.
+ */
+static void lookup_add(struct file_info *finfo, const char *path, int rc,
+		       const struct stat *st)
+{
+	struct lookup_cache *lc = finfo->lookups;
+	struct lookup **bucket;
+	struct lookup *l;
+
+	if(lookup_find(finfo, path))
+		return;
+	if(!lc) {
+		lc = calloc(1, sizeof(*lc));
+		if(!lc)
+			return;
+		finfo->lookups = lc;
+	}
+	if(lc->count >= lc->num_buckets) {
+		struct lookup **buckets;
+		int num_buckets = lc->num_buckets ? lc->num_buckets * 2 : 64;
+		int x;
+
+		buckets = calloc(num_buckets, sizeof(*buckets));
+		if(!buckets)
+			return;
+		for(x=0; x<lc->num_buckets; x++) {
+			struct lookup *next;
+
+			for(l = lc->buckets[x]; l; l = next) {
+				next = l->next;
+				bucket = &buckets[l->hash & (num_buckets - 1)];
+				l->next = *bucket;
+				*bucket = l;
+			}
+		}
+		free(lc->buckets);
+		lc->buckets = buckets;
+		lc->num_buckets = num_buckets;
+	}
+
+	l = malloc(sizeof(*l));
+	if(!l)
+		return;
+	l->path = strdup(path);
+	if(!l->path) {
+		free(l);
+		return;
+	}
+	l->hash = lookup_hash(path);
+	l->rc = rc;
+	if(rc == 0)
+		l->st = *st;
+	bucket = &lc->buckets[l->hash & (lc->num_buckets - 1)];
+	l->next = *bucket;
+	*bucket = l;
+	lc->count++;
+}
+
+static void free_lookups(struct file_info *finfo)
+{
+	struct lookup_cache *lc = finfo->lookups;
+	int x;
+
+	if(!lc)
+		return;
+	for(x=0; x<lc->num_buckets; x++) {
+		struct lookup *l;
+		struct lookup *next;
+
+		for(l = lc->buckets[x]; l; l = next) {
+			next = l->next;
+			free(l->path);
+			free(l);
+		}
+	}
+	free(lc->buckets);
+	free(lc);
+	finfo->lookups = NULL;
+}
+
 int tup_fuse_add_group(int id, struct file_info *finfo)
 {
 	finfo->tnode.id = id;
@@ -85,6 +217,14 @@ int tup_fuse_add_group(int id, struct file_info *finfo)
 int tup_fuse_rm_group(struct file_info *finfo)
 {
 	thread_tree_rm(&troot, &finfo->tnode);
+
+	/* Another fuse thread may have found the finfo just before it was
+	 * removed from the tree. It locks the finfo before letting go of the
+	 * tree, so once we can get the lock here, nobody else is using it.
+	 */
+	finfo_lock(finfo);
+	finfo_unlock(finfo);
+	free_lookups(finfo);
 	return 0;
 }
 
@@ -93,6 +233,11 @@ void tup_fuse_set_parser_mode(int mode)
 	server_mode = mode;
 }
 
+void tup_fuse_set_lookup_cache(int enabled)
+{
+	lookup_cache = enabled;
+}
+
 static int is_hidden(const char *path)
 {
 	if(strstr(path, "/.git") != NULL)
@@ -125,13 +270,17 @@ static struct file_info *get_finfo(const char *path)
 	path += sizeof(TUP_JOB)-1;
 	jobnum = strtol(path, NULL, 0);
 
-	tt = thread_tree_search(&troot, jobnum);
+	tt = thread_tree_search_rdlock(&troot, jobnum);
 	if(tt) {
 		struct file_info *finfo;
 		finfo = container_of(tt, struct file_info, tnode);
 		finfo_lock(finfo);
+		thread_tree_unlock(&troot);
+		if(trace_enabled())
+			finfo->num_events++;
 		return finfo;
 	}
+	thread_tree_unlock(&troot);
 
 	return NULL;
 }
@@ -141,6 +290,25 @@ static void put_finfo(struct file_info *finfo)
 	finfo_unlock(finfo);
 }
 
+/* Reads and writes on an open file don't need the file_info otherwise, so
+ * this is only done when tracing.
+ */
+static void trace_io(const char *path, int bytes, int is_write)
+{
+	struct file_info *finfo;
+
+	if(bytes <= 0 || !trace_enabled())
+		return;
+	finfo = get_finfo(path);
+	if(finfo) {
+		if(is_write)
+			finfo->bytes_written += bytes;
+		else
+			finfo->bytes_read += bytes;
+		put_finfo(finfo);
+	}
+}
+
 static const char *peel(const char *path)
 {
 	if(!path)
@@ -185,7 +353,11 @@ static const char *prefix_strip(const char *peeled, const char *variant_dir)
 	return NULL;
 }
 
-static struct mapping *add_mapping(const char *path)
+/* The mapping's tmpname is copied out into 'tmpname' (which must be
+ * TMPNAME_SIZE bytes), since another fuse thread may delete the mapping as
+ * soon as we release the finfo lock.
+ */
+static int add_mapping(const char *path, char *tmpname)
 {
 	static int filenum = 0;
 	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
@@ -194,7 +366,6 @@ static struct mapping *add_mapping(const char *path)
 
 	finfo = get_finfo(path);
 	if(finfo) {
-		int size;
 		int myfile;
 		const char *peeled;
 
@@ -203,41 +374,53 @@ static struct mapping *add_mapping(const char *path)
 		if(handle_open_file(ACCESS_WRITE, peeled, finfo) < 0) {
 			/* TODO: Set failure on internal server? */
 			fprintf(stderr, "tup internal error: handle open file failed\n");
-			return NULL;
+			goto err_put;
 		}
 
 		map = malloc(sizeof *map);
 		if(!map) {
 			perror("malloc");
-			return NULL;
+			goto err_put;
 		}
 		map->realname = strdup(peeled);
 		if(!map->realname) {
 			perror("strdup");
-			return NULL;
+			goto err_free_map;
 		}
-		size = sizeof(int) * 2 + sizeof(TUP_TMP) + 1;
-		map->tmpname = malloc(size);
+		map->tmpname = malloc(TMPNAME_SIZE);
 		if(!map->tmpname) {
 			perror("malloc");
-			return NULL;
+			goto err_free_realname;
 		}
 		map->tent = NULL; /* This is used when saving dependencies */
+		map->have_mtime = 0;
 
 		pthread_mutex_lock(&lock);
 		myfile = filenum;
 		filenum++;
 		pthread_mutex_unlock(&lock);
 
-		if(snprintf(map->tmpname, size, TUP_TMP "/%x", myfile) >= size) {
+		if(snprintf(map->tmpname, TMPNAME_SIZE, TUP_TMP "/%x", myfile) >= (signed)TMPNAME_SIZE) {
 			fprintf(stderr, "tup internal error: mapping tmpname is sized incorrectly.\n");
-			return NULL;
+			goto err_free_tmpname;
 		}
 
 		LIST_INSERT_HEAD(&finfo->mapping_list, map, list);
+		strcpy(tmpname, map->tmpname);
 		put_finfo(finfo);
+		return 0;
 	}
-	return map;
+	return -1;
+
+err_free_tmpname:
+	free(map->tmpname);
+err_free_realname:
+	free(map->realname);
+err_free_map:
+	free(map);
+err_put:
+	put_finfo(finfo);
+	return -1;
 }
 
 static struct mapping *find_mapping(struct file_info *finfo, const char *path)
@@ -254,6 +437,22 @@ static struct mapping *find_mapping(struct file_info *finfo, const char *path)
 	return NULL;
 }
 
+/* Same as find_mapping(), but copies the tmpname so it can still be used
+ * after the finfo is unlocked. Returns the copy, or NULL if there is no
+ * mapping for the path.
+ */
+static const char *find_mapping_tmpname(struct file_info *finfo, const char *path,
+					char *tmpname)
+{
+	struct mapping *map;
+
+	map = find_mapping(finfo, path);
+	if(!map)
+		return NULL;
+	strcpy(tmpname, map->tmpname);
+	return tmpname;
+}
+
 static int context_check(void)
 {
 	pid_t pgid;
@@ -324,6 +523,17 @@ static void tup_fuse_handle_file(const char *path, const char *stripped, enum ac
 	}
 }
 
+static int lookup_cacheable(const char *peeled)
+{
+	if(strncmp(peeled, get_tup_top(), get_tup_top_len()) != 0)
+		return 0;
+	if(peeled[get_tup_top_len()] != '/')
+		return 0;
+	if(is_hidden(peeled))
+		return 0;
+	return 1;
+}
+
 static const char *get_virtual_var(const char *peeled, const char *variant_dir)
 {
 	const char *stripped;
@@ -356,12 +566,14 @@ static int tup_fs_getattr(const char *path, struct stat *stbuf)
 {
 	int res;
 	const char *peeled;
-	struct mapping *map;
+	const char *tmpname;
+	char tmpbuf[TMPNAME_SIZE];
 	struct tmpdir *tmpdir;
 	struct file_info *finfo;
 	const char *var;
 	const char *variant_dir = NULL;
 	const char *stripped = NULL;
+	const char *cache_path = NULL;
 	int rc;
 
 	if(context_check() < 0)
@@ -392,11 +604,25 @@ static int tup_fs_getattr(const char *path, struct stat *stbuf)
 				return rc;
 			}
 		}
-		map = find_mapping(finfo, path);
-		if(map)
-			peeled = map->tmpname;
-		else
+		tmpname = find_mapping_tmpname(finfo, path, tmpbuf);
+		if(tmpname) {
+			peeled = tmpname;
+		} else {
 			variant_dir = finfo->variant_dir;
+			if(lookup_cache && lookup_cacheable(peeled)) {
+				struct lookup *l;
+
+				l = lookup_find(finfo, peeled);
+				if(l) {
+					if(l->rc == 0)
+						*stbuf = l->st;
+					rc = l->rc;
+					put_finfo(finfo);
+					return rc;
+				}
+				cache_path = peeled;
+			}
+		}
 		put_finfo(finfo);
 	}
 
@@ -416,13 +642,17 @@ static int tup_fs_getattr(const char *path, struct stat *stbuf)
 			/* skip '/' */
 			var++;
 
+			/* The job may have finished while we weren't
+			 * holding the lock, so look it up again.
+			 */
+			finfo = get_finfo(path);
 			if(finfo) {
-				finfo_lock(finfo);
 				if(handle_open_file(ACCESS_VAR, var, finfo) < 0) {
 					fprintf(stderr, "tup error: Unable to save dependency on @-%s\n", var);
+					put_finfo(finfo);
 					return 1;
 				}
-				finfo_unlock(finfo);
+				put_finfo(finfo);
 			}
 			/* Always return error, since we can't actually open
 			 * an @-variable.
@@ -446,6 +676,17 @@ static int tup_fs_getattr(const char *path, struct stat *stbuf)
 	}
 	tup_fuse_handle_file(path, stripped, ACCESS_READ);
 
+	/* Only a missing file is saved as a failure, since that is what
+	 * gets recorded as a ghost dependency.
+	 */
+	if(cache_path && (rc == 0 || rc == -ENOENT)) {
+		finfo = get_finfo(path);
+		if(finfo) {
+			lookup_add(finfo, cache_path, rc, stbuf);
+			put_finfo(finfo);
+		}
+	}
+
 	return rc;
 }
 
@@ -453,7 +694,8 @@ static int tup_fs_access(const char *path, int mask)
 {
 	int res;
 	const char *peeled;
-	struct mapping *map;
+	const char *tmpname;
+	char tmpbuf[TMPNAME_SIZE];
 	struct file_info *finfo;
 	struct tmpdir *tmpdir;
 	const char *var;
@@ -469,9 +711,9 @@ static int tup_fs_access(const char *path, int mask)
 		int entry_found = 0;
 		int rc = 0;
 
-		map = find_mapping(finfo, path);
-		if(map)
-			peeled = map->tmpname;
+		tmpname = find_mapping_tmpname(finfo, path, tmpbuf);
+		if(tmpname)
+			peeled = tmpname;
 		else
 			variant_dir = finfo->variant_dir;
 
@@ -523,8 +765,9 @@ static int tup_fs_readlink(const char *path, char *buf, size_t size)
 {
 	int res;
 	const char *peeled;
+	const char *tmpname;
+	char tmpbuf[TMPNAME_SIZE];
 	struct file_info *finfo;
-	struct mapping *map;
 	const char *variant_dir = NULL;
 	const char *stripped = NULL;
 
@@ -536,9 +779,9 @@ static int tup_fs_readlink(const char *path, char *buf, size_t size)
 	finfo = get_finfo(path);
 	if(finfo) {
 		variant_dir = finfo->variant_dir;
-		map = find_mapping(finfo, path);
-		if(map)
-			peeled = map->tmpname;
+		tmpname = find_mapping_tmpname(finfo, path, tmpbuf);
+		if(tmpname)
+			peeled = tmpname;
 		put_finfo(finfo);
 	}
 
@@ -776,7 +1019,7 @@ static int tup_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 static int mknod_internal(const char *path, mode_t mode, int flags, int close_fd)
 {
 	int rc;
-	struct mapping *map;
+	char tmpname[TMPNAME_SIZE];
 
 	if(context_check() < 0)
 		return -EPERM;
@@ -784,14 +1027,13 @@ static int mknod_internal(const char *path, mode_t mode, int flags, int close_fd
 	/* On Linux this could just be 'mknod(path, mode, rdev)' but this
 	   is more portable */
 	if (S_ISREG(mode)) {
-		map = add_mapping(path);
-		if(!map) {
+		if(add_mapping(path, tmpname) < 0) {
 			return -ENOMEM;
 		} else {
 			/* TODO: Error check */
 			tup_fuse_handle_file(path, NULL, ACCESS_WRITE);
 
-			rc = openat(tup_top_fd(), map->tmpname, flags, mode);
+			rc = openat(tup_top_fd(), tmpname, flags, mode);
 			if(rc < 0)
 				return -errno;
 			if(close_fd) {
@@ -801,20 +1043,18 @@ static int mknod_internal(const char *path, mode_t mode, int flags, int close_fd
 			}
 		}
 	} else if S_ISFIFO(mode) {
-		map = add_mapping(path);
-		if(!map) {
+		if(add_mapping(path, tmpname) < 0) {
 			return -ENOMEM;
 		} else {
-			rc = mkfifo(map->tmpname, mode);
+			rc = mkfifo(tmpname, mode);
 			if(rc < 0)
 				return -errno;
 		}
 	} else if S_ISSOCK(mode) {
-		map = add_mapping(path);
-		if(!map) {
+		if(add_mapping(path, tmpname) < 0) {
 			return -ENOMEM;
 		} else {
-			rc = mknod(map->tmpname, mode, 0);
+			rc = mknod(tmpname, mode, 0);
 			if(rc < 0)
 				return -errno;
 		}
@@ -941,17 +1181,16 @@ static int tup_fs_rmdir(const char *path)
 static int tup_fs_symlink(const char *from, const char *to)
 {
 	int res;
-	struct mapping *tomap;
+	char tmpname[TMPNAME_SIZE];
 
 	if(context_check() < 0)
 		return -EPERM;
 
-	tomap = add_mapping(to);
-	if(!tomap) {
+	if(add_mapping(to, tmpname) < 0) {
 		return -ENOMEM;
 	}
 
-	res = symlinkat(from, tup_top_fd(), tomap->tmpname);
+	res = symlinkat(from, tup_top_fd(), tmpname);
 	if (res == -1)
 		return -errno;
 
@@ -1244,14 +1483,15 @@ static int tup_fs_read(const char *path, char *buf, size_t size, off_t offset,
 	if(fi->fh == 0) {
 		struct file_info *finfo;
 		const char *openfile;
+		char tmpbuf[TMPNAME_SIZE];
 
 		openfile = peel(path);
 		finfo = get_finfo(path);
 		if(finfo) {
-			struct mapping *map;
-			map = find_mapping(finfo, path);
-			if(map) {
-				openfile = map->tmpname;
+			const char *tmpname;
+			tmpname = find_mapping_tmpname(finfo, path, tmpbuf);
+			if(tmpname) {
+				openfile = tmpname;
 			}
 			put_finfo(finfo);
 		}
@@ -1266,6 +1506,7 @@ static int tup_fs_read(const char *path, char *buf, size_t size, off_t offset,
 	res = pread(fd, buf, size, offset);
 	if (res == -1)
 		res = -errno;
+	trace_io(path, res, 0);
 
 	if(fi->fh == 0) {
 		close(fd);
@@ -1304,6 +1545,7 @@ static int tup_fs_write(const char *path, const char *buf, size_t size,
 	res = pwrite(fd, buf, size, offset);
 	if (res == -1)
 		res = -errno;
+	trace_io(path, res, 1);
 
 	if(fi->fh == 0) {
 		close(fd);
@@ -1312,12 +1554,108 @@ static int tup_fs_write(const char *path, const char *buf, size_t size,
 	return res;
 }
 
+#if FUSE_VERSION >= 29
+/* The _buf versions of read and write let libfuse splice the data between
+ * the file and the fuse device, instead of copying it through our buffers.
+ * This matters for things like linkers that read and write large files.
+ */
+static int tup_fs_read_buf(const char *path, struct fuse_bufvec **bufp,
+			   size_t size, off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec *src;
+
+	src = malloc(sizeof(*src));
+	if(!src)
+		return -ENOMEM;
+	*src = FUSE_BUFVEC_INIT(size);
+
+	if(fi->fh == 0) {
+		/* The file has to be opened just for this read, so it
+		 * can't be spliced after we close it again.
+		 */
+		int res;
+
+		src->buf[0].mem = malloc(size);
+		if(!src->buf[0].mem) {
+			free(src);
+			return -ENOMEM;
+		}
+		res = tup_fs_read(path, src->buf[0].mem, size, offset, fi);
+		if(res < 0) {
+			free(src->buf[0].mem);
+			free(src);
+			return res;
+		}
+		src->buf[0].size = res;
+	} else {
+		src->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		src->buf[0].fd = fi->fh;
+		src->buf[0].pos = offset;
+		if(trace_enabled()) {
+			/* libfuse does the actual read, so use the file size
+			 * to count what it will get back rather than what was
+			 * asked for.
+			 */
+			struct stat st;
+			if(fstat(fi->fh, &st) == 0 && offset < st.st_size) {
+				if((off_t)size > st.st_size - offset)
+					size = st.st_size - offset;
+				trace_io(path, size, 0);
+			}
+		}
+	}
+	*bufp = src;
+	return 0;
+}
+
+static int tup_fs_write_buf(const char *path, struct fuse_bufvec *buf,
+			    off_t offset, struct fuse_file_info *fi)
+{
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(fuse_buf_size(buf));
+	int fd = -1;
+	int res;
+
+	if(fi->fh == 0) {
+		struct file_info *finfo;
+		finfo = get_finfo(path);
+		if(finfo) {
+			struct mapping *map;
+			map = find_mapping(finfo, path);
+			if(map) {
+				fd = openat(tup_top_fd(), map->tmpname, O_WRONLY);
+				if(fd < 0) {
+					put_finfo(finfo);
+					return -errno;
+				}
+			}
+			put_finfo(finfo);
+		}
+		if(fd < 0)
+			return -EPERM;
+	} else {
+		fd = fi->fh;
+	}
+
+	dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	dst.buf[0].fd = fd;
+	dst.buf[0].pos = offset;
+	res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	trace_io(path, res, 1);
+
+	if(fi->fh == 0) {
+		close(fd);
+	}
+	return res;
+}
+#endif
+
 static int tup_fs_statfs(const char *path, struct statvfs *stbuf)
 {
 	int fd;
 	int rc = 0;
 	const char *peeled;
-	struct mapping *map;
+	const char *tmpname;
+	char tmpbuf[TMPNAME_SIZE];
 	struct file_info *finfo;
 	struct tmpdir *tmpdir;
 
@@ -1328,9 +1666,9 @@ static int tup_fs_statfs(const char *path, struct statvfs *stbuf)
 
 	finfo = get_finfo(path);
 	if(finfo) {
-		map = find_mapping(finfo, path);
-		if(map) {
-			peeled = map->tmpname;
+		tmpname = find_mapping_tmpname(finfo, path, tmpbuf);
+		if(tmpname) {
+			peeled = tmpname;
 		} else {
 			LIST_FOREACH(tmpdir, &finfo->tmpdir_list, list) {
 				if(strcmp(tmpdir->dirname, peeled) == 0) {
@@ -1395,7 +1733,14 @@ static int fuse_inited = 0;
 
 static void *tup_fs_init(struct fuse_conn_info *conn)
 {
+#if FUSE_VERSION >= 29
+	/* Use splice for read_buf/write_buf where the kernel supports it. */
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+				       FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
+#else
 	if(conn) {}
+#endif
 	pthread_mutex_lock(&init_lock);
 	fuse_inited = 1;
 	pthread_cond_signal(&init_cond);
@@ -1448,6 +1793,10 @@ struct fuse_operations tup_fs_oper = {
 	.open = tup_fs_open,
 	.read = tup_fs_read,
 	.write = tup_fs_write,
+#if FUSE_VERSION >= 29
+	.read_buf = tup_fs_read_buf,
+	.write_buf = tup_fs_write_buf,
+#endif
 	.statfs = tup_fs_statfs,
 	.release = tup_fs_release,
 	.init = tup_fs_init,
@@ -35,6 +35,7 @@
 #include "tup/container.h"
 #include "tup_fuse_fs.h"
 #include "master_fork.h"
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,21 +54,111 @@ static struct sigaction sigact = {
 };
 static volatile sig_atomic_t sig_quit = 0;
 static int server_inited = 0;
+static int server_persistent = 0;
+static int signals_set = 0;
 static int null_fd = -1;
 static struct parser_server *curps;
 static pthread_mutex_t curps_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_t fuse_tid;
+static int fuse_threads = 1;
+static int job_counter = 0;
+static pthread_mutex_t job_counter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* This is the same as the loop in libfuse's fuse_loop_mt(), except we use a
+ * fixed number of workers so it can be controlled by the fuse.num_threads
+ * option. Each worker blocks reading the next request from the kernel.
+ */
+static void *fuse_worker(void *arg)
+{
+	struct fuse_session *se = arg;
+	struct fuse_chan *ch;
+	size_t bufsize;
+	char *buf;
+
+	ch = fuse_session_next_chan(se, NULL);
+	bufsize = fuse_chan_bufsize(ch);
+	buf = malloc(bufsize);
+	if(!buf) {
+		perror("malloc");
+		fuse_session_exit(se);
+		return NULL;
+	}
+
+	while(!fuse_session_exited(se)) {
+		struct fuse_chan *tmpch = ch;
+		int res;
+#if FUSE_VERSION >= 29
+		/* The _buf variants let the kernel splice write data into a
+		 * pipe, which tup_fs_write_buf can then splice into the file.
+		 */
+		struct fuse_buf fbuf;
+
+		memset(&fbuf, 0, sizeof(fbuf));
+		fbuf.mem = buf;
+		fbuf.size = bufsize;
+		res = fuse_session_receive_buf(se, &fbuf, &tmpch);
+#else
+		res = fuse_chan_recv(&tmpch, buf, bufsize);
+#endif
+		if(res == -EINTR)
+			continue;
+		if(res <= 0) {
+			/* 0 means the filesystem was unmounted */
+			if(res < 0)
+				fuse_session_exit(se);
+			break;
+		}
+#if FUSE_VERSION >= 29
+		fuse_session_process_buf(se, &fbuf, tmpch);
+#else
+		fuse_session_process(se, buf, res, tmpch);
+#endif
+	}
+	free(buf);
+	return NULL;
+}
+
+static void fuse_run_workers(struct fuse *fuse)
+{
+	struct fuse_session *se;
+	pthread_t *workers;
+	int x;
+
+	se = fuse_get_session(fuse);
+	workers = malloc(sizeof(*workers) * fuse_threads);
+	if(!workers) {
+		perror("malloc");
+		return;
+	}
+	/* The first worker is this thread. */
+	for(x=1; x<fuse_threads; x++) {
+		if(pthread_create(&workers[x], NULL, fuse_worker, se) != 0) {
+			perror("pthread_create");
+			fprintf(stderr, "tup warning: Only able to start %i fuse threads.\n", x);
+			break;
+		}
+	}
+	fuse_worker(se);
+	/* Once we return, the filesystem was unmounted, which wakes up all
+	 * the other workers too.
+	 */
+	while(--x > 0) {
+		pthread_join(workers[x], NULL);
+	}
+	free(workers);
+}
 
 static void *fuse_thread(void *arg)
 {
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	struct fuse *fuse;
+	char *mountpoint;
+	int multithreaded;
 	if(arg) {}
 
 	/* Need a garbage arg first to count as the process name */
 	if(fuse_opt_add_arg(&args, "tup") < 0)
 		return NULL;
-	if(fuse_opt_add_arg(&args, "-s") < 0)
-		return NULL;
 	if(fuse_opt_add_arg(&args, "-f") < 0)
 		return NULL;
 	if(fuse_opt_add_arg(&args, TUP_MNT) < 0)
@@ -89,8 +180,16 @@ static void *fuse_thread(void *arg)
 		return NULL;
 #endif
 
-	fuse_main(args.argc, args.argv, &tup_fs_oper, NULL);
+	/* This is fuse_main() split up so that we can run our own loop.
+	 * The multithreaded flag is ignored, since we never pass -s.
+	 */
+	fuse = fuse_setup(args.argc, args.argv, &tup_fs_oper,
+			  sizeof(tup_fs_oper), &mountpoint, &multithreaded, NULL);
 	fuse_opt_free_args(&args);
+	if(!fuse)
+		return NULL;
+	fuse_run_workers(fuse);
+	fuse_teardown(fuse, mountpoint);
 	return NULL;
 }
 
@@ -144,24 +243,8 @@ static int tup_unmount(void)
 	return 0;
 }
 
-int server_init(enum server_mode mode)
+static int server_signals(void)
 {
-	struct flist f = {0, 0, 0};
-
-	tup_fuse_set_parser_mode(mode);
-
-	if(server_inited)
-		return 0;
-
-	tup_fuse_fs_init();
-
-	null_fd = open("/dev/null", O_RDONLY);
-	if(null_fd < 0) {
-		perror("/dev/null");
-		fprintf(stderr, "tup error: Unable to open /dev/null for dup'ing stdin\n");
-		return -1;
-	}
-
 	if(sigemptyset(&sigact.sa_mask) < 0) {
 		perror("sigemptyset");
 		return -1;
@@ -186,6 +269,42 @@ int server_init(enum server_mode mode)
 		perror("sigaction");
 		return -1;
 	}
+	signals_set = 1;
+	return 0;
+}
+
+int server_init(enum server_mode mode)
+{
+	struct flist f = {0, 0, 0};
+
+	tup_fuse_set_parser_mode(mode);
+
+	if(server_inited) {
+		/* A persistent server keeps the mount between updates, but
+		 * the caller (the monitor) has its own signal handlers in
+		 * between.
+		 */
+		if(!signals_set)
+			return server_signals();
+		return 0;
+	}
+
+	tup_fuse_fs_init();
+
+	fuse_threads = tup_option_get_int("fuse.num_threads");
+	if(fuse_threads < 1)
+		fuse_threads = 1;
+	tup_fuse_set_lookup_cache(tup_option_get_int("fuse.lookup_cache"));
+
+	null_fd = open("/dev/null", O_RDONLY);
+	if(null_fd < 0) {
+		perror("/dev/null");
+		fprintf(stderr, "tup error: Unable to open /dev/null for dup'ing stdin\n");
+		return -1;
+	}
+
+	if(server_signals() < 0)
+		return -1;
 
 	if(fchdir(tup_top_fd()) < 0) {
 		perror("fchdir");
@@ -320,10 +439,20 @@ err_out:
 	return -1;
 }
 
+void server_set_persistent(int persistent)
+{
+	server_persistent = persistent;
+}
+
 int server_quit(void)
 {
 	if(!server_inited)
 		return 0;
+	if(server_persistent) {
+		sig_quit = 0;
+		signals_set = 0;
+		return 0;
+	}
 	if(close(null_fd) < 0) {
 		perror("close(null_fd)");
 	}
@@ -361,7 +490,7 @@ static int virt_tup_open(struct parser_server *ps)
 		return -1;
 	}
 
-	snprintf(virtdir, sizeof(virtdir), TUP_JOB "%i", ps->s.id);
+	snprintf(virtdir, sizeof(virtdir), TUP_JOB "%i", ps->s.jobnum);
 	virtdir[sizeof(virtdir)-1] = 0;
 	fd = re_openat(fd, virtdir);
 	if(fd < 0) {
@@ -434,11 +563,30 @@ static int finfo_wait_open_count(struct server *s)
 	return 0;
 }
 
+/* A persistent server keeps the mount between updates, so the kernel may
+ * still have lookups cached in a job directory from the last time the same
+ * command ran. For example, it could think an output that has since been
+ * removed is still there. So there each job gets a new directory for as long
+ * as the file-system is mounted. Otherwise the server id is fine, since each
+ * command only runs once per mount.
+ */
+static void set_jobnum(struct server *s)
+{
+	if(server_persistent) {
+		pthread_mutex_lock(&job_counter_lock);
+		job_counter++;
+		s->jobnum = job_counter;
+		pthread_mutex_unlock(&job_counter_lock);
+	} else {
+		s->jobnum = s->id;
+	}
+}
+
 static int exec_internal(struct server *s, const char *cmd, struct tup_env *newenv,
 			 struct tup_entry *dtent, int single_output, int need_namespacing)
 {
+	struct exec_result res;
 	int status;
-	char buf[64];
 	char job[JOB_MAX];
 	char dir[PATH_MAX];
 	struct execmsg em;
@@ -450,7 +598,7 @@ static int exec_internal(struct server *s, const char *cmd, struct tup_env *newe
 	em.need_namespacing = need_namespacing;
 	em.envlen = newenv->block_size;
 	em.num_env_entries = newenv->num_entries;
-	em.joblen = snprintf(job, sizeof(job), TUP_MNT "/" TUP_JOB "%i", s->id) + 1;
+	em.joblen = snprintf(job, sizeof(job), TUP_MNT "/" TUP_JOB "%i", s->jobnum) + 1;
 
 	/* dirlen includes the \0, which snprintf does not count. Hence the -1/+1
 	 * adjusting.
@@ -470,52 +618,47 @@ static int exec_internal(struct server *s, const char *cmd, struct tup_env *newe
 	em.cmdlen = strlen(cmd) + 1;
 	variant = tup_entry_variant(dtent);
 	em.vardictlen = variant->vardict_len;
-	if(master_fork_exec(&em, job, dir, cmd, newenv->envblock, variant->vardict_file, &status) < 0) {
+	if(master_fork_exec(&em, job, dir, cmd, newenv->envblock, variant->vardict_file, &res) < 0) {
 		server_lock(s);
 		fprintf(stderr, "tup error: Unable to fork sub-process.\n");
 		server_unlock(s);
 		return -1;
 	}
+	status = res.status;
+	s->output_fd = res.output_fd;
+	s->error_fd = res.error_fd;
+	s->cpu_ms = res.cpu_ms;
+	s->rss_kb = res.rss_kb;
 
 	if(finfo_wait_open_count(s) < 0)
 		return -1;
 
-	snprintf(buf, sizeof(buf), ".tup/tmp/output-%i", s->id);
-	buf[sizeof(buf)-1] = 0;
-	s->output_fd = openat(tup_top_fd(), buf, O_RDONLY);
 	if(s->output_fd < 0) {
-		server_lock(s);
-		perror(buf);
-		fprintf(stderr, "tup error: Unable to open sub-process output file.\n");
-		server_unlock(s);
-		return -1;
-	}
-	if(unlinkat(tup_top_fd(), buf, 0) < 0) {
-		server_lock(s);
-		perror(buf);
-		fprintf(stderr, "tup error: Unable to unlink sub-process output file.\n");
-		server_unlock(s);
-		return -1;
-	}
+		/* The master fork process already said why. */
+		s->error_fd = -1;
+	} else {
+		struct stat st;
 
-	if(!single_output) {
-		snprintf(buf, sizeof(buf), ".tup/tmp/errors-%i", s->id);
-		buf[sizeof(buf)-1] = 0;
-		s->error_fd = openat(tup_top_fd(), buf, O_RDWR);
-		if(s->error_fd < 0) {
-			server_lock(s);
-			perror(buf);
-			fprintf(stderr, "tup error: Unable to open sub-process errors file.\n");
-			server_unlock(s);
+		if(fstat(s->output_fd, &st) < 0) {
+			perror("fstat");
 			return -1;
 		}
-		if(unlinkat(tup_top_fd(), buf, 0) < 0) {
-			server_lock(s);
-			perror(buf);
-			fprintf(stderr, "tup error: Unable to unlink sub-process errors file.\n");
-			server_unlock(s);
+		if(single_output && st.st_size == 0) {
+			/* Most commands don't print anything, so don't bother
+			 * reading their output later.
+			 */
+			close(s->output_fd);
+			s->output_fd = -1;
+		} else if(lseek(s->output_fd, 0, SEEK_SET) < 0) {
+			perror("lseek");
 			return -1;
 		}
+		if(!single_output) {
+			if(lseek(s->error_fd, 0, SEEK_SET) < 0) {
+				perror("lseek");
+				return -1;
+			}
+		}
 	}
 
 	if(WIFEXITED(status)) {
@@ -540,7 +683,8 @@ int server_exec(struct server *s, int dfd, const char *cmd, struct tup_env *newe
 
 	if(dfd) {/* TODO */}
 
-	if(tup_fuse_add_group(s->id, &s->finfo) < 0)
+	set_jobnum(s);
+	if(tup_fuse_add_group(s->jobnum, &s->finfo) < 0)
 		return -1;
 
 	rc = exec_internal(s, cmd, newenv, dtent, 1, need_namespacing);
@@ -563,11 +707,18 @@ int server_run_script(FILE *f, tupid_t tupid, const char *cmdline,
 	struct tup_entry *tent;
 	struct server s;
 	struct tup_env te;
+	int rc;
 
 	if(tup_db_get_environ(env_root, NULL, &te) < 0)
 		return -1;
 
 	s.id = tupid;
+	/* The script runs in the parser's job directory, so it sees the same
+	 * files that the Tupfile does.
+	 */
+	pthread_mutex_lock(&curps_lock);
+	s.jobnum = curps ? curps->s.jobnum : tupid;
+	pthread_mutex_unlock(&curps_lock);
 	s.output_fd = -1;
 	s.error_fd = -1;
 	s.exited = 0;
@@ -576,22 +727,23 @@ int server_run_script(FILE *f, tupid_t tupid, const char *cmdline,
 	s.error_mutex = NULL;
 	tent = tup_entry_get(tupid);
 	init_file_info(&s.finfo, tup_entry_variant(tent)->variant_dir);
-	if(exec_internal(&s, cmdline, &te, tent, 0, 0) < 0)
-		return -1;
+	rc = exec_internal(&s, cmdline, &te, tent, 0, 0);
 	environ_free(&te);
+	if(rc < 0)
+		return -1;
 
 	if(display_output(s.error_fd, 1, cmdline, 1, f) < 0)
-		return -1;
+		goto err_close;
 	if(close(s.error_fd) < 0) {
 		perror("close(s.error_fd)");
-		return -1;
+		goto err_close;
 	}
 
 	if(s.exited) {
 		if(s.exit_status == 0) {
 			struct buf b;
 			if(fslurp_null(s.output_fd, &b) < 0)
-				return -1;
+				goto err_close;
 			if(close(s.output_fd) < 0) {
 				perror("close(s.output_fd)");
 				return -1;
@@ -607,6 +759,9 @@ int server_run_script(FILE *f, tupid_t tupid, const char *cmdline,
 			fprintf(f, "tup error: run-script terminated abnormally.\n");
 		}
 	}
+err_close:
+	if(s.output_fd >= 0)
+		close(s.output_fd);
 	return -1;
 }
 
@@ -628,8 +783,9 @@ int server_is_dead(void)
 
 int server_parser_start(struct parser_server *ps)
 {
+	set_jobnum(&ps->s);
 	pthread_mutex_lock(&curps_lock);
-	if(tup_fuse_add_group(ps->s.id, &ps->s.finfo) < 0)
+	if(tup_fuse_add_group(ps->s.jobnum, &ps->s.finfo) < 0)
 		goto err_unlock;
 	if(virt_tup_open(ps) < 0) {
 		goto err_rm_group;
@@ -36,17 +36,33 @@
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
 #include <signal.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+/* Stack for the subprocess between clone() and exec(). Only one child uses it
+ * at a time, since the master fork process is suspended until the child
+ * execs.
+ */
+#define CHILD_STACK_SIZE (256 * 1024)
 
 struct rcmsg {
 	int sid;
 	int status;
+	int cpu_ms;
+	long rss_kb;
+	int num_fds; /* output (and errors) fds passed along with SCM_RIGHTS */
 };
 
 struct child_waiter {
-	pid_t pid;
+	struct tupid_tree tnode; /* keyed by pid */
 	int sid;
+	int output_fd;
+	int error_fd;
 	int umount_dev;
 	char dev[JOB_MAX];
 	char proc[JOB_MAX];
@@ -54,26 +70,50 @@ struct child_waiter {
 
 struct status_tree {
 	struct tupid_tree tnode;
-	int status;
+	struct exec_result res;
 	int set;
 	pthread_cond_t cond;
 };
 
 static pthread_mutex_t statuslock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sendlock = PTHREAD_MUTEX_INITIALIZER;
 static struct tupid_entries status_root = {NULL};
 static pid_t master_fork_pid;
 static int msd[2];
 static pthread_t cw_tid;
 
+/* These are only used inside the master fork process. The main loop adds each
+ * subprocess to waiter_root, and a single child_waiter thread reaps them all.
+ */
+static pthread_mutex_t waiterlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t waitercond = PTHREAD_COND_INITIALIZER;
+static struct tupid_entries waiter_root = {NULL};
+static int num_children = 0;
+static int waiter_quit = 0;
+
 static int master_fork_loop(void);
 static void *child_waiter(void *arg);
 static void *child_wait_notifier(void *arg);
-static int wait_for_my_sid(struct status_tree *st);
+static void wait_for_my_sid(struct status_tree *st, struct exec_result *res);
 static void sighandler(int sig);
 static int inited = 0;
 static int use_namespacing = 1;
 static int privileged = 0;
 static int full_deps;
+static int use_vfork;
+static int use_direct_exec;
+static char *child_stack = NULL;
+
+struct child_args {
+	struct execmsg *em;
+	const char *job;
+	const char *dir;
+	const char *cmd;
+	char **argv; /* NULL if the command has to go through /bin/sh */
+	char **envp;
+	struct child_waiter *waiter;
+	sigset_t *sigmask;
+};
 
 static struct sigaction sigact = {
 	.sa_handler = sighandler,
@@ -141,6 +181,8 @@ int server_pre_init(void)
 	char c = 0;
 	int rc;
 	full_deps = tup_option_get_int("updater.full_deps");
+	use_vfork = tup_option_get_flag("updater.vfork");
+	use_direct_exec = tup_option_get_flag("updater.direct_exec");
 	if(socketpair(AF_LOCAL, SOCK_STREAM, 0, msd) < 0) {
 		perror("socketpair");
 		return -1;
@@ -249,7 +291,7 @@ static int write_all(const void *data, int size)
 
 int master_fork_exec(struct execmsg *em, const char *job, const char *dir,
 		     const char *cmd, const char *envstring,
-		     const char *vardict_file, int *status)
+		     const char *vardict_file, struct exec_result *res)
 {
 	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 	struct status_tree st;
@@ -259,7 +301,11 @@ int master_fork_exec(struct execmsg *em, const char *job, const char *dir,
 		perror("pthread_cond_init");
 		return -1;
 	}
-	st.status = 0;
+	st.res.status = 0;
+	st.res.output_fd = -1;
+	st.res.error_fd = -1;
+	st.res.cpu_ms = -1;
+	st.res.rss_kb = -1;
 	st.set = 0;
 
 	pthread_mutex_lock(&statuslock);
@@ -284,7 +330,7 @@ int master_fork_exec(struct execmsg *em, const char *job, const char *dir,
 	if(write_all(vardict_file, em->vardictlen) < 0)
 		goto err_out;
 	pthread_mutex_unlock(&lock);
-	*status = wait_for_my_sid(&st);
+	wait_for_my_sid(&st, res);
 	return 0;
 
 err_out:
@@ -315,45 +361,12 @@ static int read_all_internal(int sd, void *dest, int size, int line)
 	return 0;
 }
 
-static int setup_subprocess(int sid, const char *job, const char *dir,
-			    const char *dev, const char *proc, int single_output,
+static int setup_subprocess(int ofd, int efd, const char *job, const char *dir,
+			    const char *dev, const char *proc,
 			    int need_namespacing)
 {
-	int ofd, efd;
-	char buf[64];
 	int do_chroot;
 
-	snprintf(buf, sizeof(buf), ".tup/tmp/output-%i", sid);
-	buf[sizeof(buf)-1] = 0;
-	ofd = creat(buf, 0600);
-	if(ofd < 0) {
-		perror(buf);
-		fprintf(stderr, "tup error: Unable to create temporary file for sub-process output.\n");
-		return -1;
-	}
-	if(fchown(ofd, getuid(), getgid()) < 0) {
-		perror("fchown");
-		fprintf(stderr, "tup error: Unable to create temporary file for sub-process output.\n");
-		return -1;
-	}
-
-	if(single_output) {
-		efd = ofd;
-	} else {
-		snprintf(buf, sizeof(buf), ".tup/tmp/errors-%i", sid);
-		buf[sizeof(buf)-1] = 0;
-		efd = creat(buf, 0600);
-		if(efd < 0) {
-			perror(buf);
-			fprintf(stderr, "tup error: Unable to create temporary file for sub-process errors.\n");
-			return -1;
-		}
-		if(fchown(efd, getuid(), getgid()) < 0) {
-			perror("fchown");
-			fprintf(stderr, "tup error: Unable to create temporary file for sub-process errors.\n");
-			return -1;
-		}
-	}
 	if(dup2(ofd, STDOUT_FILENO) < 0) {
 		perror("dup2");
 		fprintf(stderr, "tup error: Unable to dup stdout for the child process.\n");
@@ -368,7 +381,7 @@ static int setup_subprocess(int sid, const char *job, const char *dir,
 		perror("close(ofd)");
 		return -1;
 	}
-	if(!single_output) {
+	if(efd != ofd) {
 		if(close(efd) < 0) {
 			perror("close(efd)");
 			return -1;
@@ -479,18 +492,407 @@ static int setup_subprocess(int sid, const char *job, const char *dir,
 	return 0;
 }
 
+/* Words that only mean something to the shell (keywords and builtins), so a
+ * command that starts with one of them can't be exec'd directly.
+ */
+static const char *shell_words[] = {
+	"!", ".", ":", "alias", "break", "case", "cd", "command", "continue",
+	"do", "done", "elif", "else", "esac", "eval", "exec", "exit", "export",
+	"fi", "for", "function", "getopts", "hash", "if", "local", "read",
+	"readonly", "return", "select", "set", "shift", "source", "then",
+	"time", "times", "trap", "type", "ulimit", "umask", "unalias", "unset",
+	"until", "wait", "while",
+};
+
+static int simple_char(char c)
+{
+	if(c >= 'a' && c <= 'z')
+		return 1;
+	if(c >= 'A' && c <= 'Z')
+		return 1;
+	if(c >= '0' && c <= '9')
+		return 1;
+	switch(c) {
+		case '_':
+		case '-':
+		case '.':
+		case '/':
+		case ',':
+		case '+':
+		case '=':
+		case ':':
+		case '@':
+		case '%':
+			return 1;
+	}
+	return 0;
+}
+
+/* Splits cmd into argv if it is just a list of words that the shell would
+ * pass through unchanged: no quoting, expansions, globs, redirections, or
+ * operators. The words are copied into buf, which must be at least as long as
+ * cmd. Returns the number of words, or 0 if the command has to be run by
+ * /bin/sh.
+ */
+static int split_simple_command(const char *cmd, char *buf, char **argv)
+{
+	const char *p;
+	char *b = buf;
+	int argc = 0;
+	unsigned int x;
+
+	for(p=cmd; *p; p++) {
+		if(*p == ' ' || *p == '\t') {
+			if(b != buf && b[-1] != 0) {
+				*b = 0;
+				b++;
+			}
+			continue;
+		}
+		if(!simple_char(*p))
+			return 0;
+		if(b == buf || b[-1] == 0) {
+			argv[argc] = b;
+			argc++;
+		}
+		*b = *p;
+		b++;
+	}
+	*b = 0;
+	argv[argc] = NULL;
+	if(argc == 0)
+		return 0;
+
+	/* A leading FOO=bar is a variable assignment. */
+	if(strchr(argv[0], '='))
+		return 0;
+	for(x=0; x<sizeof(shell_words) / sizeof(shell_words[0]); x++) {
+		if(strcmp(argv[0], shell_words[x]) == 0)
+			return 0;
+	}
+	return argc;
+}
+
+/* Does the PATH search like the shell would, using the PATH from the
+ * command's environment. This only returns if the shell should run the
+ * command instead, which is the case for a file without a #! line.
+ */
+static void exec_direct(struct child_args *ca)
+{
+	const char *path = NULL;
+	const char *p;
+	char **envp;
+	char file[PATH_MAX];
+	int eacces = 0;
+
+	if(strchr(ca->argv[0], '/')) {
+		execve(ca->argv[0], ca->argv, ca->envp);
+		if(errno == ENOEXEC)
+			return;
+		perror(ca->argv[0]);
+		_exit(errno == ENOENT ? 127 : 126);
+	}
+
+	for(envp=ca->envp; *envp; envp++) {
+		if(strncmp(*envp, "PATH=", 5) == 0) {
+			path = *envp + 5;
+			break;
+		}
+	}
+	/* Let the shell pick its own default search path. */
+	if(!path)
+		return;
+
+	p = path;
+	while(1) {
+		const char *end = strchr(p, ':');
+		int len;
+
+		if(!end)
+			end = p + strlen(p);
+		len = end - p;
+
+		/* An empty PATH entry means the current directory. */
+		if(snprintf(file, sizeof(file), "%.*s/%s", len ? len : 1, len ? p : ".", ca->argv[0]) < (signed)sizeof(file)) {
+			execve(file, ca->argv, ca->envp);
+			if(errno == ENOEXEC)
+				return;
+			if(errno == EACCES) {
+				eacces = 1;
+			} else if(errno != ENOENT && errno != ENOTDIR) {
+				perror(file);
+				_exit(126);
+			}
+		}
+		if(!*end)
+			break;
+		p = end + 1;
+	}
+	if(eacces) {
+		fprintf(stderr, "%s: Permission denied\n", ca->argv[0]);
+		_exit(126);
+	}
+	fprintf(stderr, "%s: not found\n", ca->argv[0]);
+	_exit(127);
+}
+
+/* Sub-process output is captured in an anonymous memory file where the
+ * kernel supports it, so nothing has to be created in .tup/tmp for each
+ * command. Otherwise we fall back to a temporary file that is unlinked right
+ * away. Either way the file descriptor is passed back to the main tup process
+ * along with the exit status.
+ */
+static int create_output_fd(int sid, const char *type)
+{
+	char buf[64];
+	int fd;
+
+#ifdef MFD_CLOEXEC
+	fd = memfd_create(type, MFD_CLOEXEC);
+	if(fd >= 0)
+		return fd;
+	if(errno != ENOSYS) {
+		perror("memfd_create");
+		fprintf(stderr, "tup error: Unable to create memory file for sub-process %s.\n", type);
+		return -1;
+	}
+#endif
+	snprintf(buf, sizeof(buf), ".tup/tmp/%s-%i", type, sid);
+	buf[sizeof(buf)-1] = 0;
+	fd = open(buf, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd < 0) {
+		perror(buf);
+		fprintf(stderr, "tup error: Unable to create temporary file for sub-process %s.\n", type);
+		return -1;
+	}
+	if(unlink(buf) < 0) {
+		perror(buf);
+		fprintf(stderr, "tup error: Unable to unlink temporary file for sub-process %s.\n", type);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int send_status(int sid, int status, const struct rusage *ru,
+		       int output_fd, int error_fd)
+{
+	struct rcmsg rcm;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * 2)];
+	} control;
+	int fds[2];
+	int rc;
+
+	memset(&rcm, 0, sizeof(rcm));
+	rcm.sid = sid;
+	rcm.status = status;
+	rcm.cpu_ms = -1;
+	rcm.rss_kb = -1;
+	if(ru) {
+		rcm.cpu_ms = (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000 +
+			(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1000;
+#ifdef __APPLE__
+		/* ru_maxrss is in bytes on OSX, and kilobytes on Linux */
+		rcm.rss_kb = ru->ru_maxrss / 1024;
+#else
+		rcm.rss_kb = ru->ru_maxrss;
+#endif
+	}
+	rcm.num_fds = 0;
+	if(output_fd >= 0)
+		fds[rcm.num_fds++] = output_fd;
+	if(error_fd >= 0 && error_fd != output_fd)
+		fds[rcm.num_fds++] = error_fd;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &rcm;
+	iov.iov_len = sizeof(rcm);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if(rcm.num_fds) {
+		struct cmsghdr *cmsg;
+
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * rcm.num_fds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * rcm.num_fds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * rcm.num_fds);
+	}
+
+	pthread_mutex_lock(&sendlock);
+	rc = sendmsg(msd[0], &msg, 0);
+	pthread_mutex_unlock(&sendlock);
+	if(rc != sizeof(rcm)) {
+		perror("sendmsg");
+		return -1;
+	}
+	return 0;
+}
+
+static int recv_status(struct rcmsg *rcm, int *fds)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(sizeof(int) * 2)];
+	} control;
+	int rc;
+	int x;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = rcm;
+	iov.iov_len = sizeof(*rcm);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do {
+		rc = recvmsg(msd[1], &msg, 0);
+	} while(rc < 0 && errno == EINTR);
+	if(rc < 0) {
+		perror("recvmsg");
+		fprintf(stderr, "tup error: Unable to read from the master fork socket.\n");
+		return -1;
+	}
+	if(rc == 0) {
+		DEBUGP("tup error: The master fork socket closed before the status was read.\n");
+		return -1;
+	}
+	/* The file descriptors come with the first byte of the message, so
+	 * only the rest of the message might still have to be read.
+	 */
+	if(rc < (signed)sizeof(*rcm)) {
+		if(read_all(msd[1], (char*)rcm + rc, sizeof(*rcm) - rc) < 0)
+			return -1;
+	}
+
+	fds[0] = -1;
+	fds[1] = -1;
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			int num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if(num > 2)
+				num = 2;
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * num);
+		}
+	}
+	/* MSG_CMSG_CLOEXEC is Linux-only, so set close-on-exec afterward. */
+	for(x=0; x<2; x++) {
+		if(fds[x] >= 0 && fcntl(fds[x], F_SETFD, FD_CLOEXEC) < 0) {
+			perror("fcntl");
+			fprintf(stderr, "tup error: Unable to set close-on-exec for sub-process output.\n");
+			if(fds[0] >= 0)
+				close(fds[0]);
+			if(fds[1] >= 0)
+				close(fds[1]);
+			return -1;
+		}
+	}
+	if(msg.msg_flags & MSG_CTRUNC) {
+		fprintf(stderr, "tup error: Sub-process output file descriptors were truncated.\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Runs in the subprocess. When it was started with clone(CLONE_VM), this
+ * shares memory with the master fork process, so it must not allocate
+ * anything, and it has to use _exit() so nothing is flushed or freed on the
+ * way out.
+ */
+static int run_subprocess(void *arg)
+{
+	struct child_args *ca = arg;
+
+	if(close(msd[0]) < 0) {
+		perror("close(msd[0])");
+		_exit(1);
+	}
+	if(setup_subprocess(ca->waiter->output_fd, ca->waiter->error_fd,
+			    ca->job, ca->dir, ca->waiter->dev, ca->waiter->proc,
+			    ca->em->need_namespacing) < 0)
+		_exit(1);
+	if(ca->sigmask) {
+		if(sigprocmask(SIG_SETMASK, ca->sigmask, NULL) < 0) {
+			perror("sigprocmask");
+			_exit(1);
+		}
+	}
+	if(ca->argv)
+		exec_direct(ca);
+	execle("/bin/sh", "/bin/sh", "-e", "-c", ca->cmd, NULL, ca->envp);
+	perror("execl");
+	_exit(1);
+}
+
+static pid_t start_subprocess(struct child_args *ca)
+{
+	pid_t pid;
+
+	ca->sigmask = NULL;
+#ifdef __linux__
+	if(use_vfork) {
+		sigset_t all;
+		sigset_t old;
+
+		/* Keep our signal handlers from running on the child's stack
+		 * before it execs. The child puts the old mask back right
+		 * before the exec.
+		 */
+		sigfillset(&all);
+		if(pthread_sigmask(SIG_SETMASK, &all, &old) != 0) {
+			perror("pthread_sigmask");
+			return -1;
+		}
+		ca->sigmask = &old;
+		pid = clone(run_subprocess, child_stack + CHILD_STACK_SIZE,
+			    CLONE_VM | CLONE_VFORK | SIGCHLD, ca);
+		if(pid < 0)
+			perror("clone");
+		if(pthread_sigmask(SIG_SETMASK, &old, NULL) != 0) {
+			perror("pthread_sigmask");
+			return -1;
+		}
+		return pid;
+	}
+#endif
+	pid = fork();
+	if(pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if(pid == 0)
+		run_subprocess(ca);
+	return pid;
+}
+
 static int master_fork_loop(void)
 {
 	struct execmsg em;
-	pthread_attr_t attr;
+	pthread_t waiter_tid;
 	int null_fd;
 	char job[PATH_MAX];
 	char dir[PATH_MAX];
 	char vardict_file[PATH_MAX];
+	char full_vardict_file[PATH_MAX];
 	char *cmd;
+	char *cmdwords;
+	char **cmdargv;
 	char *env;
+	char **envp = NULL;
 	int cmdsize = 4096;
 	int envsize = 4096;
+	int envpsize = 0;
 	int in_valgrind = 0;
 
 	if(sigemptyset(&sigact.sa_mask) < 0) {
@@ -519,7 +921,12 @@ static int master_fork_loop(void)
 	}
 
 	cmd = malloc(cmdsize);
-	if(!cmd) {
+	cmdwords = malloc(cmdsize);
+	/* Each word takes at least two characters (one for a single
+	 * character, and one for the space after it), plus the NULL.
+	 */
+	cmdargv = malloc((cmdsize / 2 + 2) * sizeof(*cmdargv));
+	if(!cmd || !cmdwords || !cmdargv) {
 		perror("malloc");
 		return -1;
 	}
@@ -532,6 +939,19 @@ static int master_fork_loop(void)
 	if(getenv("TUP_VALGRIND")) {
 		in_valgrind = 1;
 	}
+	/* Valgrind can't follow a clone() that shares memory, and a child
+	 * that drops privileges with setuid() would change them for the
+	 * master fork process too, so those cases use a plain fork().
+	 */
+	if(in_valgrind || tup_privileged())
+		use_vfork = 0;
+	if(use_vfork) {
+		child_stack = malloc(CHILD_STACK_SIZE);
+		if(!child_stack) {
+			perror("malloc");
+			return -1;
+		}
+	}
 	if(clearenv() < 0) {
 		perror("clearenv");
 		return -1;
@@ -553,18 +973,16 @@ static int master_fork_loop(void)
 		exit(1);
 	}
 
-	if(pthread_attr_init(&attr) != 0) {
-		perror("pthread_attr_init");
-		exit(1);
-	}
-	if(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0) {
-		perror("pthread_attr_setdetachstate\n");
+	if(pthread_create(&waiter_tid, NULL, child_waiter, NULL) != 0) {
+		perror("pthread_create");
 		exit(1);
 	}
 	while(1) {
 		struct child_waiter *waiter;
+		struct child_args ca;
+		char **curp;
+		char *curenv;
 		pid_t pid;
-		pthread_t pt;
 
 		if(read_all(msd[0], &em, sizeof(em)) < 0)
 			return -1;
@@ -579,9 +997,13 @@ static int master_fork_loop(void)
 			return -1;
 		if(em.cmdlen > cmdsize) {
 			free(cmd);
+			free(cmdwords);
+			free(cmdargv);
 			cmdsize = em.cmdlen;
 			cmd = malloc(cmdsize);
-			if(!cmd) {
+			cmdwords = malloc(cmdsize);
+			cmdargv = malloc((cmdsize / 2 + 2) * sizeof(*cmdargv));
+			if(!cmd || !cmdwords || !cmdargv) {
 				perror("malloc");
 				return -1;
 			}
@@ -608,6 +1030,26 @@ static int master_fork_loop(void)
 			exit(1);
 		}
 		waiter->umount_dev = 0;
+		waiter->sid = em.sid;
+		waiter->output_fd = create_output_fd(em.sid, "output");
+		waiter->error_fd = waiter->output_fd;
+		if(waiter->output_fd >= 0 && !em.single_output) {
+			waiter->error_fd = create_output_fd(em.sid, "errors");
+			if(waiter->error_fd < 0) {
+				close(waiter->output_fd);
+				waiter->output_fd = -1;
+			}
+		}
+		if(waiter->output_fd < 0) {
+			/* Report it as a failed command rather than taking
+			 * down every other job, since this is likely just
+			 * running out of file descriptors.
+			 */
+			free(waiter);
+			if(send_status(em.sid, 1 << 8, NULL, -1, -1) < 0)
+				exit(1);
+			continue;
+		}
 		snprintf(waiter->dev, sizeof(waiter->dev), "%s/dev", job);
 		snprintf(waiter->proc, sizeof(waiter->proc), "%s/proc", job);
 #ifdef __APPLE__
@@ -616,74 +1058,81 @@ static int master_fork_loop(void)
 		}
 #endif
 
-		pid = fork();
-		if(pid < 0) {
-			perror("fork");
+		if(snprintf(full_vardict_file, sizeof(full_vardict_file), TUP_VARDICT_NAME "=%s/%s", get_tup_top(), vardict_file) >= (signed)sizeof(full_vardict_file)) {
+			fprintf(stderr, "tup error: full_vardict_file is sized incorrectly.\n");
 			exit(1);
 		}
-		if(pid == 0) {
-			char **envp;
-			char **curp;
-			char *curenv;
-			char full_vardict_file[PATH_MAX];
-
-			if(close(msd[0]) < 0) {
-				perror("close(msd[0])");
-				exit(1);
-			}
 
-			if(snprintf(full_vardict_file, sizeof(full_vardict_file), TUP_VARDICT_NAME "=%s/%s", get_tup_top(), vardict_file) >= (signed)sizeof(full_vardict_file)) {
-				fprintf(stderr, "tup error: full_vardict_file is sized incorrectly.\n");
-				exit(1);
-			}
-
-			/* +1 for the vardict variable, and +1 for the terminating
-			 * NULL pointer.
-			 */
-			envp = malloc((em.num_env_entries + 2) * sizeof(*envp));
+		/* +1 for the vardict variable, and +1 for the terminating
+		 * NULL pointer.
+		 */
+		if(em.num_env_entries + 2 > envpsize) {
+			free(envp);
+			envpsize = em.num_env_entries + 2;
+			envp = malloc(envpsize * sizeof(*envp));
 			if(!envp) {
 				perror("malloc");
 				exit(1);
 			}
-			/* Convert from Windows-style environment to
-			 * Linux-style.
-			 */
-			curp = envp;
-			curenv = env;
-			while(*curenv) {
-				*curp = curenv;
-				curp++;
-				curenv += strlen(curenv) + 1;
-			}
-			*curp = full_vardict_file;
+		}
+		/* Convert from Windows-style environment to
+		 * Linux-style.
+		 */
+		curp = envp;
+		curenv = env;
+		while(*curenv) {
+			*curp = curenv;
 			curp++;
-			*curp = NULL;
-
-			if(setup_subprocess(em.sid, job, dir, waiter->dev, waiter->proc, em.single_output, em.need_namespacing) < 0)
-				exit(1);
-			execle("/bin/sh", "/bin/sh", "-e", "-c", cmd, NULL, envp);
-			perror("execl");
-			exit(1);
+			curenv += strlen(curenv) + 1;
 		}
-		waiter->pid = pid;
-		waiter->sid = em.sid;
-		pthread_create(&pt, &attr, child_waiter, waiter);
-	}
+		*curp = full_vardict_file;
+		curp++;
+		*curp = NULL;
 
-	{
-		struct rcmsg rcm;
-		memset(&rcm, 0, sizeof(rcm));
-		rcm.sid = -1;
-		rcm.status = 0;
-		if(write(msd[0], &rcm, sizeof(rcm)) != sizeof(rcm)) {
-			perror("write");
-			fprintf(stderr, "tup error: Unable to send notification to shutdown the child wait thread. This process may not shutdown cleanly.\n");
-			return -1;
+		ca.em = &em;
+		ca.job = job;
+		ca.dir = dir;
+		ca.cmd = cmd;
+		ca.argv = NULL;
+		if(use_direct_exec && split_simple_command(cmd, cmdwords, cmdargv) > 0)
+			ca.argv = cmdargv;
+		ca.envp = envp;
+		ca.waiter = waiter;
+
+		/* Hold the lock until the child is in the tree, in case it
+		 * exits before start_subprocess() even returns.
+		 */
+		pthread_mutex_lock(&waiterlock);
+		pid = start_subprocess(&ca);
+		if(pid < 0) {
+			pthread_mutex_unlock(&waiterlock);
+			exit(1);
 		}
-		if(close(msd[0]) < 0) {
-			perror("close(msd[0])");
+		waiter->tnode.tupid = pid;
+		if(tupid_tree_insert(&waiter_root, &waiter->tnode) < 0) {
+			fprintf(stderr, "tup error: Unable to add subprocess pid=%i to the waiter tree.\n", pid);
+			pthread_mutex_unlock(&waiterlock);
 			exit(1);
 		}
+		num_children++;
+		pthread_cond_signal(&waitercond);
+		pthread_mutex_unlock(&waiterlock);
+	}
+
+	/* Make sure every status is sent back before the shutdown message. */
+	pthread_mutex_lock(&waiterlock);
+	waiter_quit = 1;
+	pthread_cond_signal(&waitercond);
+	pthread_mutex_unlock(&waiterlock);
+	pthread_join(waiter_tid, NULL);
+
+	if(send_status(-1, 0, NULL, -1, -1) < 0) {
+		fprintf(stderr, "tup error: Unable to send notification to shutdown the child wait thread. This process may not shutdown cleanly.\n");
+		return -1;
+	}
+	if(close(msd[0]) < 0) {
+		perror("close(msd[0])");
+		exit(1);
 	}
 
 	if(in_valgrind) {
@@ -695,38 +1144,75 @@ static int master_fork_loop(void)
 			perror("close(STDERR_FILENO)");
 	}
 	free(cmd);
+	free(cmdwords);
+	free(cmdargv);
 	free(env);
+	free(envp);
+	free(child_stack);
 	return 0;
 }
 
 static void *child_waiter(void *arg)
 {
-	struct child_waiter *waiter = arg;
-	struct rcmsg rcm;
-	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	if(arg) {}
+	while(1) {
+		struct child_waiter *waiter;
+		struct tupid_tree *tt;
+		pid_t pid;
+		int status;
+		struct rusage ru;
 
-	memset(&rcm, 0, sizeof(rcm));
-	rcm.sid = waiter->sid;
-	if(waitpid(waiter->pid, &rcm.status, 0) < 0) {
-		perror("waitpid");
-	}
+		pthread_mutex_lock(&waiterlock);
+		while(num_children == 0 && !waiter_quit)
+			pthread_cond_wait(&waitercond, &waiterlock);
+		if(num_children == 0) {
+			pthread_mutex_unlock(&waiterlock);
+			break;
+		}
+		pthread_mutex_unlock(&waiterlock);
+
+		/* wait4() gives us the resource usage of just this
+		 * subprocess (and its children), which is saved in the
+		 * command's history.
+		 */
+		pid = wait4(-1, &status, 0, &ru);
+		if(pid < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("wait4");
+			fprintf(stderr, "tup error: Unable to wait for subprocesses. The remaining subprocesses may not exit properly.\n");
+			break;
+		}
+
+		pthread_mutex_lock(&waiterlock);
+		tt = tupid_tree_search(&waiter_root, pid);
+		if(tt) {
+			tupid_tree_rm(&waiter_root, tt);
+			num_children--;
+		}
+		pthread_mutex_unlock(&waiterlock);
+		if(!tt)
+			continue;
+		waiter = container_of(tt, struct child_waiter, tnode);
 #ifdef __APPLE__
-	if(waiter->umount_dev) {
-		int rc;
-		rc = unmount(waiter->dev, MNT_FORCE);
-		if(rc < 0) {
-			perror("umount");
-			fprintf(stderr, "tup error: Unable to umount the /dev file-system in the chroot environment. Subprocess pid=%i may not exit properly.\n", waiter->pid);
+		if(waiter->umount_dev) {
+			int rc;
+			rc = unmount(waiter->dev, MNT_FORCE);
+			if(rc < 0) {
+				perror("umount");
+				fprintf(stderr, "tup error: Unable to umount the /dev file-system in the chroot environment. Subprocess pid=%i may not exit properly.\n", pid);
+			}
 		}
-	}
 #endif
-	pthread_mutex_lock(&lock);
-	if(write(msd[0], &rcm, sizeof(rcm)) != sizeof(rcm)) {
-		perror("write");
-		fprintf(stderr, "tup error: Unable to write return status value to the socket. Subprocess pid=%i may not exit properly.\n", waiter->pid);
+		if(send_status(waiter->sid, status, &ru, waiter->output_fd, waiter->error_fd) < 0) {
+			fprintf(stderr, "tup error: Unable to write return status value to the socket. Subprocess pid=%i may not exit properly.\n", pid);
+		}
+		/* The main tup process has its own copies now. */
+		close(waiter->output_fd);
+		if(waiter->error_fd != waiter->output_fd)
+			close(waiter->error_fd);
+		free(waiter);
 	}
-	pthread_mutex_unlock(&lock);
-	free(waiter);
 	return NULL;
 }
 
@@ -737,7 +1223,8 @@ static void *child_wait_notifier(void *arg)
 		struct rcmsg rcm;
 		struct tupid_tree *tt;
 		struct status_tree *st;
-		if(read_all(msd[1], &rcm, sizeof(rcm)) < 0)
+		int fds[2];
+		if(recv_status(&rcm, fds) < 0)
 			return NULL;
 		if(rcm.sid == -1)
 			return NULL;
@@ -750,7 +1237,11 @@ static void *child_wait_notifier(void *arg)
 		}
 		st = container_of(tt, struct status_tree, tnode);
 		tupid_tree_rm(&status_root, tt);
-		st->status = rcm.status;
+		st->res.status = rcm.status;
+		st->res.cpu_ms = rcm.cpu_ms;
+		st->res.rss_kb = rcm.rss_kb;
+		st->res.output_fd = fds[0];
+		st->res.error_fd = fds[1];
 		st->set = 1;
 		pthread_cond_signal(&st->cond);
 		pthread_mutex_unlock(&statuslock);
@@ -758,16 +1249,14 @@ static void *child_wait_notifier(void *arg)
 	return NULL;
 }
 
-static int wait_for_my_sid(struct status_tree *st)
+static void wait_for_my_sid(struct status_tree *st, struct exec_result *res)
 {
-	int status;
 	pthread_mutex_lock(&statuslock);
 	while(st->set == 0) {
 		pthread_cond_wait(&st->cond, &statuslock);
 	}
-	status = st->status;
+	memcpy(res, &st->res, sizeof(*res));
 	pthread_mutex_unlock(&statuslock);
-	return status;
 }
 
 static void sighandler(int sig)
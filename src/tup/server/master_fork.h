@@ -40,8 +40,16 @@ struct execmsg {
 
 #define JOB_MAX 64
 
+struct exec_result {
+	int status;
+	int output_fd;
+	int error_fd;
+	int cpu_ms; /* user + system time, or -1 if unknown */
+	long rss_kb; /* peak resident set size, or -1 if unknown */
+};
+
 int master_fork_exec(struct execmsg *em, const char *job, const char *dir,
 		     const char *cmd, const char *newenv,
-		     const char *vardict_file, int *status);
+		     const char *vardict_file, struct exec_result *res);
 
 #endif
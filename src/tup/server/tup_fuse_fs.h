@@ -34,6 +34,7 @@ struct file_info;
 int tup_fuse_add_group(int id, struct file_info *finfo);
 int tup_fuse_rm_group(struct file_info *finfo);
 void tup_fuse_set_parser_mode(int mode);
+void tup_fuse_set_lookup_cache(int enabled);
 int tup_fuse_server_get_dir_entries(const char *path, void *buf,
 				    fuse_fill_dir_t filler);
 void tup_fuse_fs_init(void);
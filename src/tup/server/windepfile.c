@@ -143,6 +143,11 @@ int server_init(enum server_mode mode)
 	return 0;
 }
 
+void server_set_persistent(int persistent)
+{
+	if(persistent) {/* unused */}
+}
+
 int server_quit(void)
 {
 	return 0;
@@ -576,6 +581,7 @@ static int process_depfile(struct server *s, HANDLE h)
 				return -1;
 			}
 			map->tent = NULL; /* This is used when saving deps */
+			map->have_mtime = 0;
 			LIST_INSERT_HEAD(&s->finfo.mapping_list, map, list);
 		}
 		if(handle_file(event.at, event1, event2, &s->finfo) < 0) {
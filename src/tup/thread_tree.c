@@ -28,31 +28,42 @@ static int thread_tree_cmp(struct thread_tree *tt1, struct thread_tree *tt2)
 RB_GENERATE(thread_entries, thread_tree, linkage, thread_tree_cmp);
 
 struct thread_tree *thread_tree_search(struct thread_root *troot, int id)
+{
+	struct thread_tree *ret;
+
+	ret = thread_tree_search_rdlock(troot, id);
+	thread_tree_unlock(troot);
+	return ret;
+}
+
+struct thread_tree *thread_tree_search_rdlock(struct thread_root *troot, int id)
 {
 	struct thread_tree tt = {
 		.id = id,
 	};
-	struct thread_tree *ret = NULL;
 
-	pthread_mutex_lock(&troot->lock);
-	ret = RB_FIND(thread_entries, &troot->root, &tt);
-	pthread_mutex_unlock(&troot->lock);
-	return ret;
+	pthread_rwlock_rdlock(&troot->lock);
+	return RB_FIND(thread_entries, &troot->root, &tt);
+}
+
+void thread_tree_unlock(struct thread_root *troot)
+{
+	pthread_rwlock_unlock(&troot->lock);
 }
 
 int thread_tree_insert(struct thread_root *troot, struct thread_tree *data)
 {
 	int rc = 0;
-	pthread_mutex_lock(&troot->lock);
+	pthread_rwlock_wrlock(&troot->lock);
 	if(RB_INSERT(thread_entries, &troot->root, data) != NULL)
 		rc = -1;
-	pthread_mutex_unlock(&troot->lock);
+	pthread_rwlock_unlock(&troot->lock);
 	return rc;
 }
 
 void thread_tree_rm(struct thread_root *troot, struct thread_tree *data)
 {
-	pthread_mutex_lock(&troot->lock);
+	pthread_rwlock_wrlock(&troot->lock);
 	RB_REMOVE(thread_entries, &troot->root, data);
-	pthread_mutex_unlock(&troot->lock);
+	pthread_rwlock_unlock(&troot->lock);
 }
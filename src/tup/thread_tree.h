@@ -22,7 +22,8 @@
 #define tup_thread_tree
 
 /* This is similar to the basic tupid_tree structure, except it uses an int
- * instead of a tupid, and has a mutex for automatic thread-safe operations.
+ * instead of a tupid, and has a read-write lock for automatic thread-safe
+ * operations.
  */
 
 #include "bsd/tree.h"
@@ -38,11 +39,17 @@ RB_PROTOTYPE(thread_entries, thread_tree, linkage, x);
 
 struct thread_root {
 	struct thread_entries root;
-	pthread_mutex_t lock;
+	pthread_rwlock_t lock;
 };
-#define THREAD_ROOT_INITIALIZER {{NULL}, PTHREAD_MUTEX_INITIALIZER}
+#define THREAD_ROOT_INITIALIZER {{NULL}, PTHREAD_RWLOCK_INITIALIZER}
 
 struct thread_tree *thread_tree_search(struct thread_root *troot, int id);
+
+/* Same as thread_tree_search(), but the tree is left read-locked so the
+ * entry can't be removed until thread_tree_unlock() is called.
+ */
+struct thread_tree *thread_tree_search_rdlock(struct thread_root *troot, int id);
+void thread_tree_unlock(struct thread_root *troot);
 int thread_tree_insert(struct thread_root *troot, struct thread_tree *data);
 void thread_tree_rm(struct thread_root *troot, struct thread_tree *data);
 
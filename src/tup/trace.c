@@ -0,0 +1,175 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+#include "trace.h"
+#include "timespan.h"
+#include "entry.h"
+#include "compat.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* Writes a trace in the Chrome trace-event format (the "JSON Object Format"
+ * with a traceEvents array), which can be loaded into chrome://tracing or
+ * other trace viewers. Each command or Tupfile parse is a complete ("X")
+ * event on the thread id of the worker slot that ran it.
+ */
+static FILE *trace_f = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static struct timeval trace_start;
+static int num_events;
+static int named_slots;
+
+static long long tv_us(const struct timeval *tv)
+{
+	return (tv->tv_sec - trace_start.tv_sec) * 1000000LL +
+		(tv->tv_usec - trace_start.tv_usec);
+}
+
+static void print_json_string(const char *s)
+{
+	fputc('"', trace_f);
+	for(; *s; s++) {
+		unsigned char c = *s;
+		if(c == '"' || c == '\\') {
+			fputc('\\', trace_f);
+			fputc(c, trace_f);
+		} else if(c == '\n') {
+			fputs("\\n", trace_f);
+		} else if(c == '\t') {
+			fputs("\\t", trace_f);
+		} else if(c < 0x20) {
+			fprintf(trace_f, "\\u%04x", c);
+		} else {
+			fputc(c, trace_f);
+		}
+	}
+	fputc('"', trace_f);
+}
+
+static void start_event(void)
+{
+	if(num_events)
+		fprintf(trace_f, ",\n");
+	num_events++;
+}
+
+int trace_open(const char *filename)
+{
+	trace_f = fopen(filename, "w");
+	if(!trace_f) {
+		perror(filename);
+		fprintf(stderr, "tup error: Unable to open the trace file.\n");
+		return -1;
+	}
+	if(pthread_key_create(&slot_key, NULL) != 0) {
+		perror("pthread_key_create");
+		fclose(trace_f);
+		trace_f = NULL;
+		return -1;
+	}
+	gettimeofday(&trace_start, NULL);
+	num_events = 0;
+	named_slots = 0;
+	fprintf(trace_f, "{\"traceEvents\":[\n");
+	start_event();
+	fprintf(trace_f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}");
+	return 0;
+}
+
+int trace_close(void)
+{
+	int rc = 0;
+
+	if(!trace_f)
+		return 0;
+	fprintf(trace_f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+	if(fclose(trace_f) != 0) {
+		perror("fclose");
+		fprintf(stderr, "tup error: Unable to write the trace file.\n");
+		rc = -1;
+	}
+	trace_f = NULL;
+	pthread_key_delete(slot_key);
+	return rc;
+}
+
+int trace_enabled(void)
+{
+	return trace_f != NULL;
+}
+
+/* Worker threads call this with their slot number, starting at 1. Anything
+ * traced from a thread that never set a slot shows up as the main thread.
+ */
+void trace_set_slot(int slot)
+{
+	if(!trace_f)
+		return;
+	pthread_setspecific(slot_key, (void*)(intptr_t)slot);
+	pthread_mutex_lock(&trace_lock);
+	while(named_slots < slot) {
+		named_slots++;
+		start_event();
+		fprintf(trace_f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"job %i\"}}", named_slots, named_slots);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_span(const char *cat, struct tup_entry *tent,
+		const struct timespan *ts, const struct trace_stats *stats)
+{
+	char dir[PATH_MAX];
+	long long start;
+	long long dur;
+	void *slotp;
+	int slot;
+
+	if(!trace_f)
+		return;
+	slotp = pthread_getspecific(slot_key);
+	slot = (int)(intptr_t)slotp;
+	start = tv_us(&ts->start);
+	dur = tv_us(&ts->end) - start;
+	if(dur < 0)
+		dur = 0;
+	if(snprint_tup_entry(dir, sizeof(dir), tent->parent) >= (signed)sizeof(dir))
+		dir[0] = 0;
+
+	pthread_mutex_lock(&trace_lock);
+	start_event();
+	fprintf(trace_f, "{\"name\":");
+	print_json_string(tent->name.s);
+	fprintf(trace_f, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%lli,\"dur\":%lli,\"args\":{\"tupid\":%lli,\"dir\":", cat, slot, start, dur, tent->tnode.tupid);
+	print_json_string(dir);
+	if(stats) {
+		fprintf(trace_f, ",\"db_wait_us\":%lli,\"display_wait_us\":%lli,\"fuse_events\":%i,\"bytes_read\":%lli,\"bytes_written\":%lli",
+			(long long)(stats->db_wait * 1e6),
+			(long long)(stats->display_wait * 1e6),
+			stats->fuse_events,
+			stats->bytes_read,
+			stats->bytes_written);
+	}
+	fprintf(trace_f, "}}");
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,43 @@
+/* vim: set ts=8 sw=8 sts=8 noet tw=78:
+ *
+ * tup - A file-based build system
+ *
+ * Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef tup_trace_h
+#define tup_trace_h
+
+struct timespan;
+struct tup_entry;
+
+/* Extra information about a command or parse that ends up in the trace. */
+struct trace_stats {
+	float db_wait; /* Seconds spent waiting on the database thread */
+	float display_wait; /* Seconds spent waiting on the display lock */
+	int fuse_events;
+	long long bytes_read;
+	long long bytes_written;
+};
+
+int trace_open(const char *filename);
+int trace_close(void);
+int trace_enabled(void);
+void trace_set_slot(int slot);
+void trace_span(const char *cat, struct tup_entry *tent,
+		const struct timespan *ts, const struct trace_stats *stats);
+
+#endif
@@ -64,6 +64,8 @@ static int node(int argc, char **argv);
 static int rm(int argc, char **argv);
 static int varshow(int argc, char **argv);
 static int dbconfig(int argc, char **argv);
+static int stats(int argc, char **argv);
+static int query(int argc, char **argv);
 static int options(int argc, char **argv);
 static int fake_mtime(int argc, char **argv);
 static int fake_parser_version(int argc, char **argv);
@@ -157,6 +159,18 @@ int main(int argc, char **argv)
 		return 1;
 	tup_restore_privs();
 
+	/* If the monitor is running as an update server, let it do the work. */
+	if(strcmp(cmd, "upd") == 0) {
+		int status;
+		tup_temporarily_drop_privs();
+		rc = monitor_client(argc, argv, &status);
+		tup_restore_privs();
+		if(rc < 0)
+			return 1;
+		if(rc == 1)
+			return status;
+	}
+
 	/* Commands that don't use a normal tup_init() */
 	if(strcmp(cmd, "stop") == 0) {
 		if(tup_drop_privs() < 0)
@@ -184,8 +198,18 @@ int main(int argc, char **argv)
 
 	if(tup_option_init(argc, argv) < 0)
 		return -1;
-	if(tup_init() < 0)
-		return 1;
+	tup_content_hash_init();
+	/* Commands that only read the database */
+	if(strcmp(cmd, "graph") == 0 ||
+	   strcmp(cmd, "query") == 0 ||
+	   strcmp(cmd, "todo") == 0 ||
+	   strcmp(cmd, "stats") == 0) {
+		if(tup_init_readonly() < 0)
+			return 1;
+	} else {
+		if(tup_init() < 0)
+			return 1;
+	}
 
 	if(strcmp(cmd, "monitor") == 0) {
 		rc = monitor(argc, argv);
@@ -253,6 +277,10 @@ int main(int argc, char **argv)
 		rc = varshow(argc, argv);
 	} else if(strcmp(cmd, "dbconfig") == 0) {
 		rc = dbconfig(argc, argv);
+	} else if(strcmp(cmd, "stats") == 0) {
+		rc = stats(argc, argv);
+	} else if(strcmp(cmd, "query") == 0) {
+		rc = query(argc, argv);
 	} else if(strcmp(cmd, "options") == 0) {
 		rc = options(argc, argv);
 	} else if(strcmp(cmd, "fake_mtime") == 0) {
@@ -897,6 +925,198 @@ static int dbconfig(int argc, char **argv)
 	return 0;
 }
 
+static int stats(int argc, char **argv)
+{
+	int num = 10;
+	if(argc == 2) {
+		char *endp;
+		num = strtol(argv[1], &endp, 10);
+		if(*endp || num <= 0) {
+			fprintf(stderr, "tup error: Expected a positive number of entries for 'stats', not '%s'.\n", argv[1]);
+			return -1;
+		}
+	} else if(argc > 2) {
+		fprintf(stderr, "tup error: 'stats' takes at most one argument.\n");
+		return -1;
+	}
+	if(tup_db_begin() < 0)
+		return -1;
+	if(tup_db_show_stats(num) < 0)
+		return -1;
+	if(tup_db_commit() < 0)
+		return -1;
+	return 0;
+}
+
+static int query_json;
+
+static void print_json_string(const char *str)
+{
+	const unsigned char *p;
+
+	putchar('"');
+	for(p=(const unsigned char *)str; *p; p++) {
+		if(*p == '"' || *p == '\\') {
+			printf("\\%c", *p);
+		} else if(*p == '\n') {
+			printf("\\n");
+		} else if(*p == '\t') {
+			printf("\\t");
+		} else if(*p < 0x20) {
+			printf("\\u%04x", *p);
+		} else {
+			putchar(*p);
+		}
+	}
+	putchar('"');
+}
+
+/* TSV has no way to escape a tab or newline, so they are replaced with
+ * spaces. Only command strings are likely to have them.
+ */
+static void print_tsv_string(const char *str)
+{
+	const char *p;
+
+	for(p=str; *p; p++) {
+		if(*p == '\t' || *p == '\n')
+			putchar(' ');
+		else
+			putchar(*p);
+	}
+}
+
+static int query_cb(void *arg, struct tup_entry *tent, int depth)
+{
+	char dir[PATH_MAX];
+	const char *dirname;
+	if(arg) {}
+
+	if(snprint_tup_entry(dir, sizeof(dir), tent->parent) >= (int)sizeof(dir)) {
+		fprintf(stderr, "tup error: Directory name is too long for tupid %lli\n", tent->tnode.tupid);
+		return -1;
+	}
+	dirname = dir[0] ? dir + 1 : ".";
+
+	if(query_json) {
+		printf("{\"depth\": %i, \"id\": %lli, \"type\": ", depth, tent->tnode.tupid);
+		print_json_string(tup_db_type(tent->type));
+		printf(", \"dir\": ");
+		print_json_string(dirname);
+		printf(", \"name\": ");
+		print_json_string(tent->name.s);
+		printf("}\n");
+	} else {
+		printf("%i\t%lli\t%s\t", depth, tent->tnode.tupid, tup_db_type(tent->type));
+		print_tsv_string(dirname);
+		putchar('\t');
+		print_tsv_string(tent->name.s);
+		putchar('\n');
+	}
+	return 0;
+}
+
+static int query(int argc, char **argv)
+{
+	int x;
+	int max_depth = -1;
+	int sticky = 0;
+	int num_args = 0;
+	int rc = 0;
+	const char *mode;
+	const char *args[2];
+	struct tup_entry *tents[2];
+	tupid_t sub_dir_dt;
+
+	query_json = 0;
+	if(argc < 2) {
+		fprintf(stderr, "tup error: 'query' requires one of 'deps', 'rdeps', 'path', or 'cmds'.\n");
+		return -1;
+	}
+	mode = argv[1];
+	for(x=2; x<argc; x++) {
+		if(strcmp(argv[x], "--depth") == 0) {
+			char *endp;
+
+			if(x+1 >= argc) {
+				fprintf(stderr, "tup error: --depth requires a number.\n");
+				return -1;
+			}
+			x++;
+			max_depth = strtol(argv[x], &endp, 10);
+			if(*endp || max_depth < 0) {
+				fprintf(stderr, "tup error: Expected a non-negative depth for 'query', not '%s'.\n", argv[x]);
+				return -1;
+			}
+		} else if(strcmp(argv[x], "--sticky") == 0) {
+			sticky = 1;
+		} else if(strcmp(argv[x], "--json") == 0) {
+			query_json = 1;
+		} else if(strcmp(argv[x], "--tsv") == 0) {
+			query_json = 0;
+		} else {
+			if(num_args == 2) {
+				fprintf(stderr, "tup error: Too many arguments to 'query %s'.\n", mode);
+				return -1;
+			}
+			args[num_args] = argv[x];
+			num_args++;
+		}
+	}
+
+	if(strcmp(mode, "path") == 0) {
+		if(num_args != 2) {
+			fprintf(stderr, "tup error: 'query path' requires a source and destination node.\n");
+			return -1;
+		}
+	} else if(strcmp(mode, "deps") == 0 ||
+		  strcmp(mode, "rdeps") == 0 ||
+		  strcmp(mode, "cmds") == 0) {
+		if(num_args != 1) {
+			fprintf(stderr, "tup error: 'query %s' requires exactly one node.\n", mode);
+			return -1;
+		}
+	} else {
+		fprintf(stderr, "tup error: Unknown query '%s'. Expected one of 'deps', 'rdeps', 'path', or 'cmds'.\n", mode);
+		return -1;
+	}
+
+	if(tup_db_begin() < 0)
+		return -1;
+	sub_dir_dt = get_sub_dir_dt();
+	if(sub_dir_dt < 0)
+		return -1;
+	for(x=0; x<num_args; x++) {
+		tents[x] = get_tent_dt(sub_dir_dt, args[x]);
+		if(!tents[x]) {
+			fprintf(stderr, "tup error: Unable to find tupid for: '%s'\n", args[x]);
+			return -1;
+		}
+	}
+
+	if(strcmp(mode, "deps") == 0) {
+		rc = tup_db_query_links(tents[0]->tnode.tupid, 0, sticky, max_depth, query_cb, NULL);
+	} else if(strcmp(mode, "rdeps") == 0) {
+		rc = tup_db_query_links(tents[0]->tnode.tupid, 1, sticky, max_depth, query_cb, NULL);
+	} else if(strcmp(mode, "path") == 0) {
+		rc = tup_db_query_path(tents[0]->tnode.tupid, tents[1]->tnode.tupid, sticky, max_depth, query_cb, NULL);
+		if(rc == 1)
+			fprintf(stderr, "tup: No path from '%s' to '%s'.\n", args[0], args[1]);
+	} else {
+		if(tents[0]->type != TUP_NODE_DIR &&
+		   tents[0]->type != TUP_NODE_GENERATED_DIR) {
+			fprintf(stderr, "tup error: '%s' is not a directory.\n", args[0]);
+			return -1;
+		}
+		rc = tup_db_query_dir_cmds(tents[0]->tnode.tupid, max_depth, query_cb, NULL);
+	}
+	if(rc < 0)
+		return -1;
+	if(tup_db_commit() < 0)
+		return -1;
+	return rc;
+}
+
 static int options(int argc, char **argv)
 {
 	if(argc || argv) {}
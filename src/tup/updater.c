@@ -26,6 +26,7 @@
 #include "db.h"
 #include "entry.h"
 #include "parser.h"
+#include "luaparser.h"
 #include "progress.h"
 #include "timespan.h"
 #include "server.h"
@@ -39,6 +40,8 @@
 #include "variant.h"
 #include "flist.h"
 #include "estring.h"
+#include "trace.h"
+#include "artifact_cache.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -74,18 +77,31 @@ static int expand_command(char **res,
 			  struct tupid_entries *group_sticky_root,
 			  struct tupid_entries *used_groups_root);
 static int update(struct node *n);
+static int db_thread_start(void);
+static int db_thread_stop(void);
+static int db_call(int (*func)(void *arg), void *arg, float *wait);
+static int db_call_async(int (*func)(void *arg), void *arg);
 
 static int do_keep_going;
 static int num_jobs;
 static int full_deps;
 static int warnings;
 static int show_warnings;
+static long memory_budget;
+static int commit_jobs;
+static int commit_interval;
 static int refactoring;
 static int verbose;
 
-static pthread_mutex_t db_mutex;
 static pthread_mutex_t display_mutex;
 
+/* Update jobs clear the skip flags of the nodes after them, and a node can
+ * come after several jobs at once (a command with many inputs, or a group).
+ * A job's own skip flag doesn't need the lock, since the jobs before it have
+ * all finished by the time it starts.
+ */
+static pthread_mutex_t skip_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static const char *signal_err[] = {
 	NULL, /* 0 */
 	"Hangup detected on controlling terminal or death of controlling process",
@@ -131,6 +147,7 @@ struct worker_thread {
 	struct node *retn;
 	int rc;
 	int quit;
+	int slot; /* Starts at 1, for tracing */
 };
 
 int updater(int argc, char **argv, int phase)
@@ -141,11 +158,19 @@ int updater(int argc, char **argv, int phase)
 	int rc = -1;
 	int environ_check = 1;
 
+	verbose = 0;
+	tup_entry_set_verbose(0);
 	do_keep_going = tup_option_get_flag("updater.keep_going");
 	num_jobs = tup_option_get_int("updater.num_jobs");
 	full_deps = tup_option_get_int("updater.full_deps");
 	show_warnings = tup_option_get_int("updater.warnings");
+	memory_budget = (long)tup_option_get_int("updater.memory_budget") * 1024;
+	commit_jobs = tup_option_get_int("updater.commit_jobs");
+	commit_interval = tup_option_get_int("updater.commit_interval");
+	tup_content_hash_init();
 	progress_init();
+	if(artifact_cache_init() < 0)
+		return -1;
 
 	if(check_full_deps_rebuild() < 0)
 		return -1;
@@ -168,6 +193,9 @@ int updater(int argc, char **argv, int phase)
 		} else if(strcmp(argv[x], "--quiet") == 0 ||
 			  strcmp(argv[x], "-q") == 0) {
 			progress_quiet();
+		} else if(strncmp(argv[x], "--trace=", 8) == 0) {
+			if(trace_open(argv[x] + 8) < 0)
+				return -1;
 		} else if(strcmp(argv[x], "--") == 0) {
 			break;
 		}
@@ -214,6 +242,9 @@ int updater(int argc, char **argv, int phase)
 out:
 	if(server_quit() < 0)
 		rc = -1;
+	if(trace_close() < 0)
+		rc = -1;
+	artifact_cache_close();
 	return rc; /* Profit! */
 }
 
@@ -261,6 +292,7 @@ int generate(int argc, char **argv)
 		return -1;
 	if(tup_option_init(argc, argv) < 0)
 		return -1;
+	tup_content_hash_init();
 	if(open_tup_top() < 0)
 		return -1;
 	printf("Scanning...\n");
@@ -295,7 +327,7 @@ int generate(int argc, char **argv)
 		return -1;
 	if(tup_db_select_node_by_flags(build_graph_cb, &g, TUP_FLAGS_CREATE) < 0)
 		return -1;
-	start_progress(g.num_nodes, g.total_mtime, 1);
+	start_progress(g.num_nodes, -1, 1);
 
 	/* The parsing nodes have to be removed so that we know if dependent
 	 * Tupfiles have already been parsed.
@@ -432,7 +464,9 @@ static int run_scan(int do_scan)
 		fprintf(stderr, "tup error: Unable to determine if the file monitor is still running.\n");
 		return -1;
 	}
-	if(pid < 0) {
+	if(tup_db_readonly()) {
+		tup_main_progress("No filesystem scan - reading the database while another tup process updates it.\n");
+	} else if(pid < 0) {
 		if(do_scan) {
 			tup_main_progress("Scanning filesystem...\n");
 			if(tup_scan() < 0)
@@ -450,9 +484,10 @@ static int run_scan(int do_scan)
 			tup_main_progress("No filesystem scan - monitor is running.\n");
 		}
 	}
-	if(!scanned) {
+	if(!scanned && variant_list_empty()) {
 		/* The scanner loads variants, so if we haven't done that yet
-		 * then we need to do it here.
+		 * then we need to do it here. When we are running inside the
+		 * monitor's update server, they are already loaded.
 		 */
 		if(tup_db_begin() < 0)
 			return -1;
@@ -513,7 +548,7 @@ static int delete_files(struct graph *g)
 			goto out_err;
 		if(tup_del_id_force(te->tnode.tupid, te->type) < 0)
 			goto out_err;
-		skip_result(NULL);
+		skip_result(0);
 		/* Use TUP_NODE_GENERATED to make the bar purple since
 		 * we are deleting (not executing) commands.
 		 */
@@ -603,6 +638,8 @@ static void initialize_server_struct(struct server *s, struct tup_entry *tent)
 	s->exit_sig = -1;
 	s->output_fd = -1;
 	s->error_fd = -1;
+	s->cpu_ms = -1;
+	s->rss_kb = -1;
 	s->error_mutex = &display_mutex;
 	init_file_info(&s->finfo, tup_entry_variant(tent)->variant_dir);
 }
@@ -1252,6 +1289,8 @@ static int process_create_nodes(void)
 	compat_lock_disable();
 	rc = execute_graph(&g, 0, 1, create_work);
 	compat_lock_enable();
+	parser_rules_memo_clear();
+	lua_parser_pool_clear();
 
 	if(rc == 0) {
 		if(g.gen_delete_count) {
@@ -1362,10 +1401,6 @@ static int process_update_nodes(int argc, char **argv, int *num_pruned)
 	if(graph_empty(&g))
 		goto out_destroy;
 
-	if(pthread_mutex_init(&db_mutex, NULL) != 0) {
-		perror("pthread_mutex_init");
-		return -1;
-	}
 	if(pthread_mutex_init(&display_mutex, NULL) != 0) {
 		perror("pthread_mutex_init");
 		return -1;
@@ -1374,7 +1409,11 @@ static int process_update_nodes(int argc, char **argv, int *num_pruned)
 	if(server_init(SERVER_UPDATER_MODE) < 0) {
 		return -1;
 	}
+	if(db_thread_start() < 0)
+		return -1;
 	rc = execute_graph(&g, do_keep_going, num_jobs, update_work);
+	if(db_thread_stop() < 0 && rc == 0)
+		rc = -1;
 	if(warnings) {
 		fprintf(stderr, "tup warning: Update resulted in %i warning%s\n", warnings, warnings == 1 ? "" : "s");
 	}
@@ -1383,7 +1422,6 @@ static int process_update_nodes(int argc, char **argv, int *num_pruned)
 		return -1;
 	}
 	pthread_mutex_destroy(&display_mutex);
-	pthread_mutex_destroy(&db_mutex);
 out_destroy:
 	if(destroy_graph(&g) < 0)
 		return -1;
@@ -1509,10 +1547,140 @@ static void pop_node(struct graph *g, struct node *n)
 	remove_node(g, n);
 }
 
+/* Nodes that are ready to run are kept in a heap ordered by their critical
+ * path, so that the commands on the longest chain through the graph are
+ * started first. Nodes with the same critical path run in the order they
+ * became ready.
+ */
+struct ready_node {
+	struct node *n;
+	unsigned int seq;
+};
+
+struct ready_heap {
+	struct ready_node *nodes;
+	int num;
+	unsigned int seq;
+};
+
+static int ready_before(struct ready_node *a, struct ready_node *b)
+{
+	if(a->n->cpath != b->n->cpath)
+		return a->n->cpath > b->n->cpath;
+	return a->seq < b->seq;
+}
+
+static void ready_swap(struct ready_heap *h, int a, int b)
+{
+	struct ready_node tmp;
+	tmp = h->nodes[a];
+	h->nodes[a] = h->nodes[b];
+	h->nodes[b] = tmp;
+}
+
+static void ready_insert(struct ready_heap *h, struct ready_node *rn)
+{
+	int x = h->num;
+
+	h->nodes[x] = *rn;
+	h->num++;
+	while(x > 0) {
+		int parent = (x - 1) / 2;
+		if(!ready_before(&h->nodes[x], &h->nodes[parent]))
+			break;
+		ready_swap(h, x, parent);
+		x = parent;
+	}
+}
+
+static void ready_push(struct ready_heap *h, struct node *n)
+{
+	struct ready_node rn;
+
+	rn.n = n;
+	rn.seq = h->seq++;
+	ready_insert(h, &rn);
+}
+
+static struct node *ready_pop(struct ready_heap *h)
+{
+	struct node *n;
+	int x = 0;
+
+	n = h->nodes[0].n;
+	h->num--;
+	h->nodes[0] = h->nodes[h->num];
+	while(1) {
+		int best = x;
+		int left = x * 2 + 1;
+		int right = left + 1;
+		if(left < h->num && ready_before(&h->nodes[left], &h->nodes[best]))
+			best = left;
+		if(right < h->num && ready_before(&h->nodes[right], &h->nodes[best]))
+			best = right;
+		if(best == x)
+			break;
+		ready_swap(h, x, best);
+		x = best;
+	}
+	return n;
+}
+
+/* With updater.memory_budget set, a command only starts if the peak memory it
+ * used the last time it ran fits in what is left of the budget. Commands that
+ * don't fit stay in the heap (in their original order) while smaller ones are
+ * started. Returns NULL if nothing fits, in which case we have to wait for an
+ * active job to finish. With nothing active, the next command always starts
+ * so that one command bigger than the whole budget can't stop the update.
+ */
+static struct node *ready_pop_fit(struct ready_heap *h, struct ready_node *deferred,
+				  long mem_used, int active)
+{
+	struct node *n = NULL;
+	int num = 0;
+	int x;
+
+	if(!memory_budget || !active)
+		return ready_pop(h);
+	while(h->num) {
+		struct ready_node rn = h->nodes[0];
+
+		ready_pop(h);
+		if(mem_used + rn.n->mem_kb <= memory_budget) {
+			n = rn.n;
+			break;
+		}
+		deferred[num++] = rn;
+	}
+	for(x=0; x<num; x++)
+		ready_insert(h, &deferred[x]);
+	return n;
+}
+
+/* Tells the first num workers to quit, and waits for them. */
+static void stop_workers(struct worker_thread *workers, int num)
+{
+	int x;
+
+	/* First tell all the threads to quit */
+	for(x=0; x<num; x++) {
+		pthread_mutex_lock(&workers[x].lock);
+		workers[x].quit = 1;
+		pthread_cond_signal(&workers[x].cond);
+		pthread_mutex_unlock(&workers[x].lock);
+	}
+	/* Then wait for all the threads to quit */
+	for(x=0; x<num; x++) {
+		pthread_join(workers[x].pid, NULL);
+		pthread_cond_destroy(&workers[x].cond);
+		pthread_mutex_destroy(&workers[x].lock);
+	}
+}
+
 /* Returns:
  *   0: everything built ok
  *  -1: a command failed
- *  -2: a system call failed (some work threads may still be active)
+ *  -2: a system call failed (no work threads are left running)
  */
 static int execute_graph(struct graph *g, int keep_going, int jobs,
 			 worker_function work_func)
@@ -1528,34 +1696,66 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 	struct worker_thread_head active_list;
 	struct worker_thread_head fin_list;
 	struct worker_thread_head free_list;
+	struct ready_heap ready;
+	struct ready_node *deferred;
+	long mem_used = 0;
+	int blocked = 0;
+	struct node *n;
+
+	/* Each node can only become ready once, so the heap never needs to
+	 * hold more than the number of nodes in the graph.
+	 */
+	ready.num = 0;
+	ready.seq = 0;
+	x = 0;
+	TAILQ_FOREACH(n, &g->node_list, list) {
+		x++;
+	}
+	TAILQ_FOREACH(n, &g->plist, list) {
+		x++;
+	}
+	if(set_critical_paths(g) < 0)
+		return -2;
+	ready.nodes = malloc(sizeof(*ready.nodes) * x);
+	if(!ready.nodes) {
+		perror("malloc");
+		return -2;
+	}
+	deferred = malloc(sizeof(*deferred) * x);
+	if(!deferred) {
+		perror("malloc");
+		free(ready.nodes);
+		return -2;
+	}
 
 	LIST_INIT(&active_list);
 	LIST_INIT(&fin_list);
 	LIST_INIT(&free_list);
 	if(pthread_mutex_init(&list_mutex, NULL) != 0) {
 		perror("pthread_mutex_init");
-		return -2;
+		goto err_free;
 	}
 	if(pthread_cond_init(&list_cond, NULL) != 0) {
 		perror("pthread_cond_init");
-		return -2;
+		goto err_destroy_mutex;
 	}
 
 	workers = malloc(sizeof(*workers) * jobs);
 	if(!workers) {
 		perror("malloc");
-		return -2;
+		goto err_destroy_cond;
 	}
 	for(x=0; x<jobs; x++) {
 		workers[x].g = g;
 
 		if(pthread_mutex_init(&workers[x].lock, NULL) != 0) {
 			perror("pthread_mutex_init");
-			return -2;
+			goto err_stop_workers;
 		}
 		if(pthread_cond_init(&workers[x].cond, NULL) != 0) {
 			perror("pthread_cond_init");
-			return -2;
+			pthread_mutex_destroy(&workers[x].lock);
+			goto err_stop_workers;
 		}
 
 		workers[x].list_mutex = &list_mutex;
@@ -1565,12 +1765,15 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 		workers[x].retn = NULL;
 		workers[x].rc = -1;
 		workers[x].quit = 0;
+		workers[x].slot = x + 1;
 		workers[x].fn = work_func;
 		LIST_INSERT_HEAD(&free_list, &workers[x], list);
 
-		if(pthread_create(&workers[x].pid, NULL, &run_thread, &workers[x]) < 0) {
+		if(pthread_create(&workers[x].pid, NULL, &run_thread, &workers[x]) != 0) {
 			perror("pthread_create");
-			return -2;
+			pthread_cond_destroy(&workers[x].cond);
+			pthread_mutex_destroy(&workers[x].lock);
+			goto err_stop_workers;
 		}
 	}
 
@@ -1581,32 +1784,42 @@ static int execute_graph(struct graph *g, int keep_going, int jobs,
 
 	start_progress(g->num_nodes, g->total_mtime, jobs);
 	/* Keep going as long as:
-	 * 1) There is work to do (plist is not empty)
+	 * 1) There is work to do (plist or the ready heap is not empty)
 	 * 2) The server hasn't been killed
 	 * 3) No jobs have failed, or if jobs have failed we have keep_going set.
 	 */
-	while(!TAILQ_EMPTY(&g->plist) && !server_is_dead() && (!failed || keep_going)) {
-		struct node *n;
+	while((!TAILQ_EMPTY(&g->plist) || ready.num) && !server_is_dead() && (!failed || keep_going)) {
 		struct worker_thread *wt;
-		n = TAILQ_FIRST(&g->plist);
-		DEBUGP("cur node: %lli\n", n->tnode.tupid);
-		if(!LIST_EMPTY(&n->incoming)) {
-			/* Here STATE_FINISHED means we're on the node_list,
-			 * therefore not ready for processing.
-			 */
+
+		/* Move everything on the plist either back to the node_list,
+		 * or to the ready heap if all of its inputs are done.
+		 */
+		while(!TAILQ_EMPTY(&g->plist)) {
+			n = TAILQ_FIRST(&g->plist);
+			DEBUGP("cur node: %lli\n", n->tnode.tupid);
 			TAILQ_REMOVE(&g->plist, n, list);
-			TAILQ_INSERT_HEAD(&g->node_list, n, list);
-			n->state = STATE_FINISHED;
-			goto check_empties;
+			if(!LIST_EMPTY(&n->incoming)) {
+				/* Here STATE_FINISHED means we're on the
+				 * node_list, therefore not ready for
+				 * processing.
+				 */
+				TAILQ_INSERT_HEAD(&g->node_list, n, list);
+				n->state = STATE_FINISHED;
+			} else if(!n->expanded) {
+				pop_node(g, n);
+			} else {
+				ready_push(&ready, n);
+			}
 		}
+		if(!ready.num)
+			goto check_empties;
 
-		if(!n->expanded) {
-			TAILQ_REMOVE(&g->plist, n, list);
-			pop_node(g, n);
+		n = ready_pop_fit(&ready, deferred, mem_used, active);
+		if(!n) {
+			blocked = 1;
 			goto check_empties;
 		}
-
-		TAILQ_REMOVE(&g->plist, n, list);
+		mem_used += n->mem_kb;
 		active++;
 
 		wt = LIST_FIRST(&free_list);
@@ -1625,11 +1838,11 @@ check_empties:
 		/* Keep looking for dudes to return as long as:
 		 *  1) There are no more free workers
 		 *  2) There is no work to do (plist is empty or the server is
-		 *     dead or we failed without keep-going) and some people
-		 *     are active.
+		 *     dead or we failed without keep-going, or nothing ready
+		 *     fits in the memory budget) and some people are active.
 		 */
 		while(LIST_EMPTY(&free_list) ||
-		      ((TAILQ_EMPTY(&g->plist) || server_is_dead() || (failed && !keep_going)) && active)) {
+		      (((TAILQ_EMPTY(&g->plist) && !ready.num) || blocked || server_is_dead() || (failed && !keep_going)) && active)) {
 			pthread_mutex_lock(&list_mutex);
 			while(LIST_EMPTY(&fin_list)) {
 				pthread_cond_wait(&list_cond, &list_mutex);
@@ -1641,6 +1854,8 @@ check_empties:
 			LIST_INSERT_HEAD(&free_list, wt, list);
 			pthread_mutex_unlock(&list_mutex);
 			active--;
+			mem_used -= n->mem_kb;
+			blocked = 0;
 
 			if(wt->rc == 0) {
 				pop_node(g, n);
@@ -1653,6 +1868,15 @@ check_empties:
 			}
 		}
 	}
+	/* Anything left in the heap was skipped, so put it back on the plist
+	 * where it gets cleaned up with the rest of the graph.
+	 */
+	while(ready.num) {
+		n = ready_pop(&ready);
+		TAILQ_INSERT_TAIL(&g->plist, n, list);
+	}
+	free(ready.nodes);
+	free(deferred);
 	clear_progress();
 	if(failed) {
 		fprintf(stderr, " *** tup: %i job%s failed.\n", failed, failed == 1 ? "" : "s");
@@ -1672,24 +1896,26 @@ check_empties:
 		rc = 0;
 	}
 
-	/* First tell all the threads to quit */
-	for(x=0; x<jobs; x++) {
-		pthread_mutex_lock(&workers[x].lock);
-		workers[x].quit = 1;
-		pthread_cond_signal(&workers[x].cond);
-		pthread_mutex_unlock(&workers[x].lock);
-	}
-	/* Then wait for all the threads to quit */
-	for(x=0; x<jobs; x++) {
-		pthread_join(workers[x].pid, NULL);
-		pthread_cond_destroy(&workers[x].cond);
-		pthread_mutex_destroy(&workers[x].lock);
-	}
-
+	stop_workers(workers, jobs);
 	free(workers); /* Viva la revolucion! */
 	pthread_mutex_destroy(&list_mutex);
 	pthread_cond_destroy(&list_cond);
 	return rc;
+
+err_stop_workers:
+	/* None of the workers have been given a node yet, so they all quit
+	 * right away.
+	 */
+	stop_workers(workers, x);
+	free(workers);
+err_destroy_cond:
+	pthread_cond_destroy(&list_cond);
+err_destroy_mutex:
+	pthread_mutex_destroy(&list_mutex);
+err_free:
+	free(ready.nodes);
+	free(deferred);
+	return -2;
 }
 
 static struct node *worker_wait(struct worker_thread *wt)
@@ -1724,6 +1950,7 @@ static void *run_thread(void *arg)
 	struct node *n;
 	int rc;
 
+	trace_set_slot(wt->slot);
 	while(1) {
 		n = worker_wait(wt);
 		if(n == (void*)-1)
@@ -1736,53 +1963,337 @@ static void *run_thread(void *arg)
 
 static int create_work(struct graph *g, struct node *n)
 {
+	struct edge *e;
+	int unskip = 0;
 	int rc = 0;
+
 	if(n->tent->type == TUP_NODE_DIR || n->tent->type == TUP_NODE_GHOST) {
 		if(tup_entry_variant(n->tent)->enabled) {
 			if(n->already_used) {
 				rc = 0;
+			} else if(n->skip && n->tent->type == TUP_NODE_DIR) {
+				/* We are only in the graph because a directory
+				 * we read from was re-parsed, and it came out
+				 * with the same outputs as before.
+				 */
+				skip_result(0);
 			} else {
 				rc = parse(n, g, NULL, refactoring, 1);
 			}
 			show_progress(-1, TUP_NODE_DIR);
 		}
+		if(n->parsing && !n->parse_unchanged)
+			unskip = 1;
 	} else if(n->tent->type == TUP_NODE_VAR ||
 		  n->tent->type == TUP_NODE_FILE ||
 		  n->tent->type == TUP_NODE_GENERATED ||
 		  n->tent->type == TUP_NODE_GROUP ||
 		  n->tent->type == TUP_NODE_CMD) {
+		unskip = 1;
 		rc = 0;
 	} else {
 		fprintf(stderr, "tup error: Unknown node type %i with ID %lli named '%s' in create graph.\n", n->tent->type, n->tnode.tupid, n->tent->name.s);
 		rc = -1;
 	}
+	if(rc == 0 && unskip) {
+		/* Directories that depend on us only need to be parsed if
+		 * our set of generated files may have changed.
+		 */
+		LIST_FOREACH(e, &n->edges, list) {
+			e->dest->skip = 0;
+		}
+	}
 	if(tup_db_unflag_create(n->tnode.tupid) < 0)
 		rc = -1;
 
 	return rc;
 }
 
-static int modify_outputs(struct node *n)
+/* All database access during the update phase goes through a single thread,
+ * since neither sqlite nor the tup_entry cache are thread-safe. The workers
+ * queue up requests for it instead of fighting over a lock, and only wait for
+ * the requests whose results they need.
+ */
+struct db_request {
+	TAILQ_ENTRY(db_request) list;
+	int (*func)(void *arg);
+	void *arg;
+	int rc;
+	int done;
+	int async;
+	struct timespan ts;
+	float wait;
+};
+TAILQ_HEAD(db_request_head, db_request);
+
+static struct db_request_head db_queue;
+static pthread_t db_tid;
+static pthread_mutex_t db_queue_mutex;
+static pthread_cond_t db_queue_cond;
+static pthread_cond_t db_done_cond;
+static int db_quit;
+static int db_async_failed;
+static int db_requests;
+static float db_wait;
+static int batch_cmds;
+static struct timespan batch_ts;
+
+/* With updater.commit_jobs or updater.commit_interval set, the database thread
+ * commits the update so far once enough commands have finished, or enough
+ * time has passed. Each request leaves the database in a state the next update
+ * can pick up from: a command stays on the modify list until finish_node()
+ * has put the commands after it there. So an interrupted update only re-runs
+ * what hadn't finished, and the journal never holds more than one batch.
+ * Ghosts are only reclaimed by the final commit, since jobs that are still
+ * running may refer to them.
+ */
+static int batch_commit(void)
 {
-	struct edge *e;
+	if(!batch_cmds)
+		return 0;
+	if(commit_jobs <= 0 || batch_cmds < commit_jobs) {
+		if(commit_interval <= 0)
+			return 0;
+		timespan_end(&batch_ts);
+		if(timespan_seconds(&batch_ts) < commit_interval)
+			return 0;
+	}
+	if(tup_db_commit_batch() < 0)
+		return -1;
+	if(tup_db_begin() < 0)
+		return -1;
+	batch_cmds = 0;
+	timespan_start(&batch_ts);
+	return 0;
+}
+
+static void *db_thread(void *arg)
+{
+	int rc;
+	if(arg) {/* unused */}
+
+	pthread_mutex_lock(&db_queue_mutex);
+	while(1) {
+		struct db_request *req;
+
+		while(TAILQ_EMPTY(&db_queue) && !db_quit)
+			pthread_cond_wait(&db_queue_cond, &db_queue_mutex);
+		if(TAILQ_EMPTY(&db_queue))
+			break;
+		req = TAILQ_FIRST(&db_queue);
+		TAILQ_REMOVE(&db_queue, req, list);
+		if(!req->async) {
+			timespan_end(&req->ts);
+			req->wait = timespan_seconds(&req->ts);
+			db_wait += req->wait;
+			db_requests++;
+		}
+		pthread_mutex_unlock(&db_queue_mutex);
+
+		req->rc = req->func(req->arg);
+		rc = batch_commit();
+
+		pthread_mutex_lock(&db_queue_mutex);
+		if(rc < 0)
+			db_async_failed = 1;
+		if(req->async) {
+			if(req->rc < 0)
+				db_async_failed = 1;
+			free(req->arg);
+			free(req);
+		} else {
+			req->done = 1;
+			pthread_cond_broadcast(&db_done_cond);
+		}
+	}
+	pthread_mutex_unlock(&db_queue_mutex);
+	return NULL;
+}
+
+static int db_thread_start(void)
+{
+	TAILQ_INIT(&db_queue);
+	db_quit = 0;
+	db_async_failed = 0;
+	db_requests = 0;
+	db_wait = 0.0;
+	batch_cmds = 0;
+	timespan_start(&batch_ts);
+	if(pthread_mutex_init(&db_queue_mutex, NULL) != 0) {
+		perror("pthread_mutex_init");
+		return -1;
+	}
+	if(pthread_cond_init(&db_queue_cond, NULL) != 0) {
+		perror("pthread_cond_init");
+		return -1;
+	}
+	if(pthread_cond_init(&db_done_cond, NULL) != 0) {
+		perror("pthread_cond_init");
+		return -1;
+	}
+	if(pthread_create(&db_tid, NULL, db_thread, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	return 0;
+}
+
+/* Finishes any queued requests and stops the thread. Returns -1 if any of the
+ * asynchronous requests failed.
+ */
+static int db_thread_stop(void)
+{
+	pthread_mutex_lock(&db_queue_mutex);
+	db_quit = 1;
+	pthread_cond_signal(&db_queue_cond);
+	pthread_mutex_unlock(&db_queue_mutex);
+	pthread_join(db_tid, NULL);
+
+	if(verbose) {
+		printf("tup: Jobs waited %.3fs for %i database requests.\n", db_wait, db_requests);
+	}
+	pthread_cond_destroy(&db_done_cond);
+	pthread_cond_destroy(&db_queue_cond);
+	pthread_mutex_destroy(&db_queue_mutex);
+	if(db_async_failed)
+		return -1;
+	return 0;
+}
+
+/* Runs func(arg) in the database thread and waits for the result. If wait is
+ * set, the time spent waiting for the database thread to get to this request
+ * is added to it.
+ */
+static int db_call(int (*func)(void *arg), void *arg, float *wait)
+{
+	struct db_request req;
+
+	req.func = func;
+	req.arg = arg;
+	req.rc = -1;
+	req.done = 0;
+	req.async = 0;
+	timespan_start(&req.ts);
+
+	pthread_mutex_lock(&db_queue_mutex);
+	TAILQ_INSERT_TAIL(&db_queue, &req, list);
+	pthread_cond_signal(&db_queue_cond);
+	while(!req.done)
+		pthread_cond_wait(&db_done_cond, &db_queue_mutex);
+	pthread_mutex_unlock(&db_queue_mutex);
+	if(wait)
+		*wait += req.wait;
+	return req.rc;
+}
+
+/* Queues func(arg) in the database thread without waiting for it. The arg
+ * must be malloc'd, and is freed once the request is done. Since requests are
+ * processed in order, anything queued later by a dependent job still sees
+ * these changes.
+ */
+static int db_call_async(int (*func)(void *arg), void *arg)
+{
+	struct db_request *req;
+
+	req = malloc(sizeof *req);
+	if(!req) {
+		perror("malloc");
+		free(arg);
+		return -1;
+	}
+	req->func = func;
+	req->arg = arg;
+	req->rc = -1;
+	req->done = 0;
+	req->async = 1;
+
+	pthread_mutex_lock(&db_queue_mutex);
+	TAILQ_INSERT_TAIL(&db_queue, req, list);
+	pthread_cond_signal(&db_queue_cond);
+	pthread_mutex_unlock(&db_queue_mutex);
+	return 0;
+}
+
+struct finish_request {
+	tupid_t tupid;
+	int ran;
+	int delete_var;
+	int num_modify;
+	tupid_t modify[];
+};
+
+/* Mark the next commands as modify in case we hit an error, and take this
+ * node off of the modify list.
+ */
+static int finish_node(void *arg)
+{
+	struct finish_request *fr = arg;
 	int rc = 0;
+	int x;
+
+	for(x=0; x<fr->num_modify; x++) {
+		if(tup_db_add_modify_list(fr->modify[x]) < 0)
+			rc = -1;
+	}
+	if(tup_db_unflag_modify(fr->tupid) < 0)
+		rc = -1;
+	if(fr->delete_var && rc == 0)
+		rc = delete_name_file(fr->tupid);
+	if(fr->ran)
+		batch_cmds++;
+	return rc;
+}
+
+static void unskip_node(struct node *n)
+{
+	pthread_mutex_lock(&skip_mutex);
+	n->skip = 0;
+	pthread_mutex_unlock(&skip_mutex);
+}
+
+static int node_skipped(struct node *n)
+{
+	int skip;
+
+	pthread_mutex_lock(&skip_mutex);
+	skip = n->skip;
+	pthread_mutex_unlock(&skip_mutex);
+	return skip;
+}
+
+/* Adds the commands that use n's outputs to the finish_request, so they can be
+ * put on the modify list by the database thread.
+ */
+static int modify_outputs(struct finish_request **frp, struct node *n)
+{
+	struct finish_request *fr = *frp;
+	struct edge *e;
 
 	LIST_FOREACH(e, &n->edges, list) {
 		if(e->style & TUP_LINK_NORMAL) {
 			if(e->dest->tent->type == TUP_NODE_CMD) {
-				if(tup_db_add_modify_list(e->dest->tnode.tupid) < 0)
-					rc = -1;
+				struct finish_request *tmp;
+				tmp = realloc(fr, sizeof(*fr) + sizeof(fr->modify[0]) * (fr->num_modify + 1));
+				if(!tmp) {
+					perror("realloc");
+					return -1;
+				}
+				fr = tmp;
+				*frp = fr;
+				fr->modify[fr->num_modify] = e->dest->tnode.tupid;
+				fr->num_modify++;
 			}
-			e->dest->skip = 0;
+			unskip_node(e->dest);
 		}
 	}
-	return rc;
+	return 0;
 }
 
 static int update_work(struct graph *g, struct node *n)
 {
 	static int jobs_active = 0;
 
+	struct finish_request *fr;
 	struct edge *e;
 	int rc = 0;
 	if(g) {/* unused */}
@@ -1802,7 +2313,7 @@ static int update_work(struct graph *g, struct node *n)
 			pthread_mutex_unlock(&display_mutex);
 		} else {
 			pthread_mutex_lock(&display_mutex);
-			skip_result(n->tent);
+			skip_result(n->runtime);
 			show_progress(jobs_active, TUP_NODE_CMD);
 			pthread_mutex_unlock(&display_mutex);
 		}
@@ -1815,29 +2326,35 @@ static int update_work(struct graph *g, struct node *n)
 		 * modify list, which is needed in order to convert
 		 * generated files to normal files (t6035).
 		 */
-		if(rc == 0) {
-			pthread_mutex_lock(&db_mutex);
-			LIST_FOREACH(e, &n->edges, list) {
-				if(!e->dest->skip) {
-					if(modify_outputs(e->dest) < 0)
-						rc = -1;
-				}
+		if(rc != 0)
+			return rc;
+	}
+
+	fr = malloc(sizeof *fr);
+	if(!fr) {
+		perror("malloc");
+		return -1;
+	}
+	fr->tupid = n->tnode.tupid;
+	fr->ran = n->tent->type == TUP_NODE_CMD && !n->skip;
+	fr->delete_var = 0;
+	fr->num_modify = 0;
+
+	if(n->tent->type == TUP_NODE_CMD) {
+		LIST_FOREACH(e, &n->edges, list) {
+			if(!node_skipped(e->dest)) {
+				if(modify_outputs(&fr, e->dest) < 0)
+					goto err_free;
 			}
-			if(tup_db_unflag_modify(n->tnode.tupid) < 0)
-				rc = -1;
-			pthread_mutex_unlock(&db_mutex);
 		}
 	} else {
-		pthread_mutex_lock(&db_mutex);
 		/* Mark the next nodes as modify in case we hit
 		 * an error - we'll need to pick up there (t6006).
 		 */
 		if(!n->skip) {
-			if(modify_outputs(n) < 0)
-				rc = -1;
+			if(modify_outputs(&fr, n) < 0)
+				goto err_free;
 		}
-		if(tup_db_unflag_modify(n->tnode.tupid) < 0)
-			rc = -1;
 
 		/* For environment variables, if there are no more
 		 * out-going edges, then this variable is no longer
@@ -1847,14 +2364,20 @@ static int update_work(struct graph *g, struct node *n)
 		 */
 		if(n->tent->type == TUP_NODE_VAR &&
 		   n->tent->dt == env_dt() &&
-		   LIST_EMPTY(&n->edges) &&
-		   rc == 0) {
-			rc = delete_name_file(n->tent->tnode.tupid);
+		   LIST_EMPTY(&n->edges)) {
+			fr->delete_var = 1;
 		}
-		pthread_mutex_unlock(&db_mutex);
 	}
 
-	return rc;
+	/* Nothing later in this job needs the result, so let the database
+	 * thread do this while the dependent jobs get started. Any failure is
+	 * reported when the database thread is stopped.
+	 */
+	return db_call_async(finish_node, fr);
+
+err_free:
+	free(fr);
+	return -1;
 }
 
 static int generate_work(struct graph *g, struct node *n)
@@ -1911,6 +2434,7 @@ static int todo_work(struct graph *g, struct node *n)
 {
 	/* TUP_NODE_ROOT means we count everything */
 	if(n->tent->type == g->count_flags || g->count_flags == TUP_NODE_ROOT) {
+		progress_add_time(n->runtime);
 		show_result(n->tent, 0, NULL, NULL, 1);
 	}
 
@@ -2125,7 +2649,7 @@ static int unskip_outputs(struct node *n)
 
 	LIST_FOREACH(e, &n->edges, list) {
 		output = e->dest;
-		output->skip = 0;
+		unskip_node(output);
 	}
 	return 0;
 }
@@ -2154,7 +2678,7 @@ static int check_outputs(struct node *n)
 			if(compare_paths(tmppath, curpath, &eq) < 0)
 				return -1;
 			if(!eq) {
-				output->skip = 0;
+				unskip_node(output);
 			}
 		}
 	}
@@ -2169,7 +2693,7 @@ static int unlink_outputs(int dfd, struct node *n)
 		output = e->dest;
 		if(output->tent->type != TUP_NODE_GROUP) {
 			int output_dfd = dfd;
-			output->skip = 0;
+			unskip_node(output);
 			if(output->tent->dt != n->tent->dt) {
 				output_dfd = tup_entry_open(output->tent->parent);
 				if(output_dfd < 0) {
@@ -2200,51 +2724,57 @@ static int unlink_outputs(int dfd, struct node *n)
 	return 0;
 }
 
-static int process_output(struct server *s, struct node *n,
-			  struct tupid_entries *sticky_root,
-			  struct tupid_entries *normal_root,
-			  struct tupid_entries *group_sticky_root,
-			  struct timespan *ts,
-			  struct tupid_entries *used_groups_root,
-			  const char *expanded_name,
-			  int compare_outputs)
-{
+/* The result of a finished command, as saved by save_output() for
+ * show_output() to display.
+ */
+struct output_log {
 	FILE *f;
-	int is_err = 1;
-	struct timespan *show_ts = NULL;
+	int is_err;
+	struct timespan *show_ts;
+	int important_link_removed;
+};
+
+/* Saves the dependencies of a finished command, and writes any problems with
+ * them to the log. This runs in the database thread, so everything that
+ * doesn't need the database is left for show_output().
+ */
+static int save_output(struct server *s, struct node *n,
+		       struct tupid_entries *sticky_root,
+		       struct tupid_entries *normal_root,
+		       struct tupid_entries *group_sticky_root,
+		       struct timespan *ts,
+		       struct tupid_entries *used_groups_root,
+		       struct output_log *log)
+{
+	FILE *f = log->f;
 	time_t ms = -1;
+	struct cmd_stats cs;
 	struct tup_entry *tent = n->tent;
 	int *warning_dest;
-	int important_link_removed = 0;
-	int always_display;
 
 	if(show_warnings)
 		warning_dest = &warnings;
 	else
 		warning_dest = NULL;
 
-	f = tmpfile();
-	if(!f) {
-		show_result(tent, 1, NULL, NULL, 1);
-		perror("tmpfile");
-		fprintf(stderr, "tup error: Unable to open the error log for writing.\n");
-		return -1;
-	}
+	log->is_err = 1;
+	log->show_ts = NULL;
+	log->important_link_removed = 0;
 	if(s->exited) {
 		if(s->exit_status == 0) {
-			if(write_files(f, tent->tnode.tupid, &s->finfo, warning_dest, 0, sticky_root, normal_root, group_sticky_root, full_deps, tup_entry_vardt(tent), used_groups_root, &important_link_removed) < 0) {
+			if(write_files(f, tent->tnode.tupid, &s->finfo, warning_dest, 0, sticky_root, normal_root, group_sticky_root, full_deps, tup_entry_vardt(tent), used_groups_root, &log->important_link_removed) < 0) {
 				fprintf(f, " *** Command ID=%lli ran successfully, but tup failed to save the dependencies.\n", tent->tnode.tupid);
 			} else {
 				timespan_end(ts);
-				show_ts = ts;
+				log->show_ts = ts;
 				ms = timespan_milliseconds(ts);
 
 				/* Hooray! */
-				is_err = 0;
+				log->is_err = 0;
 			}
 		} else {
 			fprintf(f, " *** Command ID=%lli failed with return value %i\n", tent->tnode.tupid, s->exit_status);
-			if(write_files(f, tent->tnode.tupid, &s->finfo, warning_dest, 1, sticky_root, normal_root, group_sticky_root, full_deps, tup_entry_vardt(tent), used_groups_root, &important_link_removed) < 0) {
+			if(write_files(f, tent->tnode.tupid, &s->finfo, warning_dest, 1, sticky_root, normal_root, group_sticky_root, full_deps, tup_entry_vardt(tent), used_groups_root, &log->important_link_removed) < 0) {
 				fprintf(f, " *** Additionally, command %lli failed to process input dependencies. These should probably be fixed before addressing the command failure.\n", tent->tnode.tupid);
 			}
 		}
@@ -2255,24 +2785,50 @@ static int process_output(struct server *s, struct node *n,
 		if(sig >= 0 && sig < ARRAY_SIZE(signal_err) && signal_err[sig])
 			errmsg = signal_err[sig];
 		fprintf(f, " *** Command ID=%lli killed by signal %i (%s)\n", tent->tnode.tupid, sig, errmsg);
-		if(write_files(f, tent->tnode.tupid, &s->finfo, warning_dest, 1, sticky_root, normal_root, group_sticky_root, full_deps, tup_entry_vardt(tent), used_groups_root, &important_link_removed) < 0) {
+		if(write_files(f, tent->tnode.tupid, &s->finfo, warning_dest, 1, sticky_root, normal_root, group_sticky_root, full_deps, tup_entry_vardt(tent), used_groups_root, &log->important_link_removed) < 0) {
 			fprintf(f, " *** Additionally, command %lli failed to process input dependencies.", tent->tnode.tupid);
 		}
 	} else {
 		fprintf(f, "tup internal error: Expected s->exited or s->signalled to be set for command ID=%lli", tent->tnode.tupid);
 	}
 
+	if(log->is_err)
+		return -1;
+	if(tent->mtime != ms)
+		if(tup_db_set_mtime(tent, ms) < 0)
+			return -1;
+	cs.wall = ms;
+	cs.cpu = s->cpu_ms;
+	cs.rss = s->rss_kb;
+	if(tup_db_set_cmd_stats(tent->tnode.tupid, &cs) < 0)
+		return -1;
+	return 0;
+}
+
+/* Checks the outputs of a command that compares them (^o), and displays the
+ * result along with anything the command printed. This runs in the job after
+ * save_output(), and only holds the display lock to print. The log is closed.
+ */
+static int show_output(struct server *s, struct node *n, struct output_log *log,
+		       const char *expanded_name, int compare_outputs,
+		       struct trace_stats *stats)
+{
+	FILE *f = log->f;
+	struct tup_entry *tent = n->tent;
+	int always_display;
+	int rc = 0;
+
 	if(compare_outputs) {
-		if(is_err) {
+		if(log->is_err) {
 			if(restore_outputs(n) < 0)
-				return -1;
+				rc = -1;
 		} else {
-			if(important_link_removed) {
+			if(log->important_link_removed) {
 				if(unskip_outputs(n) < 0)
-					return -1;
+					rc = -1;
 			} else {
 				if(check_outputs(n) < 0)
-					return -1;
+					rc = -1;
 			}
 		}
 	}
@@ -2280,42 +2836,46 @@ static int process_output(struct server *s, struct node *n,
 	fflush(f);
 	rewind(f);
 
+	/* The server only gives us an output_fd if the command printed
+	 * something, in which case we always display the banner.
+	 */
 	always_display = 0;
-	if(s->output_fd >= 0) {
-		/* If there's any output, always display the banner. */
-		if(lseek(s->output_fd, 0, SEEK_END))
-			always_display = 1;
-		lseek(s->output_fd, 0, SEEK_SET);
-	}
+	if(s->output_fd >= 0)
+		always_display = 1;
 
-	show_result(tent, is_err, show_ts, NULL, always_display);
-	if(expanded_name && (is_err || verbose)) {
+	if(trace_enabled()) {
+		struct timespan ts;
+		timespan_start(&ts);
+		pthread_mutex_lock(&display_mutex);
+		timespan_end(&ts);
+		stats->display_wait += timespan_seconds(&ts);
+	} else {
+		pthread_mutex_lock(&display_mutex);
+	}
+	progress_add_time(n->runtime);
+	show_result(tent, log->is_err, log->show_ts, NULL, always_display);
+	if(expanded_name && (log->is_err || verbose)) {
 		FILE *eout = stdout;
-		if(is_err)
+		if(log->is_err)
 			eout = stderr;
 		fprintf(eout, "tup: Expanded command string: %s\n", expanded_name);
 	}
 	if(s->output_fd >= 0) {
-		if(display_output(s->output_fd, is_err ? 3 : 0, tent->name.s, 0, NULL) < 0)
-			return -1;
+		if(display_output(s->output_fd, log->is_err ? 3 : 0, tent->name.s, 0, NULL) < 0)
+			rc = -1;
 		if(close(s->output_fd) < 0) {
 			perror("close(s->output_fd)");
-			return -1;
+			rc = -1;
 		}
 	}
 	if(display_output(fileno(f), 2, tent->name.s, 0, NULL) < 0)
-		return -1;
+		rc = -1;
+	pthread_mutex_unlock(&display_mutex);
 	if(fclose(f) != 0) {
 		perror("fclose");
-		return -1;
+		rc = -1;
 	}
-
-	if(is_err)
-		return -1;
-	if(tent->mtime != ms)
-		if(tup_db_set_mtime(tent, ms) < 0)
-			return -1;
-	return 0;
+	return rc;
 }
 
 #define TMPFILESIZE 32
@@ -2525,6 +3085,7 @@ static int do_ln(struct server *s, struct tup_entry *dtent, int dfd, const char
 	map->realname = strdup(fileout);
 	map->tmpname = strdup(fileout);
 	map->tent = NULL;
+	map->have_mtime = 0;
 	finfo_lock(&s->finfo);
 	LIST_INSERT_HEAD(&s->finfo.mapping_list, map, list);
 	finfo_unlock(&s->finfo);
@@ -2534,25 +3095,181 @@ static int do_ln(struct server *s, struct tup_entry *dtent, int dfd, const char
 	return 0;
 }
 
+/* The state of a single command in update(), shared with the requests that
+ * run in the database thread.
+ */
+struct update_info {
+	struct node *n;
+	const char *name;
+	const char *cmd;
+	char *expanded_name;
+	struct server s;
+	int dfd;
+	struct tupid_entries sticky_root;
+	struct tupid_entries normal_root;
+	struct tupid_entries group_sticky_root;
+	struct tupid_entries used_groups_root;
+	struct tup_env newenv;
+	struct timespan ts;
+	int compare_outputs;
+	struct trace_stats stats;
+	struct artifact art;
+	int use_cache;
+	struct output_log log;
+};
+
+/* Collects the paths needed for the artifact cache key. Commands that compare
+ * their outputs (^o) aren't cached, since restoring the outputs would always
+ * look like a change.
+ */
+static int get_artifact_paths(struct update_info *info)
+{
+	struct node *n = info->n;
+	struct edge *e;
+	char path[PATH_MAX];
+
+	if(!artifact_cache_enabled() || info->compare_outputs)
+		return 0;
+	if(snprint_tup_entry(path, sizeof(path), n->tent->parent) >= (int)sizeof(path))
+		return -1;
+	if(artifact_init(&info->art, path) < 0)
+		return -1;
+	info->use_cache = 1;
+	LIST_FOREACH(e, &n->edges, list) {
+		struct tup_entry *output = e->dest->tent;
+		if(output->type != TUP_NODE_GROUP) {
+			if(snprint_tup_entry(path, sizeof(path), output) >= (int)sizeof(path))
+				return -1;
+			/* Skip the leading '/' */
+			if(artifact_add_output(&info->art, path + 1) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/* Moves the outputs into place before their dependencies are saved. See
+ * rename_outputs() in file.c.
+ */
+static int move_new_outputs(struct node *n, struct file_info *finfo)
+{
+	struct edge *e;
+	char path[PATH_MAX];
+	char **outputs = NULL;
+	int num_outputs = 0;
+	int rc = -1;
+	int x;
+
+	if(LIST_EMPTY(&finfo->mapping_list))
+		return 0;
+	LIST_FOREACH(e, &n->edges, list) {
+		struct tup_entry *output = e->dest->tent;
+		char **tmp;
+
+		if(output->type == TUP_NODE_GROUP)
+			continue;
+		if(snprint_tup_entry(path, sizeof(path), output) >= (int)sizeof(path))
+			goto out_free;
+		tmp = realloc(outputs, sizeof(*tmp) * (num_outputs + 1));
+		if(!tmp) {
+			perror("realloc");
+			goto out_free;
+		}
+		outputs = tmp;
+		/* Skip the leading '/' */
+		outputs[num_outputs] = strdup(path + 1);
+		if(!outputs[num_outputs]) {
+			perror("strdup");
+			goto out_free;
+		}
+		num_outputs++;
+	}
+	qsort(outputs, num_outputs, sizeof(*outputs), strcmp_p);
+	rc = rename_outputs(finfo, outputs, num_outputs);
+
+out_free:
+	for(x=0; x<num_outputs; x++)
+		free(outputs[x]);
+	free(outputs);
+	return rc;
+}
+
+static int update_get_inputs(void *arg)
+{
+	struct update_info *info = arg;
+	struct node *n = info->n;
+	int rc;
+
+	rc = tup_db_get_inputs(n->tent->tnode.tupid, &info->sticky_root, &info->normal_root, &info->group_sticky_root);
+	if(rc == 0)
+		rc = tup_db_get_environ(&info->sticky_root, &info->normal_root, &info->newenv);
+	if(rc == 0) {
+		if(expand_command(&info->expanded_name, n->tent, info->name, &info->group_sticky_root, &info->used_groups_root) < 0)
+			rc = -1;
+		if(info->expanded_name)
+			info->cmd = info->expanded_name;
+	}
+	if(rc == 0)
+		rc = get_artifact_paths(info);
+	initialize_server_struct(&info->s, n->tent);
+	return rc;
+}
+
+static int update_ln(void *arg)
+{
+	struct update_info *info = arg;
+	return do_ln(&info->s, info->n->tent->parent, info->dfd, info->cmd + 8);
+}
+
+static int update_save_output(void *arg)
+{
+	struct update_info *info = arg;
+	return save_output(&info->s, info->n, &info->sticky_root, &info->normal_root, &info->group_sticky_root, &info->ts, &info->used_groups_root, &info->log);
+}
+
+/* Only saving the dependencies goes through the database thread. The outputs
+ * are compared and the result displayed in the job itself, so other jobs can
+ * get to the database in the meantime.
+ */
+static int process_output(struct update_info *info)
+{
+	int rc;
+
+	info->log.f = tmpfile();
+	if(!info->log.f) {
+		pthread_mutex_lock(&display_mutex);
+		show_result(info->n->tent, 1, NULL, NULL, 1);
+		perror("tmpfile");
+		fprintf(stderr, "tup error: Unable to open the error log for writing.\n");
+		pthread_mutex_unlock(&display_mutex);
+		return -1;
+	}
+	rc = db_call(update_save_output, info, &info->stats.db_wait);
+	if(show_output(&info->s, info->n, &info->log, info->expanded_name, info->compare_outputs, &info->stats) < 0)
+		rc = -1;
+	return rc;
+}
+
 static int update(struct node *n)
 {
 	int dfd = -1;
 	const char *name = n->tent->name.s;
-	char *expanded_name = NULL;
 	const char *cmd;
-	struct server s;
+	struct update_info info;
 	int rc;
-	struct tupid_entries sticky_root = {NULL};
-	struct tupid_entries normal_root = {NULL};
-	struct tupid_entries group_sticky_root = {NULL};
-	struct tup_env newenv;
-	struct timespan ts;
 	int need_namespacing = 0;
 	int compare_outputs = 0;
 	int use_server = 0;
-	struct tupid_entries used_groups_root = {NULL};
 
-	timespan_start(&ts);
+	info.n = n;
+	info.expanded_name = NULL;
+	info.use_cache = 0;
+	RB_INIT(&info.sticky_root);
+	RB_INIT(&info.normal_root);
+	RB_INIT(&info.group_sticky_root);
+	RB_INIT(&info.used_groups_root);
+	memset(&info.stats, 0, sizeof(info.stats));
+	timespan_start(&info.ts);
 	if(name[0] == '^') {
 		name++;
 		while(*name && *name != ' ' && *name != '^') {
@@ -2603,53 +3320,78 @@ static int update(struct node *n)
 			goto err_close_dfd;
 	}
 
-	pthread_mutex_lock(&db_mutex);
-	rc = tup_db_get_inputs(n->tent->tnode.tupid, &sticky_root, &normal_root, &group_sticky_root);
-	if(rc == 0)
-		rc = tup_db_get_environ(&sticky_root, &normal_root, &newenv);
-	if(rc == 0) {
-		if(expand_command(&expanded_name, n->tent, name, &group_sticky_root, &used_groups_root) < 0)
-			rc = -1;
-		if(expanded_name)
-			cmd = expanded_name;
-	}
-	initialize_server_struct(&s, n->tent);
-	pthread_mutex_unlock(&db_mutex);
-	if(rc < 0)
+	info.name = name;
+	info.cmd = cmd;
+	info.dfd = dfd;
+	info.compare_outputs = compare_outputs;
+	rc = db_call(update_get_inputs, &info, &info.stats.db_wait);
+	cmd = info.cmd;
+	if(rc < 0) {
+		if(info.use_cache)
+			artifact_free(&info.art);
 		goto err_close_dfd;
+	}
+	if(info.use_cache) {
+		if(strncmp(cmd, "!tup_ln ", 8) == 0 ||
+		   artifact_set_key(&info.art, cmd, &info.newenv) < 0) {
+			artifact_free(&info.art);
+			info.use_cache = 0;
+		}
+	}
 	if(strncmp(cmd, "!tup_ln ", 8) == 0) {
-		pthread_mutex_lock(&db_mutex);
-		rc = do_ln(&s, n->tent->parent, dfd, cmd + 8);
-		pthread_mutex_unlock(&db_mutex);
+		rc = db_call(update_ln, &info, &info.stats.db_wait);
+	} else if(info.use_cache && (rc = artifact_restore(&info.art, &info.s.finfo)) != 0) {
+		if(rc == 1) {
+			info.s.exited = 1;
+			info.s.exit_status = 0;
+			rc = 0;
+		}
 	} else {
-		rc = server_exec(&s, dfd, cmd, &newenv, n->tent->parent, need_namespacing);
+		rc = server_exec(&info.s, dfd, cmd, &info.newenv, n->tent->parent, need_namespacing);
 		use_server = 1;
+		if(rc == 0 && info.use_cache && info.s.exited &&
+		   info.s.exit_status == 0 && info.s.output_fd < 0)
+			artifact_record(&info.art, &info.s.finfo);
 	}
 	if(rc < 0) {
 		pthread_mutex_lock(&display_mutex);
 		fprintf(stderr, " *** Command ID=%lli failed: %s\n", n->tnode.tupid, cmd);
 		pthread_mutex_unlock(&display_mutex);
-		free(expanded_name);
+		free(info.expanded_name);
+		if(info.use_cache)
+			artifact_free(&info.art);
 		goto err_close_dfd;
 	}
-	environ_free(&newenv);
+	environ_free(&info.newenv);
 	if(close(dfd) < 0) {
 		perror("close(dfd)");
 		return -1;
 	}
+	if(move_new_outputs(n, &info.s.finfo) < 0)
+		return -1;
 
-	pthread_mutex_lock(&db_mutex);
-	pthread_mutex_lock(&display_mutex);
-	rc = process_output(&s, n, &sticky_root, &normal_root, &group_sticky_root, &ts, &used_groups_root, expanded_name, compare_outputs);
-	pthread_mutex_unlock(&display_mutex);
-	pthread_mutex_unlock(&db_mutex);
-	free(expanded_name);
-	free_tupid_tree(&sticky_root);
-	free_tupid_tree(&normal_root);
-	free_tupid_tree(&group_sticky_root);
-	free_tupid_tree(&used_groups_root);
+	rc = process_output(&info);
+	if(info.use_cache) {
+		if(rc == 0)
+			artifact_store(&info.art);
+		artifact_free(&info.art);
+	}
+	if(trace_enabled()) {
+		struct timespan tts;
+		memcpy(&tts.start, &info.ts.start, sizeof(tts.start));
+		timespan_end(&tts);
+		info.stats.fuse_events = info.s.finfo.num_events;
+		info.stats.bytes_read = info.s.finfo.bytes_read;
+		info.stats.bytes_written = info.s.finfo.bytes_written;
+		trace_span("command", n->tent, &tts, &info.stats);
+	}
+	free(info.expanded_name);
+	free_tupid_tree(&info.sticky_root);
+	free_tupid_tree(&info.normal_root);
+	free_tupid_tree(&info.group_sticky_root);
+	free_tupid_tree(&info.used_groups_root);
 	if(use_server)
-		if(server_postexec(&s) < 0)
+		if(server_postexec(&info.s) < 0)
 			return -1;
 	return rc;
 
@@ -45,6 +45,7 @@ int vardb_close(struct vardb *v)
 		free(ve->value);
 		free(ve);
 	}
+	v->count = 0;
 	return 0;
 }
 
@@ -129,6 +130,18 @@ struct var_entry *vardb_set2(struct vardb *v, const char *var, int varlen,
 	return ve;
 }
 
+int vardb_clone(struct vardb *dest, struct vardb *src)
+{
+	struct string_tree *st;
+
+	RB_FOREACH(st, string_entries, &src->root) {
+		struct var_entry *ve = container_of(st, struct var_entry, var);
+		if(vardb_set2(dest, st->s, st->len, ve->value, ve->tent) == NULL)
+			return -1;
+	}
+	return 0;
+}
+
 int vardb_append(struct vardb *v, const char *var, const char *value)
 {
 	struct string_tree *st;
@@ -48,6 +48,7 @@ int vardb_set(struct vardb *v, const char *var, const char *value,
               struct tup_entry *tent);
 struct var_entry *vardb_set2(struct vardb *v, const char *var, int varlen,
                              const char *value, struct tup_entry *tent);
+int vardb_clone(struct vardb *dest, struct vardb *src);
 int vardb_append(struct vardb *v, const char *var, const char *value);
 int vardb_copy(struct vardb *v, const char *var, int varlen, struct estring *e);
 struct var_entry *vardb_get(struct vardb *v, const char *var, int varlen);
@@ -0,0 +1,22 @@
+#! /bin/sh -e
+# Build a graph with a deep chain of slow commands next to a wide layer of
+# quick ones, and limit it to two jobs. The first update records how long each
+# command takes. After touching the input, the second update should start the
+# slow chain first and finish in about the length of the chain. With a large
+# NUM the quick commands are the longer path, so this can't do better than
+# splitting them evenly across both jobs.
+
+echo 'quick' > quick.txt
+echo 'slow' > slow.txt
+for i in `seq 1 $1`; do echo $i > in$i.txt; done
+cat > Tupfile << HERE
+: slow.txt |> sleep 0.5; cat %f > %o |> slow1.txt
+: slow1.txt |> sleep 0.5; cat %f > %o |> slow2.txt
+: slow2.txt |> sleep 0.5; cat %f > %o |> slow3.txt
+: slow3.txt |> sleep 0.5; cat %f > %o |> slow4.txt
+: foreach in*.txt | quick.txt |> sleep 0.02; cat %f quick.txt > %o |> %B.out
+HERE
+tup upd -j2
+
+touch quick.txt slow.txt
+tup upd -j2
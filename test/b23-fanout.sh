@@ -0,0 +1,15 @@
+#! /bin/sh -e
+# Make every command depend on a single header, then touch the header and ask
+# what needs to be done. This mostly measures how long it takes to load the
+# fanned-out graph from the database.
+
+echo 'int x;' > foo.h
+for i in `seq 1 $1`; do echo "#include \"foo.h\"" > file$i.c; done
+cat > Tupfile << HERE
+: foreach *.c | foo.h |> cat %f foo.h > %o |> %B.o
+HERE
+tup upd
+
+sleep 1
+touch foo.h
+tup todo
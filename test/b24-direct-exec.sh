@@ -0,0 +1,10 @@
+#! /bin/sh -e
+# Run a lot of commands with no shell syntax, which tup starts directly
+# without going through /bin/sh. Compare with b25-shell-exec.sh to see how
+# many more commands per second this gets.
+
+for i in `seq 1 $1`; do echo $i > in$i.txt; done
+cat > Tupfile << HERE
+: foreach in*.txt |> cp %f %o |> %B.out
+HERE
+tup upd
@@ -0,0 +1,10 @@
+#! /bin/sh -e
+# The same commands as b24-direct-exec.sh, but with updater.direct_exec
+# turned off so that each one goes through /bin/sh.
+
+(echo "[updater]"; echo "direct_exec=0") >> .tup/options
+for i in `seq 1 $1`; do echo $i > in$i.txt; done
+cat > Tupfile << HERE
+: foreach in*.txt |> cp %f %o |> %B.out
+HERE
+tup upd
@@ -0,0 +1,11 @@
+#! /bin/sh -e
+# Pass large files through the FUSE file-system. Each command reads and
+# writes NUM megabytes, so this mostly measures read/write throughput of the
+# mount rather than per-command overhead.
+
+dd if=/dev/zero of=big bs=1048576 count=$1 2>/dev/null
+cat > Tupfile << HERE
+: big |> cat %f > %o |> copy1
+: copy1 |> cat %f > %o |> copy2
+HERE
+tup upd
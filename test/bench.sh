@@ -5,15 +5,19 @@
 # Run all benchmarks: ./bench.sh
 # Run all benchmarks with 1000 iterations: ./bench.sh NUM=1000
 # Run specific benchmarks: ./bench.sh b00-init.sh
+# Run all benchmarks with the database in WAL mode: ./bench.sh WAL=1
 #
 # Normally I might run just ./bench.sh with different checkouts of tup. Or, I
 # might run ./bench.sh with NUM=100, 1000, 10000, etc to see how it scales.
 
 NUM=100
+WAL=0
 
 while [ $# -gt 0 ]; do
 	if echo $1 | grep 'NUM=' > /dev/null; then
 		NUM=`echo $1 | sed 's/NUM=//'`
+	elif echo $1 | grep 'WAL=' > /dev/null; then
+		WAL=`echo $1 | sed 's/WAL=//'`
 	else
 		files="$files $1"
 	fi
@@ -32,7 +36,7 @@ for i in $files; do
 	rm -rf $testdir
 	mkdir $testdir
 	cd $testdir
-	t=`((time -p (tup init --force > /dev/null; ../$i $NUM > /dev/null 2>&3); echo -n MARF$?FRAM 1>&4) 2>&1 | grep ^real | awk '{print $2}') 3>&1 4>&1 | sed 's/MARF0FRAM//'`
+	t=`((time -p (tup init --force > /dev/null; printf "[db]\nwal=$WAL\n" >> .tup/options; ../$i $NUM > /dev/null 2>&3); echo -n MARF$?FRAM 1>&4) 2>&1 | grep ^real | awk '{print $2}') 3>&1 4>&1 | sed 's/MARF0FRAM//'`
 	if echo "$t" | grep 'MARF' > /dev/null; then
 		echo "$t"
 		exit 1
@@ -0,0 +1,70 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Several Tupfiles that include the same Tuprules.tup chain should each see the
+# same variables and !-macros, whether or not the chain is re-parsed for them.
+. ./tup.sh
+
+tmkdir sub
+cat > Tuprules.tup << HERE
+CFLAGS = -Wall
+ifeq (@(DEBUG),y)
+CFLAGS += -g
+endif
+!cc = |> gcc \$(CFLAGS) -c %f -o %o |> %B.o
+HERE
+cat > sub/Tuprules.tup << HERE
+CFLAGS += -O2
+HERE
+
+for i in a b c; do
+	tmkdir sub/$i
+	echo 'include_rules' > sub/$i/Tupfile
+	echo ': foreach *.c |> !cc |>' >> sub/$i/Tupfile
+	echo "int $i;" > sub/$i/$i.c
+done
+
+# This one sets a variable before include_rules, so it can't start from the
+# saved state of the chain.
+cat > sub/c/Tupfile << HERE
+CFLAGS = -DC
+include_rules
+: foreach *.c |> !cc |>
+HERE
+update
+
+tup_object_exist sub/a 'gcc -Wall -O2 -c a.c -o a.o'
+tup_object_exist sub/b 'gcc -Wall -O2 -c b.c -o b.o'
+tup_object_exist sub/c 'gcc -Wall -O2 -c c.c -o c.o'
+
+varsetall DEBUG=y
+update
+
+tup_object_exist sub/a 'gcc -Wall -g -O2 -c a.c -o a.o'
+tup_object_exist sub/b 'gcc -Wall -g -O2 -c b.c -o b.o'
+
+cat > sub/Tuprules.tup << HERE
+CFLAGS += -O3
+HERE
+tup touch sub/Tuprules.tup
+update
+
+tup_object_exist sub/a 'gcc -Wall -g -O3 -c a.c -o a.o'
+tup_object_exist sub/b 'gcc -Wall -g -O3 -c b.c -o b.o'
+
+eotup
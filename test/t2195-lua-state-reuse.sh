@@ -0,0 +1,73 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Lua states are reused between Tupfile.lua files, so make sure globals and
+# changes to the libraries (including the string metatable) don't leak from
+# one directory to the next, and that a cached Tuprules.lua gives the same
+# results in each directory.
+. ./tup.sh
+
+cat > Tuprules.lua << HERE
+CFLAGS = '-Wall'
+HERE
+
+for i in a b c; do
+	tmkdir $i
+	echo "int $i;" > $i/$i.c
+done
+
+cat > a/Tupfile.lua << HERE
+leaked = 'yes'
+tup.leaked = 'yes'
+string.leaked = 'yes'
+getmetatable('').leaked = 'yes'
+function string.shout(s) return s:upper() .. '!' end
+if ('a'):shout() ~= 'A!' then
+	error 'string methods should come from this Tupfile.lua'
+end
+CFLAGS += '-DA'
+tup.foreach_rule('*.c', 'gcc \$(CFLAGS) -c %f -o %o', '%B.o')
+HERE
+for i in b c; do
+	cat > $i/Tupfile.lua << HERE
+if leaked or tup.leaked or string.leaked or getmetatable('').leaked or string.shout then
+	error 'globals leaked from another Tupfile.lua'
+end
+if ('b'):upper() ~= 'B' then
+	error 'string methods are missing'
+end
+tup.foreach_rule('*.c', 'gcc \$(CFLAGS) -c %f -o %o', '%B.o')
+HERE
+done
+update
+
+tup_object_exist a 'gcc -Wall -DA -c a.c -o a.o'
+tup_object_exist b 'gcc -Wall -c b.c -o b.o'
+tup_object_exist c 'gcc -Wall -c c.c -o c.o'
+
+cat > Tuprules.lua << HERE
+CFLAGS = '-O2'
+HERE
+tup touch Tuprules.lua
+update
+
+tup_object_exist a 'gcc -O2 -DA -c a.c -o a.o'
+tup_object_exist b 'gcc -O2 -c b.c -o b.o'
+tup_object_exist c 'gcc -O2 -c c.c -o c.o'
+
+eotup
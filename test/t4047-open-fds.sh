@@ -29,9 +29,10 @@ HERE
 tup touch Tupfile
 update
 
-# On Gentoo, stdout points to output-0, while on Ubuntu, it points to the
-# redirected file (fds.txt). This might be a bash vs dash thing.
-text=`cat fds.txt | grep -v ' 0 .*/dev/null' | grep -v ' 1 .*output-' | grep -v ' 1 .*fds.txt' | grep -v ' 2 .*errors'`
+# On Gentoo, stdout points to the captured output, while on Ubuntu, it points
+# to the redirected file (fds.txt). This might be a bash vs dash thing. The
+# captured output is a memfd, or a deleted output-N file on older kernels.
+text=`cat fds.txt | grep -v ' 0 .*/dev/null' | grep -v ' 1 .*output-' | grep -v ' [12] .*memfd:output' | grep -v ' 1 .*fds.txt' | grep -v ' 2 .*errors'`
 if [ "$text" != "total 0" ]; then
 	echo "Error: These fds shouldn't be open: $text" 1>&2
 	exit 1
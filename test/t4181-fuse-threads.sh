@@ -0,0 +1,52 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Run a bunch of jobs that all read the same headers while the fuse server
+# uses multiple threads, and make sure each job gets its own dependencies.
+. ./tup.sh
+check_no_windows fuse
+
+(echo "[fuse]"; echo "num_threads=4") >> .tup/options
+
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+echo '#define FOO 1' > foo.h
+echo '#define BAR 1' > bar.h
+for i in `seq 1 20`; do
+	if [ $(($i % 2)) = 0 ]; then
+		echo "#include \"foo.h\"" > file$i.c
+	else
+		echo "#include \"bar.h\"" > file$i.c
+	fi
+	echo "int file$i;" >> file$i.c
+done
+update -j8
+
+for i in `seq 1 20`; do
+	check_exist file$i.o
+	if [ $(($i % 2)) = 0 ]; then
+		tup_dep_exist . foo.h . "gcc -c file$i.c -o file$i.o"
+		tup_dep_no_exist . bar.h . "gcc -c file$i.c -o file$i.o"
+	else
+		tup_dep_exist . bar.h . "gcc -c file$i.c -o file$i.o"
+		tup_dep_no_exist . foo.h . "gcc -c file$i.c -o file$i.o"
+	fi
+done
+
+eotup
@@ -0,0 +1,45 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Make sure --trace writes a span for each command and Tupfile parse.
+. ./tup.sh
+
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+: *.o |> cat %f > %o |> all.txt
+HERE
+echo 'int foo;' > foo.c
+echo 'int bar;' > bar.c
+update --trace=trace.json -j2
+
+for i in '"cat":"parse"' '"cat":"command"' '"name":"gcc -c foo.c -o foo.o"' '"name":"gcc -c bar.c -o bar.o"' '"bytes_written":' '"fuse_events":'; do
+	if ! grep "$i" trace.json > /dev/null; then
+		echo "Error: Expected to find '$i' in trace.json" 1>&2
+		exit 1
+	fi
+done
+if [ "`grep -c '"cat":"command"' trace.json`" != "3" ]; then
+	echo "Error: Expected 3 commands in trace.json" 1>&2
+	exit 1
+fi
+# The trace must be valid JSON if python is around to check it.
+if which python3 > /dev/null 2>&1; then
+	python3 -c 'import json,sys; json.load(open("trace.json"))'
+fi
+
+eotup
@@ -0,0 +1,61 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Make sure each command's runtime history is saved, and 'tup stats' shows it.
+. ./tup.sh
+
+mkdir sub
+cat > Tupfile << HERE
+: |> sleep 0.5; touch %o |> slow.txt
+: |> touch %o |> fast.txt
+HERE
+cat > sub/Tupfile << HERE
+: |> touch %o |> sub.txt
+HERE
+update
+
+tup stats > stats.txt
+for i in 'sleep 0.5; touch slow.txt' 'touch fast.txt' 'sub: touch sub.txt'; do
+	if ! grep "$i" stats.txt > /dev/null; then
+		echo "Error: Expected to find '$i' in the stats output" 1>&2
+		exit 1
+	fi
+done
+if ! grep -A1 'wall' stats.txt | grep 'slow.txt' > /dev/null; then
+	echo "Error: Expected the sleep command to be listed first" 1>&2
+	exit 1
+fi
+
+tup stats 1 > stats.txt
+if [ "`grep -c 'touch' stats.txt`" != "1" ]; then
+	echo "Error: Expected 'tup stats 1' to only show one command" 1>&2
+	exit 1
+fi
+
+# Removing the command also removes its history.
+cat > Tupfile << HERE
+: |> touch %o |> fast.txt
+HERE
+update
+tup stats > stats.txt
+if grep 'slow.txt' stats.txt > /dev/null; then
+	echo "Error: Expected the history of the removed command to be gone" 1>&2
+	exit 1
+fi
+
+eotup
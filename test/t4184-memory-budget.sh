@@ -0,0 +1,46 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With a memory budget smaller than any command, commands that have run before
+# must run one at a time, even with several jobs.
+. ./tup.sh
+check_no_windows memory_budget
+
+lock=/tmp/tup-t4184-lock-$$
+rm -rf $lock
+cat > Tupfile << HERE
+: foreach *.txt |> mkdir $lock && sleep 0.2 && rmdir $lock && cp %f %o |> %B.out
+HERE
+for i in 1 2 3 4; do
+	echo "file $i" > file$i.txt
+done
+# The first run only records each command's memory.
+update -j1
+
+(echo "[updater]"; echo "memory_budget=1") >> .tup/options
+for i in 1 2 3 4; do
+	echo "new file $i" > file$i.txt
+done
+update -j4
+rm -rf $lock
+
+for i in 1 2 3 4; do
+	check_exist file$i.out
+done
+
+eotup
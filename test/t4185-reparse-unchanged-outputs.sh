@@ -0,0 +1,66 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Re-parsing a Tupfile that ends up with the same outputs shouldn't re-parse
+# the directories that use those outputs. If the outputs change, they must be
+# re-parsed.
+. ./tup.sh
+
+tmkdir lib
+tmkdir app
+cat > lib/Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+cat > app/Tupfile << HERE
+: ../lib/*.o |> ar crs %o %f |> libapp.a
+HERE
+echo "int foo;" > lib/foo.c
+update
+
+cat > lib/Tupfile << HERE
+: foreach *.c |> gcc -Wall -c %f -o %o |> %B.o
+HERE
+tup touch lib/Tupfile
+tup parse > output.txt
+
+if ! grep lib output.txt > /dev/null; then
+	echo "Error: Expected to parse 'lib'" 1>&2
+	exit 1
+fi
+if grep app output.txt > /dev/null; then
+	echo "Error: Expected not to parse 'app'" 1>&2
+	exit 1
+fi
+update
+
+cat > lib/Tupfile << HERE
+: foreach *.c |> gcc -Wall -c %f -o %o |> %B.o
+: |> touch %o |> bar.o
+HERE
+tup touch lib/Tupfile
+tup parse > output.txt
+
+if ! grep app output.txt > /dev/null; then
+	echo "Error: Expected to parse 'app'" 1>&2
+	exit 1
+fi
+update
+
+check_exist lib/bar.o app/libapp.a
+
+eotup
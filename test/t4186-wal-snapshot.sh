@@ -0,0 +1,61 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# In WAL mode, read-only commands work from a snapshot of the database instead
+# of waiting for an update in progress to finish.
+. ./tup.sh
+check_no_windows wal
+
+sync=/tmp/tup-t4186-$$
+rm -rf $sync
+mkdir $sync
+(echo "[db]"; echo "wal=1") >> .tup/options
+cat > Tupfile << HERE
+: foo.txt |> cp %f %o |> foo.out
+: foo.txt |> touch $sync/started; while [ ! -f $sync/done ]; do sleep 0.1; done; cp %f %o |> slow.out
+HERE
+echo foo > foo.txt
+touch $sync/done
+update
+rm -f $sync/started $sync/done
+
+echo bar > foo.txt
+tup touch foo.txt
+tup upd > /dev/null &
+pid=$!
+while [ ! -f $sync/started ]; do sleep 0.1; done
+
+# These would block on the shared lock if they couldn't use the snapshot.
+tup graph . > ok.dot
+tup todo > todo.txt
+tup stats > /dev/null
+touch $sync/done
+wait $pid
+rm -rf $sync
+
+if ! grep 'foo.out' ok.dot > /dev/null; then
+	echo "Error: Expected 'tup graph' to show foo.out." 1>&2
+	exit 1
+fi
+if ! grep "Run 'tup upd'" todo.txt > /dev/null; then
+	echo "Error: Expected 'tup todo' to report pending work from the snapshot." 1>&2
+	exit 1
+fi
+check_exist slow.out
+
+eotup
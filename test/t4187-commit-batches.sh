@@ -0,0 +1,60 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With updater.commit_jobs set, commands that finished before tup was killed
+# are committed and don't run again.
+. ./tup.sh
+check_no_windows shell
+
+# Ignore errors, since the killed tup makes for a bad-looking error message.
+exec 2>/dev/null
+
+log=/tmp/tup-t4187-log-$$
+rm -f $log
+(echo "[updater]"; echo "commit_jobs=1") >> .tup/options
+cat > die.sh << HERE
+while [ ! -f pid.txt ]; do true; done
+kill -9 \`cat pid.txt\`
+HERE
+cat > Tupfile << HERE
+: |> echo a >> $log; echo a > %o |> a.txt
+: a.txt |> sh die.sh; cp %f %o |> b.txt
+HERE
+tup touch die.sh Tupfile
+tup upd &
+pid=$!
+echo $pid > pid.txt
+
+if wait $pid; then
+	echo "Error: Expected the spawned tup process to fail." 1>&2
+	exit 1
+fi
+
+echo "" > die.sh
+tup touch die.sh
+update
+check_exist b.txt
+
+if [ "`cat $log`" != "a" ]; then
+	echo "Error: Expected a.txt to be built only once." 1>&2
+	rm -f $log
+	exit 1
+fi
+rm -f $log
+
+eotup
@@ -0,0 +1,85 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Try the different kinds of 'tup query'.
+. ./tup.sh
+
+tmkdir sub
+cat > sub/Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+: *.o |> gcc %f -o %o |> prog
+HERE
+echo 'int main(void) {return 0;}' > sub/foo.c
+echo 'int bar;' > sub/bar.c
+update
+
+tup query rdeps sub/foo.c > .out
+if ! grep '^1	[0-9]*	command	sub	gcc -c foo.c -o foo.o$' .out > /dev/null; then
+	cat .out
+	echo "Error: Expected the compile command at depth 1." 1>&2
+	exit 1
+fi
+if ! grep '^4	[0-9]*	generated file	sub	prog$' .out > /dev/null; then
+	cat .out
+	echo "Error: Expected prog at depth 4." 1>&2
+	exit 1
+fi
+if grep '	bar\.[co]$' .out > /dev/null; then
+	cat .out
+	echo "Error: bar.c doesn't depend on foo.c" 1>&2
+	exit 1
+fi
+
+tup query rdeps --depth 2 sub/foo.c > .out
+if grep 'prog' .out > /dev/null; then
+	cat .out
+	echo "Error: Expected --depth 2 to stop before prog." 1>&2
+	exit 1
+fi
+
+tup query deps --json sub/prog > .out
+if ! grep '^{"depth": 4, "id": [0-9]*, "type": "normal file", "dir": "sub", "name": "bar.c"}$' .out > /dev/null; then
+	cat .out
+	echo "Error: Expected bar.c at depth 4 in JSON output." 1>&2
+	exit 1
+fi
+
+tup query path sub/bar.c sub/prog | cut -f 1,5 > .out
+cat > .expected << HERE
+0	bar.c
+1	gcc -c bar.c -o bar.o
+2	bar.o
+3	gcc bar.o foo.o -o prog
+4	prog
+HERE
+diff .expected .out
+
+if tup query path sub/prog sub/bar.c > /dev/null 2>&1; then
+	echo "Error: Expected no path from prog to bar.c" 1>&2
+	exit 1
+fi
+
+tup query cmds . | cut -f 1,4 | sort > .out
+cat > .expected << HERE
+1	sub
+1	sub
+1	sub
+HERE
+diff .expected .out
+
+eotup
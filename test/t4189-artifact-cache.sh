@@ -0,0 +1,75 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With updater.artifact_cache set, a command whose inputs go back to contents
+# that were already built restores its output from the cache instead of
+# running again.
+. ./tup.sh
+check_no_windows shell
+
+cache=/tmp/tup-t4189-cache-$$
+log=/tmp/tup-t4189-log-$$
+rm -rf $cache $log
+(echo "[updater]"; echo "artifact_cache=$cache") >> .tup/options
+cat > Tupfile << HERE
+: foo.txt |> echo run >> $log; tr a-z A-Z < %f > %o |> foo.out
+HERE
+echo hello > foo.txt
+update
+
+cmp_log()
+{
+	if [ "`wc -l < $log`" != "$1" ]; then
+		echo "Error: Expected the command to run $1 times." 1>&2
+		exit 1
+	fi
+}
+cmp_log 1
+echo HELLO | diff - foo.out
+
+echo world > foo.txt
+tup touch foo.txt
+update
+cmp_log 2
+echo WORLD | diff - foo.out
+
+echo hello > foo.txt
+tup touch foo.txt
+update
+cmp_log 2
+echo HELLO | diff - foo.out
+check_updates foo.txt foo.out
+
+# The shell reads the directory, so a new file in it misses the cache.
+echo world > foo.txt
+touch new.txt
+tup touch foo.txt new.txt
+update
+cmp_log 3
+echo WORLD | diff - foo.out
+
+# A different command string misses the cache.
+cat > Tupfile << HERE
+: foo.txt |> echo run >> $log; tr a-z A-Z < %f > %o; echo 2 >> %o |> foo.out
+HERE
+tup touch Tupfile
+update
+cmp_log 4
+
+rm -rf $cache $log
+eotup
@@ -0,0 +1,52 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Simple commands are exec'd without /bin/sh. Make sure a missing or
+# non-executable program fails with the same exit code as in the shell, and
+# that a script without a #! line still runs.
+. ./tup.sh
+check_no_windows shell
+
+cat > Tupfile << HERE
+: |> tup-no-such-program |>
+HERE
+update_fail_msg "failed with return value 127"
+
+cat > notexec.sh << HERE
+#! /bin/sh
+echo hi
+HERE
+chmod -x notexec.sh
+cat > Tupfile << HERE
+: |> ./notexec.sh |>
+HERE
+tup touch notexec.sh
+update_fail_msg "failed with return value 126"
+
+cat > noshebang.sh << HERE
+echo hello > out.txt
+HERE
+chmod +x noshebang.sh
+cat > Tupfile << HERE
+: |> ./noshebang.sh |> out.txt
+HERE
+tup touch noshebang.sh
+update
+echo hello | diff - out.txt
+
+eotup
@@ -0,0 +1,80 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Outputs are moved into place before the command's results are written to the
+# database. Make sure the cases that can't be moved early still get reported
+# and leave nothing behind: a leftover directory, a FIFO output, and a
+# destination that can't be renamed over.
+
+. ./tup.sh
+check_no_windows mkfifo
+
+# A leftover directory means none of the outputs get moved.
+cat > Tupfile << HERE
+: |> mkdir sub; touch %o |> out.txt
+HERE
+tup touch Tupfile
+update_fail_msg "Directory '.*/sub' was created, but not subsequently removed"
+check_not_exist out.txt sub
+
+# A FIFO output is moved into place, but still has to be an error.
+cat > Tupfile << HERE
+: |> mkfifo %1o; touch %2o |> out.fifo out.fifo.txt
+HERE
+tup touch Tupfile
+update_fail_msg "Unable to create a FIFO as an output file"
+rm -f out.fifo out.fifo.txt
+
+# Put a directory where the output goes while the command is running, so the
+# rename fails.
+sync=/tmp/tup-t4191-$$
+rm -rf $sync
+mkdir $sync
+cat > Tupfile << HERE
+: |> touch %o; touch $sync/started; while [ ! -f $sync/done ]; do sleep 0.1; done |> out.txt
+HERE
+tup touch Tupfile
+set_leak_check no
+__update 2> .tup/.tupoutput &
+pid=$!
+while [ ! -f $sync/started ]; do sleep 0.1; done
+mkdir -p out.txt/x
+touch $sync/done
+if wait $pid; then
+	echo "*** Expected update to fail, but didn't" 1>&2
+	exit 1
+fi
+rm -rf $sync
+if ! grep 'Unable to rename temporary file' .tup/.tupoutput > /dev/null; then
+	echo "*** Expected the rename of out.txt to fail" 1>&2
+	cat .tup/.tupoutput 1>&2
+	exit 1
+fi
+rm -rf out.txt
+
+# Everything works again once the command is fixed.
+cat > Tupfile << HERE
+: |> touch %1o; touch %2o |> out.txt out.txt.2
+HERE
+tup touch Tupfile
+update
+check_exist out.txt out.txt.2
+check_not_exist out.fifo sub
+check_updates out.txt.2 out.txt
+
+eotup
@@ -0,0 +1,54 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With fuse.lookup_cache, repeated lookups are answered from the job's cache.
+# Make sure the dependencies are still recorded, and that a file the job
+# creates after a failed lookup is seen by the job.
+
+. ./tup.sh
+check_no_windows fuse
+
+(echo "[fuse]"; echo "lookup_cache=1") >> .tup/options
+cat > Tupfile << HERE
+: |> test -f foo.h; test -f foo.h; test ! -f bar.h; test ! -f bar.h; cat foo.h > %o |> out.txt
+: |> test ! -f new.txt; test ! -d tmp; touch %o; test -f %o; mkdir tmp; test -d tmp; rmdir tmp; test ! -d tmp |> new.txt
+HERE
+echo foo > foo.h
+update
+echo 'foo' | diff - out.txt
+check_exist new.txt
+
+tup_dep_exist . foo.h . 'test -f foo.h; test -f foo.h; test ! -f bar.h; test ! -f bar.h; cat foo.h > out.txt'
+tup_dep_exist . bar.h . 'test -f foo.h; test -f foo.h; test ! -f bar.h; test ! -f bar.h; cat foo.h > out.txt'
+
+# Both the existing file and the missing one have to trigger an update.
+echo foo2 > foo.h
+tup touch foo.h
+update
+echo 'foo2' | diff - out.txt
+
+touch bar.h
+tup touch bar.h
+update_fail_msg "Command ID=.* failed"
+
+rm bar.h
+tup rm bar.h
+update
+check_exist out.txt
+
+eotup
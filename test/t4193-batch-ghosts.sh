@@ -0,0 +1,100 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With updater.commit_jobs set, ghosts are only reclaimed by the final commit,
+# since jobs that are still running may refer to them. Remove files before and
+# during a batched update, and make sure the right ghosts are kept.
+. ./tup.sh
+check_no_windows shell
+
+sync=/tmp/tup-t4193-$$
+rm -rf $sync
+mkdir $sync
+(echo "[updater]"; echo "commit_jobs=1") >> .tup/options
+echo hi > in.txt
+echo hi > gone.txt
+echo in.txt > a.list
+touch b.list
+cat > a.sh << 'HERE'
+for f in `cat a.list`; do cat $f 2>/dev/null; done
+true
+HERE
+cat > b.sh << 'HERE'
+cat b.list
+for f in `cat b.list`; do cat $f 2>/dev/null; done
+true
+HERE
+cat > c.sh << HERE
+touch $sync/started
+while [ ! -f $sync/done ]; do sleep 0.1; done
+cat gone.txt 2>/dev/null
+true
+HERE
+cat > Tupfile << HERE
+: |> sh a.sh > %o |> a.out
+: a.out |> sh b.sh > %o |> b.out
+: b.out |> sh c.sh > %o |> c.out
+HERE
+touch $sync/done
+update
+tup_dep_exist . in.txt . 'sh a.sh > a.out'
+tup_dep_exist . gone.txt . 'sh c.sh > c.out'
+
+# in.txt becomes a ghost that only a.out's command points to. Once that stops
+# reading it, the ghost could be reclaimed in the commit after that job, but
+# b.out's command reads it next.
+rm in.txt $sync/done $sync/started
+: > a.list
+echo in.txt > b.list
+tup touch a.list b.list c.sh
+set_leak_check no
+__update > .tup/.tupoutput 2>&1 &
+pid=$!
+while [ ! -f $sync/started ]; do
+	if ! kill -0 $pid 2>/dev/null; then
+		cat .tup/.tupoutput 1>&2
+		echo "Error: update stopped before c.out's command started." 1>&2
+		exit 1
+	fi
+	sleep 0.1
+done
+rm gone.txt
+touch $sync/done
+if ! wait $pid; then
+	cat .tup/.tupoutput 1>&2
+	exit 1
+fi
+set_leak_check full
+tup_dep_no_exist . in.txt . 'sh a.sh > a.out'
+tup_dep_exist . in.txt . 'sh b.sh > b.out'
+
+# The scan now sees that gone.txt was removed during the last update, and
+# c.out's command reads it as a ghost.
+tup touch c.sh
+update
+tup_dep_exist . gone.txt . 'sh c.sh > c.out'
+
+# Once nothing reads them, the ghosts are reclaimed at the end of the update.
+: > b.list
+echo true > c.sh
+tup touch b.list c.sh
+update
+tup_object_no_exist . in.txt gone.txt
+
+rm -rf $sync
+eotup
@@ -0,0 +1,96 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# With updater.content_hash enabled, a file that gets a new timestamp but the
+# same contents shouldn't cause anything to be rebuilt.
+
+. ./tup.sh
+(echo "[updater]"; echo "content_hash=1") >> .tup/options
+
+cat > Tupfile << HERE
+: foo.txt |> cat foo.txt > %o |> out.txt
+HERE
+echo hi > foo.txt
+update
+
+# The first timestamp change doesn't have a saved hash to compare against, so
+# it always counts. The sleeps make sure the timestamp actually changes.
+sleep 1
+touch foo.txt
+tup scan
+if tup flags_exists; then
+	echo "*** foo.txt should be modified after its first timestamp change" 1>&2
+	exit 1
+fi
+update
+
+sleep 1
+touch foo.txt
+tup scan
+if tup flags_exists; then
+	:
+else
+	echo "*** foo.txt shouldn't be modified when only its timestamp changed" 1>&2
+	exit 1
+fi
+
+sleep 1
+echo bye > foo.txt
+tup scan
+if tup flags_exists; then
+	echo "*** foo.txt should be modified when its contents change" 1>&2
+	exit 1
+fi
+update
+if [ "`cat out.txt`" != "bye" ]; then
+	echo "*** out.txt should contain 'bye'" 1>&2
+	exit 1
+fi
+
+# A symlink is hashed by its link text, not by the file it points to.
+echo bye > bar.txt
+ln -s foo.txt link.txt
+tup scan
+update
+sleep 1
+touch -h link.txt
+tup scan
+update
+
+sleep 1
+rm link.txt
+ln -s foo.txt link.txt
+tup scan
+if tup flags_exists; then
+	:
+else
+	echo "*** link.txt shouldn't be modified when it points to the same file" 1>&2
+	exit 1
+fi
+
+sleep 1
+rm link.txt
+ln -s bar.txt link.txt
+tup scan
+if tup flags_exists; then
+	echo "*** link.txt should be modified when it points to a different file" 1>&2
+	exit 1
+fi
+update
+
+eotup
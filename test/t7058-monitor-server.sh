@@ -0,0 +1,69 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Run updates through the monitor's update server.
+
+. ./tup.sh
+check_monitor_supported
+(echo "[monitor]"; echo "server=1") >> .tup/options
+monitor
+
+if [ ! -S .tup/server ]; then
+	echo "Error: .tup/server socket should exist" 1>&2
+	exit 1
+fi
+
+cat > Tupfile << HERE
+: foreach *.c |> gcc -c %f -o %o |> %B.o
+HERE
+echo 'int foo(void) {return 0;}' > foo.c
+echo 'int bar(void) {return 0;}' > bar.c
+update
+check_exist foo.o bar.o
+
+# The server keeps its state between updates, so changes made in between
+# need to be picked up.
+echo 'int baz(void) {return 0;}' > baz.c
+rm bar.c
+update
+check_exist foo.o baz.o
+check_not_exist bar.o
+
+# A failed update shouldn't take down the server.
+echo 'int baz(void) {return 0;' > baz.c
+update_fail
+echo 'int baz(void) {return 1;}' > baz.c
+update
+check_exist baz.o
+
+# Updates from a subdirectory only build that part of the tree.
+mkdir sub
+echo ': foreach *.c |> gcc -c %f -o %o |> %B.o' > sub/Tupfile
+echo 'int sub(void) {return 0;}' > sub/sub.c
+cd sub
+update
+cd ..
+check_exist sub/sub.o
+
+stop_monitor
+if [ -S .tup/server ]; then
+	echo "Error: .tup/server socket should be removed" 1>&2
+	exit 1
+fi
+
+eotup
@@ -0,0 +1,64 @@
+#! /bin/sh -e
+# tup - A file-based build system
+#
+# Copyright (C) 2008-2016  Mike Shal <marfey@gmail.com>
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 2 as
+# published by the Free Software Foundation.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+# Interrupting a 'tup upd' that runs through the monitor's update server only
+# stops that update. The monitor has to keep running.
+
+. ./tup.sh
+check_monitor_supported
+(echo "[monitor]"; echo "server=1") >> .tup/options
+# The updater passes an interrupt along to its whole process group to stop
+# the jobs, so this uses the daemonized monitor, which has a group of its own.
+tup monitor
+tup waitmon
+monpid=`cat .tup/monitor.pid`
+
+sync=/tmp/tup-t7059-$$
+rm -rf $sync
+mkdir $sync
+cat > Tupfile << HERE
+: |> touch $sync/started; while [ ! -f $sync/done ]; do sleep 0.1; done; touch %o |> slow.txt
+: |> touch %o |> fast.txt
+HERE
+tup flush
+
+tup upd > /dev/null 2>&1 &
+pid=$!
+while [ ! -f $sync/started ]; do sleep 0.1; done
+kill -INT $pid
+if wait $pid; then
+	echo "Error: Expected the interrupted update to fail." 1>&2
+	exit 1
+fi
+if ! kill -0 $monpid 2>/dev/null; then
+	echo "Error: The monitor should still be running." 1>&2
+	exit 1
+fi
+
+touch $sync/done
+update
+rm -rf $sync
+check_exist slow.txt fast.txt
+
+tup flush
+if ! tup stop; then
+	echo "Error: The monitor should still be running." 1>&2
+	exit 1
+fi
+while kill -0 $monpid 2>/dev/null; do sleep 0.1; done
+eotup
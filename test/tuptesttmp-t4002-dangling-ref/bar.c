@@ -0,0 +1,2 @@
+#include "foo.h"
+void bar1(void) {}
@@ -0,0 +1,2 @@
+#include "foo.h"
+int main(void) {}
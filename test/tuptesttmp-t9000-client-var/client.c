@@ -0,0 +1,17 @@
+#include "../../tup_client.h"
+#include <stdio.h>
+
+int main(int argc, char **argv)
+{
+	const char *value;
+	if(tup_vardict_init() < 0)
+		return 1;
+	while(argc > 1) {
+		value = tup_config_var(argv[1], -1);
+		if(value)
+			printf("%s\n", value);
+		argc--;
+		argv++;
+	}
+	return 0;
+}